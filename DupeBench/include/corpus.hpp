@@ -0,0 +1,53 @@
+#ifndef CORPUS_HPP
+#define CORPUS_HPP
+
+enum size_distribution
+{
+	uniform_sizes,
+	// as many files between 1 KiB and 2 KiB as between 1 MiB and 2 MiB, which is closer to what real disks hold
+	log_uniform_sizes
+};
+
+struct corpus_options
+{
+	corpus_options() : seed(1), fan_out(4), depth(3), file_count(10000), min_size(1), max_size(1024 * 1024), sizes(log_uniform_sizes), duplicate_ratio(0.5), max_group_size(4), difference_offset(0)
+	{
+	}
+
+	unsigned __int64 seed;
+	// subdirectories in each directory, and how many levels of them there are below the root
+	size_t fan_out;
+	size_t depth;
+	size_t file_count;
+	unsigned __int64 min_size;
+	unsigned __int64 max_size;
+	size_distribution sizes;
+	// files are made in groups that share a size. of the files in a group after the first, this proportion are exact copies of the first;
+	// the rest are the same as the first up to difference_offset, and different from it, and from each other, from there on.
+	double duplicate_ratio;
+	// most files in a group, at most 256; the number in each group is picked evenly between 1 and this
+	size_t max_group_size;
+	// past the end of a file means its last byte
+	unsigned __int64 difference_offset;
+};
+
+struct corpus_statistics
+{
+	corpus_statistics() : directories(0), files(0), bytes(0), groups(0), duplicate_files(0)
+	{
+	}
+
+	unsigned __int64 directories;
+	unsigned __int64 files;
+	unsigned __int64 bytes;
+	// groups of more than one file
+	unsigned __int64 groups;
+	// files that are exact copies of the first in their group, which is how many DupeHunter should find beyond the first of each set.
+	// files of only a few bytes can also match files in other groups by chance.
+	unsigned __int64 duplicate_files;
+};
+
+// writes a directory tree full of files under root. the same options always give the same tree, byte for byte.
+corpus_statistics generate_corpus(const std::wstring& root, const corpus_options& options);
+
+#endif
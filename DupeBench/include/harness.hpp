@@ -0,0 +1,44 @@
+#ifndef HARNESS_HPP
+#define HARNESS_HPP
+
+struct harness_options
+{
+	harness_options() : cold_cache(false), runs(1)
+	{
+	}
+
+	// DupeHunter itself, what to pass it ahead of the corpus, and a name for the results so that runs can be told apart
+	std::wstring tool;
+	std::wstring arguments;
+	std::wstring corpus;
+	std::wstring label;
+	// throw the corpus out of the file cache before each run; otherwise there's an untimed run first to fill the cache
+	bool cold_cache;
+	size_t runs;
+};
+
+struct run_result
+{
+	run_result() : scan_seconds(0.0), compare_seconds(0.0), total_seconds(0.0), user_seconds(0.0), kernel_seconds(0.0), bytes_read(0), read_operations(0), write_operations(0), other_operations(0), peak_working_set(0), exit_code(0)
+	{
+	}
+
+	// the scan ends when DupeHunter says how many files it's comparing; everything after that counts as comparing
+	double scan_seconds;
+	double compare_seconds;
+	double total_seconds;
+	double user_seconds;
+	double kernel_seconds;
+	unsigned __int64 bytes_read;
+	// I/O calls made by the process, which is as close as Windows comes to counting its system calls
+	unsigned __int64 read_operations;
+	unsigned __int64 write_operations;
+	unsigned __int64 other_operations;
+	unsigned __int64 peak_working_set;
+	DWORD exit_code;
+};
+
+// runs DupeHunter against the corpus as many times as asked, and writes a JSON object for each run, one per line
+void run_harness(const harness_options& options, std::wostream& results);
+
+#endif
@@ -0,0 +1,260 @@
+// DupeBench.cpp : timings for DupeHunter's inner loops, and for the whole program against generated corpora, to check that changes are improvements
+//
+
+#include "stdafx.h"
+
+#include <sstream>
+
+#include "block_compare.hpp"
+#include "name_filter.hpp"
+#include "corpus.hpp"
+#include "harness.hpp"
+
+namespace {
+	double seconds_since(const LARGE_INTEGER& start) {
+		LARGE_INTEGER now = {0}, frequency = {0};
+		::QueryPerformanceCounter(&now);
+		::QueryPerformanceFrequency(&frequency);
+		return static_cast<double>(now.QuadPart - start.QuadPart) / static_cast<double>(frequency.QuadPart);
+	}
+
+	void report(const wchar_t* what, size_t buffer_count, unsigned __int64 bytes, double seconds) {
+		std::wcout << buffer_count << L" buffers, " << what << L": " << (static_cast<double>(bytes) / seconds) / (1024.0 * 1024.0 * 1024.0) << L" GiB/s" << std::endl;
+	}
+
+	// identical blocks are the worst case, as nothing gets to stop early
+	void benchmark_compare(size_t buffer_count, size_t block_size) {
+		std::vector<std::vector<unsigned __int8> > blocks(buffer_count, std::vector<unsigned __int8>(block_size));
+		unsigned __int64 state(0x9e3779b97f4a7c15ULL);
+		for(auto it(blocks[0].begin()), end(blocks[0].end()); it != end; ++it) {
+			state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+			*it = static_cast<unsigned __int8>(state >> 56);
+		}
+		std::vector<const unsigned __int8*> candidates;
+		for(size_t i(1); i < buffer_count; ++i) {
+			blocks[i] = blocks[0];
+			candidates.push_back(&blocks[i][0]);
+		}
+		const unsigned __int8* reference(&blocks[0][0]);
+
+		// enough passes to compare about 4 GiB, so that the timings aren't lost in the noise
+		const unsigned __int64 bytes_per_pass(static_cast<unsigned __int64>(candidates.size()) * block_size);
+		const size_t passes(static_cast<size_t>(std::max<unsigned __int64>(1, (4ULL << 30) / bytes_per_pass)));
+		volatile size_t sink(0);
+
+		LARGE_INTEGER start = {0};
+		::QueryPerformanceCounter(&start);
+		for(size_t pass(0); pass < passes; ++pass) {
+			size_t equal(0);
+			for(size_t i(0); i < candidates.size(); ++i) {
+				equal += 0 == std::memcmp(reference, candidates[i], block_size) ? 1 : 0;
+			}
+			sink += equal;
+		}
+		report(L"memcmp loop", buffer_count, bytes_per_pass * passes, seconds_since(start));
+
+		std::vector<unsigned __int64> matches(match_words(candidates.size()));
+		for(size_t k(0); k < kernel_count; ++k) {
+			const block_compare_kernel kernel(static_cast<block_compare_kernel>(k));
+			if(!kernel_supported(kernel)) {
+				continue;
+			}
+			::QueryPerformanceCounter(&start);
+			for(size_t pass(0); pass < passes; ++pass) {
+				sink += compare_one_to_many(kernel, reference, &candidates[0], candidates.size(), block_size, &matches[0]);
+			}
+			const std::string name(kernel_name(kernel));
+			report(std::wstring(name.begin(), name.end()).c_str(), buffer_count, bytes_per_pass * passes, seconds_since(start));
+		}
+	}
+
+	// the way names were filtered before name_filter: every wildcard turned into a regex, and each tried in turn
+	bool regex_permitted(const std::wstring& name, const std::vector<boost::wregex>& include_patterns, const std::vector<boost::wregex>& exclude_patterns) {
+		for(auto ipit(include_patterns.cbegin()), ipend(include_patterns.cend()); ipit != ipend; ++ipit) {
+			if(boost::regex_match(name, *ipit)) {
+				for(auto epit(exclude_patterns.cbegin()), epend(exclude_patterns.cend()); epit != epend; ++epit) {
+					if(boost::regex_match(name, *epit)) {
+						return false;
+					}
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void benchmark_filter(size_t name_count) {
+		static const wchar_t* const extensions[] = { L"jpg", L"jpeg", L"png", L"gif", L"bmp", L"tif", L"tiff", L"raw", L"cr2", L"nef",
+		                                             L"mp3", L"flac", L"ogg", L"wav", L"m4a", L"aac", L"wma", L"mp4", L"mkv", L"avi",
+		                                             L"mov", L"wmv", L"iso", L"zip", L"7z", L"rar", L"doc", L"docx", L"pdf", L"psd" };
+		static const wchar_t* const others[] = { L"IMG_????.*", L"DSC?????.*", L"*backup*", L"thumbs.db", L"desktop.ini", L"~$*", L"*.tmp", L"*~", L"*.bak", L"Copy of *" };
+		const size_t extension_count(sizeof(extensions) / sizeof(extensions[0]));
+
+		std::vector<std::wstring> include_wildcards;
+		for(size_t i(0); i < extension_count; ++i) {
+			include_wildcards.push_back(std::wstring(L"*.") + extensions[i]);
+		}
+		include_wildcards.insert(include_wildcards.end(), others, others + 4);
+		const std::vector<std::wstring> exclude_wildcards(others + 4, others + (sizeof(others) / sizeof(others[0])));
+
+		// a mix of names that the filter takes and names that it doesn't, about as long as real ones
+		static const wchar_t* const stems[] = { L"IMG_", L"DSC0", L"holiday ", L"Copy of report", L"track", L"~$budget", L"scan", L"backup of thesis" };
+		static const wchar_t* const rejected[] = { L"txt", L"cpp", L"obj", L"dll", L"exe", L"log" };
+		std::vector<std::wstring> names;
+		unsigned __int64 state(0x9e3779b97f4a7c15ULL);
+		for(size_t i(0); i < name_count; ++i) {
+			state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+			const size_t pick(static_cast<size_t>(state >> 33));
+			std::wstringstream name;
+			name << stems[pick % (sizeof(stems) / sizeof(stems[0]))] << (pick % 10000) << L'.';
+			if(pick % 3 == 0) {
+				name << rejected[(pick / 3) % (sizeof(rejected) / sizeof(rejected[0]))];
+			}
+			else {
+				name << extensions[(pick / 3) % extension_count];
+			}
+			names.push_back(name.str());
+		}
+
+		std::vector<boost::wregex> include_patterns;
+		std::vector<boost::wregex> exclude_patterns;
+		for(auto it(include_wildcards.cbegin()), end(include_wildcards.cend()); it != end; ++it) {
+			include_patterns.push_back(boost::wregex(name_filter::wildcard_to_regex(*it), boost::regex::icase));
+		}
+		for(auto it(exclude_wildcards.cbegin()), end(exclude_wildcards.cend()); it != end; ++it) {
+			exclude_patterns.push_back(boost::wregex(name_filter::wildcard_to_regex(*it), boost::regex::icase));
+		}
+
+		LARGE_INTEGER start = {0};
+		::QueryPerformanceCounter(&start);
+		size_t regex_permitted_count(0);
+		for(auto it(names.cbegin()), end(names.cend()); it != end; ++it) {
+			regex_permitted_count += regex_permitted(*it, include_patterns, exclude_patterns) ? 1 : 0;
+		}
+		const double regex_seconds(seconds_since(start));
+
+		::QueryPerformanceCounter(&start);
+		const name_filter filter(include_wildcards, std::vector<std::wstring>(), exclude_wildcards, std::vector<std::wstring>());
+		const double compile_seconds(seconds_since(start));
+		::QueryPerformanceCounter(&start);
+		size_t filter_permitted_count(0);
+		for(auto it(names.cbegin()), end(names.cend()); it != end; ++it) {
+			filter_permitted_count += filter.permitted(*it) ? 1 : 0;
+		}
+		const double filter_seconds(seconds_since(start));
+
+		const size_t pattern_count(include_wildcards.size() + exclude_wildcards.size());
+		std::wcout << name_count << L" names, " << pattern_count << L" wildcards, regex loop: " << (static_cast<double>(name_count) / regex_seconds) / 1.0e6 << L" M names/s" << std::endl;
+		std::wcout << name_count << L" names, " << pattern_count << L" wildcards, name_filter: " << (static_cast<double>(name_count) / filter_seconds) / 1.0e6 << L" M names/s, compiled in " << compile_seconds * 1000.0 << L" ms" << std::endl;
+		if(regex_permitted_count != filter_permitted_count) {
+			std::wcout << L"name_filter permitted " << filter_permitted_count << L" names but the regexes permitted " << regex_permitted_count << std::endl;
+		}
+	}
+
+	int generate(int argc, wchar_t* argv[]) {
+		namespace po = boost::program_options;
+
+		std::wstring root;
+		corpus_options options;
+		std::wstring sizes;
+
+		po::options_description desc("Allowed options for generate");
+		desc.add_options()
+			("help",              "show this message")
+			("root",              po::wvalue<std::wstring>(&root),                                                     "directory to write the corpus into")
+			("seed",              po::wvalue<unsigned __int64>(&options.seed)->default_value(1),                        "the same seed and options always give the same corpus")
+			("fan-out",           po::wvalue<size_t>(&options.fan_out)->default_value(4),                               "subdirectories in each directory")
+			("depth",             po::wvalue<size_t>(&options.depth)->default_value(3),                                 "levels of subdirectories below the root")
+			("files",             po::wvalue<size_t>(&options.file_count)->default_value(10000),                        "number of files to write")
+			("min-size",          po::wvalue<unsigned __int64>(&options.min_size)->default_value(1),                    "smallest file size")
+			("max-size",          po::wvalue<unsigned __int64>(&options.max_size)->default_value(1024 * 1024),          "largest file size")
+			("sizes",             po::wvalue<std::wstring>(&sizes)->default_value(L"log", "log"),                       "log: as many files in each doubling of size; uniform: as many files of each size")
+			("duplicate-ratio",   po::wvalue<double>(&options.duplicate_ratio)->default_value(0.5),                     "of the files that share a size with the first of their group, the proportion that are copies of it")
+			("group-size",        po::wvalue<size_t>(&options.max_group_size)->default_value(4),                        "most files to share a size, at most 256")
+			("difference-offset", po::wvalue<unsigned __int64>(&options.difference_offset)->default_value(0),           "where files that share a size but aren't copies first differ")
+		;
+		po::positional_options_description p;
+		p.add("root", 1);
+
+		po::variables_map vm;
+		po::store(po::wcommand_line_parser(argc, argv).options(desc).style(po::command_line_style::unix_style).positional(p).run(), vm);
+		po::notify(vm);
+
+		if(vm.count("help") || root.empty() || (sizes != L"log" && sizes != L"uniform")) {
+			std::cerr << desc << std::endl;
+			return -1;
+		}
+		options.sizes = sizes == L"uniform" ? uniform_sizes : log_uniform_sizes;
+
+		const corpus_statistics statistics(generate_corpus(root, options));
+		std::wcout << L"{\"directories\":" << statistics.directories
+		           << L",\"files\":" << statistics.files
+		           << L",\"bytes\":" << statistics.bytes
+		           << L",\"groups\":" << statistics.groups
+		           << L",\"duplicate_files\":" << statistics.duplicate_files
+		           << L"}" << std::endl;
+		return 0;
+	}
+
+	int run(int argc, wchar_t* argv[]) {
+		namespace po = boost::program_options;
+
+		harness_options options;
+		std::wstring cache;
+
+		po::options_description desc("Allowed options for run");
+		desc.add_options()
+			("help",   "show this message")
+			("tool",   po::wvalue<std::wstring>(&options.tool)->default_value(L"DupeHunter.exe", "DupeHunter.exe"), "the DupeHunter to time")
+			("corpus", po::wvalue<std::wstring>(&options.corpus),                                              "directory to search")
+			("args",   po::wvalue<std::wstring>(&options.arguments),                                           "options to pass to DupeHunter")
+			("label",  po::wvalue<std::wstring>(&options.label),                                               "name to put in the results")
+			("cache",  po::wvalue<std::wstring>(&cache)->default_value(L"warm", "warm"),                       "warm: time runs after an untimed one; cold: throw the corpus out of the file cache before each run")
+			("runs",   po::wvalue<size_t>(&options.runs)->default_value(3),                                    "number of runs to time")
+		;
+		po::positional_options_description p;
+		p.add("corpus", 1);
+
+		po::variables_map vm;
+		po::store(po::wcommand_line_parser(argc, argv).options(desc).style(po::command_line_style::unix_style).positional(p).run(), vm);
+		po::notify(vm);
+
+		if(vm.count("help") || options.corpus.empty() || (cache != L"warm" && cache != L"cold")) {
+			std::cerr << desc << std::endl;
+			return -1;
+		}
+		options.cold_cache = cache == L"cold";
+
+		run_harness(options, std::wcout);
+		return 0;
+	}
+}
+
+// with no arguments, times the inner loops. "generate" writes a corpus, and "run" times DupeHunter against one,
+// with a line of JSON for each run so that the results of different builds can be put side by side.
+int wmain(int argc, wchar_t* argv[])
+try {
+	if(argc < 2) {
+		const size_t buffer_counts[] = { 2, 16, 1024 };
+		for(size_t i(0); i < sizeof(buffer_counts) / sizeof(buffer_counts[0]); ++i) {
+			benchmark_compare(buffer_counts[i], 64 * 1024);
+		}
+		benchmark_filter(1000000);
+		return 0;
+	}
+	// the command takes the place of the program name, which the option parser skips
+	const std::wstring command(argv[1]);
+	if(command == L"generate") {
+		return generate(argc - 1, argv + 1);
+	}
+	if(command == L"run") {
+		return run(argc - 1, argv + 1);
+	}
+	std::cerr << "usage: DupeBench [generate|run] [options]" << std::endl;
+	return -1;
+}
+catch(std::exception& e) {
+	std::cerr << "Caught exception" << std::endl;
+	std::cerr << e.what() << std::endl;
+	return -2;
+}
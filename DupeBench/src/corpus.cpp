@@ -0,0 +1,145 @@
+// corpus.cpp : makes directory trees of files with known duplicates in them, for DupeHunter to be timed against
+//
+
+#include "stdafx.h"
+
+#include <cmath>
+#include <sstream>
+
+#include "corpus.hpp"
+
+namespace {
+	// written a chunk at a time; a multiple of 8, so that every chunk starts on a whole word of content
+	const size_t chunk_size(1024 * 1024);
+
+	unsigned __int64 next_random(unsigned __int64& state) {
+		state = (state * 6364136223846793005ULL) + 1442695040888963407ULL;
+		return state;
+	}
+
+	// evenly between 0 and 1
+	double next_fraction(unsigned __int64& state) {
+		return static_cast<double>(next_random(state) >> 11) / static_cast<double>(1ULL << 53);
+	}
+
+	unsigned __int64 mix(unsigned __int64 value) {
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+		return value ^ (value >> 31);
+	}
+
+	// any word of a file's content can be worked out on its own, so a file can be written a chunk at a time without keeping any state
+	void fill(unsigned __int8* buffer, size_t length, unsigned __int64 position, unsigned __int64 content_seed) {
+		for(size_t i(0); i < length; i += sizeof(unsigned __int64)) {
+			const unsigned __int64 word(mix(content_seed + (((position + i) / sizeof(unsigned __int64)) * 0x9e3779b97f4a7c15ULL)));
+			std::memcpy(buffer + i, &word, std::min(sizeof(word), length - i));
+		}
+	}
+
+	unsigned __int64 pick_size(unsigned __int64& state, const corpus_options& options) {
+		const double fraction(next_fraction(state));
+		unsigned __int64 size(0);
+		if(options.sizes == uniform_sizes) {
+			size = options.min_size + static_cast<unsigned __int64>(fraction * static_cast<double>(options.max_size - options.min_size + 1));
+		}
+		else {
+			const double low(std::log(static_cast<double>(options.min_size)));
+			const double high(std::log(static_cast<double>(options.max_size) + 1.0));
+			size = static_cast<unsigned __int64>(std::exp(low + (fraction * (high - low))));
+		}
+		return std::max(options.min_size, std::min(options.max_size, size));
+	}
+
+	void fail(const wchar_t* action, const std::wstring& path) {
+		std::wcerr << L"Could not " << action << L" " << path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+		throw std::exception("could not write the corpus");
+	}
+
+	void create_directory(const std::wstring& path) {
+		if(FALSE == ::CreateDirectoryW(path.c_str(), nullptr) && ::GetLastError() != ERROR_ALREADY_EXISTS) {
+			fail(L"create directory", path);
+		}
+	}
+
+	// variant 0 is the group's first file; any other variant has its number written over the content from the difference offset on
+	void write_file(const std::wstring& path, unsigned __int64 size, unsigned __int64 content_seed, unsigned __int64 difference_offset, size_t variant, std::vector<unsigned __int8>& buffer) {
+		HANDLE file(::CreateFileW(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0));
+		if(file == INVALID_HANDLE_VALUE) {
+			fail(L"create", path);
+		}
+		ON_BLOCK_EXIT([=] { ::CloseHandle(file); });
+		const unsigned __int64 difference(std::min(difference_offset, size - 1));
+		for(unsigned __int64 position(0); position < size; position += chunk_size) {
+			const size_t length(static_cast<size_t>(std::min<unsigned __int64>(chunk_size, size - position)));
+			fill(&buffer[0], length, position, content_seed);
+			if(variant != 0) {
+				const unsigned __int64 marker(variant);
+				for(size_t i(0); i < sizeof(marker); ++i) {
+					if(difference + i >= position && difference + i < position + length) {
+						buffer[static_cast<size_t>(difference + i - position)] ^= static_cast<unsigned __int8>(marker >> (i * 8));
+					}
+				}
+			}
+			DWORD written(0);
+			if(FALSE == ::WriteFile(file, &buffer[0], static_cast<DWORD>(length), &written, nullptr) || written != length) {
+				fail(L"write", path);
+			}
+		}
+	}
+}
+
+corpus_statistics generate_corpus(const std::wstring& root, const corpus_options& options) {
+	if(options.min_size == 0 || options.max_size < options.min_size || options.max_group_size == 0 || options.max_group_size > 256) {
+		throw std::exception("the corpus options are out of range");
+	}
+	corpus_statistics statistics;
+
+	// breadth first, so that every directory's parent is made before it is
+	std::vector<std::wstring> directories(1, root);
+	create_directory(root);
+	size_t level_start(0);
+	for(size_t level(0); level < options.depth && options.fan_out != 0; ++level) {
+		const size_t level_end(directories.size());
+		for(size_t parent(level_start); parent < level_end; ++parent) {
+			for(size_t child(0); child < options.fan_out; ++child) {
+				std::wstringstream name;
+				name << directories[parent] << L"\\d" << child;
+				directories.push_back(name.str());
+				create_directory(directories.back());
+			}
+		}
+		level_start = level_end;
+	}
+	statistics.directories = directories.size();
+
+	std::vector<unsigned __int8> buffer(chunk_size);
+	unsigned __int64 state(options.seed);
+	size_t group(0);
+	while(statistics.files < options.file_count) {
+		const unsigned __int64 size(pick_size(state, options));
+		const size_t members(std::min(static_cast<size_t>(1 + (next_random(state) >> 33) % options.max_group_size), static_cast<size_t>(options.file_count - statistics.files)));
+		const unsigned __int64 content_seed(mix(options.seed ^ (group * 0x632be59bd9b4e019ULL)));
+		size_t variants(0);
+		for(size_t member(0); member < members; ++member) {
+			size_t variant(0);
+			if(member != 0) {
+				if(next_fraction(state) < options.duplicate_ratio) {
+					++statistics.duplicate_files;
+				}
+				else {
+					variant = ++variants;
+				}
+			}
+			std::wstringstream path;
+			path << directories[static_cast<size_t>((next_random(state) >> 33) % directories.size())] << L"\\f" << statistics.files << L".bin";
+			write_file(path.str(), size, content_seed, options.difference_offset, variant, buffer);
+			++statistics.files;
+			statistics.bytes += size;
+		}
+		if(members > 1) {
+			++statistics.groups;
+		}
+		++group;
+	}
+	return statistics;
+}
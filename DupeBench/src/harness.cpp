@@ -0,0 +1,199 @@
+// harness.cpp : runs DupeHunter against a corpus and records what each run cost
+//
+
+#include "stdafx.h"
+
+#include <sstream>
+#include <iomanip>
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+#include "harness.hpp"
+
+namespace {
+	// the line DupeHunter prints once it has finished scanning, whichever output format it's using
+	const char scan_finished_marker[] = "with non-unique sizes";
+
+	double seconds_between(const LARGE_INTEGER& start, const LARGE_INTEGER& end) {
+		LARGE_INTEGER frequency = {0};
+		::QueryPerformanceFrequency(&frequency);
+		return static_cast<double>(end.QuadPart - start.QuadPart) / static_cast<double>(frequency.QuadPart);
+	}
+
+	double seconds_of(const FILETIME& time) {
+		return static_cast<double>((static_cast<unsigned __int64>(time.dwHighDateTime) << 32) | time.dwLowDateTime) / 1.0e7;
+	}
+
+	// opening a file without buffering makes the cache manager write back and throw away whatever it holds of it,
+	// so that the next run has to go to the disk. this needs no privileges, unlike emptying the whole standby list.
+	void evict_from_cache(const std::wstring& root) {
+		std::vector<std::wstring> pending(1, root);
+		while(!pending.empty()) {
+			const std::wstring directory(pending.back());
+			pending.pop_back();
+			WIN32_FIND_DATAW data = {0};
+			HANDLE search(::FindFirstFileW((directory + L"\\*").c_str(), &data));
+			if(search == INVALID_HANDLE_VALUE) {
+				std::wcerr << L"Could not list " << directory << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+				continue;
+			}
+			ON_BLOCK_EXIT([=] { ::FindClose(search); });
+			do {
+				const std::wstring name(data.cFileName);
+				if(name == L"." || name == L"..") {
+					continue;
+				}
+				const std::wstring path(directory + L"\\" + name);
+				if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+					pending.push_back(path);
+					continue;
+				}
+				HANDLE file(::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, 0));
+				if(file != INVALID_HANDLE_VALUE) {
+					::CloseHandle(file);
+				}
+			}
+			while(FALSE != ::FindNextFileW(search, &data));
+		}
+	}
+
+	run_result run_once(const harness_options& options) {
+		SECURITY_ATTRIBUTES inheritable = { sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+		HANDLE output_read(INVALID_HANDLE_VALUE);
+		HANDLE output_write(INVALID_HANDLE_VALUE);
+		if(FALSE == ::CreatePipe(&output_read, &output_write, &inheritable, 0)) {
+			throw std::exception("could not create a pipe for the tool's output");
+		}
+		ON_BLOCK_EXIT([&] {
+			::CloseHandle(output_read);
+			if(output_write != INVALID_HANDLE_VALUE) {
+				::CloseHandle(output_write);
+			}
+		});
+		::SetHandleInformation(output_read, HANDLE_FLAG_INHERIT, 0);
+
+		// both streams go down the same pipe, as the status lines go to standard error when the duplicates are going to standard output as JSON
+		STARTUPINFOW startup = { sizeof(STARTUPINFOW) };
+		startup.dwFlags = STARTF_USESTDHANDLES;
+		startup.hStdInput = ::GetStdHandle(STD_INPUT_HANDLE);
+		startup.hStdOutput = output_write;
+		startup.hStdError = output_write;
+		const std::wstring command(L"\"" + options.tool + L"\" " + options.arguments + L" \"" + options.corpus + L"\"");
+		std::vector<wchar_t> command_line(command.begin(), command.end());
+		command_line.push_back(L'\0');
+
+		run_result result;
+		PROCESS_INFORMATION process = {0};
+		LARGE_INTEGER start = {0};
+		::QueryPerformanceCounter(&start);
+		if(FALSE == ::CreateProcessW(nullptr, &command_line[0], nullptr, nullptr, TRUE, 0, nullptr, nullptr, &startup, &process)) {
+			std::wcerr << L"Could not run " << command << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+			throw std::exception("could not run the tool");
+		}
+		ON_BLOCK_EXIT([=] {
+			::CloseHandle(process.hThread);
+			::CloseHandle(process.hProcess);
+		});
+		// only the tool may hold the writing end now, so that the pipe breaks when it exits
+		::CloseHandle(output_write);
+		output_write = INVALID_HANDLE_VALUE;
+
+		LARGE_INTEGER scan_finished(start);
+		bool scanned(false);
+		std::string unmatched;
+		std::vector<char> buffer(64 * 1024);
+		DWORD read(0);
+		while(FALSE != ::ReadFile(output_read, &buffer[0], static_cast<DWORD>(buffer.size()), &read, nullptr) && read != 0) {
+			if(scanned) {
+				continue;
+			}
+			unmatched.append(&buffer[0], read);
+			if(unmatched.find(scan_finished_marker) != std::string::npos) {
+				::QueryPerformanceCounter(&scan_finished);
+				scanned = true;
+			}
+			else if(unmatched.size() > sizeof(scan_finished_marker)) {
+				unmatched.erase(0, unmatched.size() - sizeof(scan_finished_marker));
+			}
+		}
+		::WaitForSingleObject(process.hProcess, INFINITE);
+		LARGE_INTEGER end = {0};
+		::QueryPerformanceCounter(&end);
+		if(!scanned) {
+			scan_finished = end;
+		}
+
+		result.scan_seconds = seconds_between(start, scan_finished);
+		result.compare_seconds = seconds_between(scan_finished, end);
+		result.total_seconds = seconds_between(start, end);
+		::GetExitCodeProcess(process.hProcess, &result.exit_code);
+		FILETIME created = {0}, exited = {0}, kernel = {0}, user = {0};
+		if(FALSE != ::GetProcessTimes(process.hProcess, &created, &exited, &kernel, &user)) {
+			result.user_seconds = seconds_of(user);
+			result.kernel_seconds = seconds_of(kernel);
+		}
+		IO_COUNTERS io = {0};
+		if(FALSE != ::GetProcessIoCounters(process.hProcess, &io)) {
+			result.bytes_read = io.ReadTransferCount;
+			result.read_operations = io.ReadOperationCount;
+			result.write_operations = io.WriteOperationCount;
+			result.other_operations = io.OtherOperationCount;
+		}
+		PROCESS_MEMORY_COUNTERS memory = { sizeof(PROCESS_MEMORY_COUNTERS) };
+		if(FALSE != ::GetProcessMemoryInfo(process.hProcess, &memory, sizeof(memory))) {
+			result.peak_working_set = memory.PeakWorkingSetSize;
+		}
+		return result;
+	}
+
+	void append_json_string(std::wostream& text, const std::wstring& s) {
+		text << L'"';
+		for(auto it(s.cbegin()), end(s.cend()); it != end; ++it) {
+			if(*it == L'"' || *it == L'\\') {
+				text << L'\\' << *it;
+			}
+			else if(*it < 0x20) {
+				text << L"\\u" << std::hex << std::setw(4) << std::setfill(L'0') << static_cast<unsigned int>(*it) << std::dec << std::setfill(L' ');
+			}
+			else {
+				text << *it;
+			}
+		}
+		text << L'"';
+	}
+}
+
+void run_harness(const harness_options& options, std::wostream& results) {
+	if(!options.cold_cache) {
+		run_once(options);
+	}
+	for(size_t run(0); run < options.runs; ++run) {
+		if(options.cold_cache) {
+			evict_from_cache(options.corpus);
+		}
+		const run_result result(run_once(options));
+		std::wstringstream line;
+		line << L"{\"label\":";
+		append_json_string(line, options.label);
+		line << L",\"corpus\":";
+		append_json_string(line, options.corpus);
+		line << L",\"arguments\":";
+		append_json_string(line, options.arguments);
+		line << L",\"cache\":\"" << (options.cold_cache ? L"cold" : L"warm") << L"\""
+		     << L",\"run\":" << run
+		     << L",\"exit_code\":" << static_cast<int>(result.exit_code)
+		     << L",\"scan_seconds\":" << result.scan_seconds
+		     << L",\"compare_seconds\":" << result.compare_seconds
+		     << L",\"total_seconds\":" << result.total_seconds
+		     << L",\"user_seconds\":" << result.user_seconds
+		     << L",\"kernel_seconds\":" << result.kernel_seconds
+		     << L",\"bytes_read\":" << result.bytes_read
+		     << L",\"read_operations\":" << result.read_operations
+		     << L",\"write_operations\":" << result.write_operations
+		     << L",\"other_operations\":" << result.other_operations
+		     << L",\"peak_working_set\":" << result.peak_working_set
+		     << L"}";
+		results << line.str() << std::endl;
+	}
+}
@@ -0,0 +1,35 @@
+#ifndef BLOCK_COMPARE_HPP
+#define BLOCK_COMPARE_HPP
+
+// the instruction sets compare_one_to_many has kernels for, narrowest first
+enum block_compare_kernel
+{
+	scalar_kernel,
+	sse2_kernel,
+	avx2_kernel,
+	avx512_kernel,
+	kernel_count
+};
+
+// whether this build has the kernel and this processor can run it
+bool kernel_supported(block_compare_kernel kernel);
+// the widest supported kernel, which is what compare_one_to_many uses unless it's told otherwise
+block_compare_kernel best_kernel();
+const char* kernel_name(block_compare_kernel kernel);
+
+// how many words of match bits compare_one_to_many needs for candidate_count candidates
+inline size_t match_words(size_t candidate_count) {
+	return (candidate_count + 63) / 64;
+}
+
+inline bool is_match(const unsigned __int64* matches, size_t candidate) {
+	return 0 != (matches[candidate / 64] & (1ULL << (candidate % 64)));
+}
+
+// compares the first length bytes of reference with those of every candidate, in one pass over the reference.
+// bit i of the match bits is set if candidate i is identical; matches needs match_words(candidate_count) words.
+// returns the offset of the first byte at which any candidate differs, or length if none of them do.
+size_t compare_one_to_many(const unsigned __int8* reference, const unsigned __int8* const* candidates, size_t candidate_count, size_t length, unsigned __int64* matches);
+size_t compare_one_to_many(block_compare_kernel kernel, const unsigned __int8* reference, const unsigned __int8* const* candidates, size_t candidate_count, size_t length, unsigned __int64* matches);
+
+#endif
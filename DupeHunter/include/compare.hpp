@@ -0,0 +1,54 @@
+#ifndef COMPARE_HPP
+#define COMPARE_HPP
+
+template<typename T>
+T round_to_next_multiple(T num, T factor) {
+	return ((num + factor - 1) / factor) * factor;
+}
+
+template<typename T>
+T round_to_previous_multiple(T num, T factor) {
+	return (num / factor) * factor;
+}
+
+struct hash_cache;
+
+struct compare_options
+{
+	compare_options() : queue_depth(1), map_files(false), max_open_files(512), physical_order(false), sample_count(0), fingerprint(false), verify(false), cache(nullptr)
+	{
+	}
+
+	// the most reads to keep in flight at once across a group; 1 reads each file in turn, synchronously
+	size_t queue_depth;
+	// compare straight out of mappings of the files rather than reading them into the buffer
+	bool map_files;
+	// groups with more files than this are compared a wave at a time, carrying just one file from each set found so far between waves
+	size_t max_open_files;
+	// read files, and start on groups, in the order their data sits on disk, and match up block clones without reading them
+	bool physical_order;
+	// how many blocks of each file the prefilter samples before a group is compared in full; 0 turns it off
+	size_t sample_count;
+	// group files by a hash of their contents instead of comparing them, and only compare the groups that share a hash if verify is set
+	bool fingerprint;
+	bool verify;
+	// hashes from earlier runs; may be null
+	hash_cache* cache;
+};
+
+// a cheap digest of a block, only good for bucketing blocks that might be equal; matches still need confirming with memcmp
+unsigned __int64 block_digest(const unsigned __int8* block, size_t length);
+
+// splits members, indices into buffers and bytes_read in ascending order, according to the contents of the block each has just read, appending
+// every resulting class with more than one member to refined. members from first_reference on are references, which are never compared with each other.
+void split_class(const std::vector<size_t>& members, const std::vector<unsigned __int8*>& buffers, const std::vector<DWORD>& bytes_read, size_t first_reference, std::vector<std::vector<size_t> >& refined);
+
+// how much buffer n_way_compare can make use of for file_count files of file_size bytes, given at most total_buffer_size
+size_t desired_buffer_size(unsigned __int64 file_size, size_t file_count, size_t total_buffer_size);
+
+// splits names into sets of identical files, in name order. the last reference_count names are references: they are only ever compared with
+// the names before them, never with each other, and each stops being read as soon as it has matched or differed from every other file left.
+// names that can't be opened, or that are hard links to a name already given, are taken out of names.
+std::vector<std::vector<std::wstring> > n_way_compare(unsigned __int64 file_size, std::vector<std::wstring>& names, void* buffer, const size_t total_buffer_size, const compare_options& options, size_t reference_count = 0);
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef DEDUPE_HPP
+#define DEDUPE_HPP
+
+#include "traversal.hpp"
+#include "scheduler.hpp"
+
+enum dedupe_method
+{
+	no_dedupe,
+	// the copies share the first file's clusters, copy-on-write; ReFS only
+	reflink_dedupe,
+	// the copies are replaced by hard links to the first file
+	hardlink_dedupe
+};
+
+struct dedupe_options
+{
+	dedupe_options() : method(no_dedupe), dry_run(false), compared_since(0)
+	{
+	}
+
+	dedupe_method method;
+	// say what would be done, without doing it
+	bool dry_run;
+	// where to record what was done, so that it can be undone; empty for nowhere
+	std::wstring undo_log_path;
+	// a file written at or after this time (a FILETIME) may have changed since it was compared, so it's left alone
+	unsigned __int64 compared_since;
+};
+
+struct dedupe_statistics
+{
+	dedupe_statistics() : files_deduplicated(0), files_skipped(0), bytes_reclaimed(0)
+	{
+	}
+
+	unsigned __int64 files_deduplicated;
+	unsigned __int64 files_skipped;
+	unsigned __int64 bytes_reclaimed;
+};
+
+// makes every file in a duplicate set after the first share the first file's data, without reading any of them again.
+// each set is a batch: the first file is opened and checked once, and then every other file is dealt with against it.
+// batches run in parallel, while comparing carries on.
+struct deduplicator
+{
+	deduplicator(const dedupe_options& options_, const file_table& table_, std::wostream& messages_);
+	~deduplicator();
+
+	// queues every set in a group; doesn't wait for any of them
+	void add(unsigned __int64 file_size, const duplicate_sets_type& duplicates);
+
+	// waits until every set queued so far has been dealt with
+	dedupe_statistics finish();
+
+private:
+	void deduplicate_set(unsigned __int64 file_size, const std::vector<file_table::file_index>& files);
+	void message(const std::wstring& text);
+	void record(const std::wstring& source, const std::wstring& target, unsigned __int64 file_size);
+	void skipped();
+
+	const dedupe_options options;
+	const file_table& table;
+	std::wostream& messages;
+	HANDLE undo_log;
+	CRITICAL_SECTION lock;
+	dedupe_statistics statistics;
+	// declared last, so that any batches still running are finished before the rest goes away
+	util::work_stealing_pool pool;
+
+	deduplicator(const deduplicator&);
+	deduplicator& operator=(const deduplicator&);
+};
+
+// undoes everything in an undo log, most recent first, by giving each file that was deduplicated a copy of its data of its own again.
+// returns false if anything couldn't be undone.
+bool undo_dedupe(const std::wstring& undo_log_path, std::wostream& messages);
+
+#endif
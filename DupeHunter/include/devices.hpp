@@ -0,0 +1,30 @@
+#ifndef DEVICES_HPP
+#define DEVICES_HPP
+
+// the disk behind a volume. volumes on the same disk share its heads (or its queue), so it's disks, not volumes, that reads are limited by.
+struct device_info
+{
+	static const DWORD no_disk = ~0UL;
+
+	device_info() : disk_number(no_disk), volume(0), seek_penalty_known(false), seek_penalty(false)
+	{
+	}
+
+	// no_disk for volumes that aren't a single local disk, such as network shares and volumes spanning several disks
+	DWORD disk_number;
+	// the serial number of the volume that the device was found through, for when there's no disk number to tell devices apart by
+	DWORD volume;
+	bool seek_penalty_known;
+	// true for rotational disks
+	bool seek_penalty;
+};
+
+// finds out which disk the volume that handle (a file or directory on it) is on lives on, and whether it's rotational.
+// whatever can't be found out is left unknown.
+device_info identify_device(HANDLE handle, DWORD volume);
+
+// how many size groups may be compared on the device at once: one for a rotational disk, so that its heads aren't dragged between
+// groups, and plenty for solid state disks, which only get faster with deeper queues. devices that won't say get a few.
+size_t device_concurrency(const device_info& device);
+
+#endif
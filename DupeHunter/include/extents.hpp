@@ -0,0 +1,25 @@
+#ifndef EXTENTS_HPP
+#define EXTENTS_HPP
+
+// where a file's data lives on its volume, as runs of clusters
+struct file_extents
+{
+	file_extents() : volume(0)
+	{
+	}
+
+	// where reads of the file start on disk. files with no clusters of their own (small enough to live in the MFT, or entirely sparse) sort last.
+	unsigned __int64 first_cluster() const;
+
+	// true if there are clusters, and the other file's data is those very same clusters, as with block clones, so the two are necessarily identical
+	bool shares_all_clusters(const file_extents& rhs) const;
+
+	DWORD volume;
+	// (first cluster, cluster count) for each run in file order; holes have a first cluster of ~0
+	std::vector<std::pair<unsigned __int64, unsigned __int64> > runs;
+};
+
+// false if the file system won't say where the file is, as for network shares
+bool query_extents(HANDLE file, file_extents& extents);
+
+#endif
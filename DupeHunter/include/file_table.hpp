@@ -0,0 +1,96 @@
+#ifndef FILE_TABLE_HPP
+#define FILE_TABLE_HPP
+
+#include "devices.hpp"
+
+// everything the scan found, without a path string per file. each directory is stored once, as its parent and its own name,
+// and each file as a fixed-size record naming its directory. the names themselves all live in an arena of fixed-size blocks.
+// full paths are only put back together when a file has to be opened or reported.
+struct file_table
+{
+	typedef unsigned __int32 directory_index;
+	typedef unsigned __int32 file_index;
+	typedef unsigned __int32 device_index;
+
+	static const directory_index no_directory = 0xffffffffUL;
+
+	struct directory_record
+	{
+		unsigned __int64 name;
+		directory_index parent;
+		unsigned __int32 name_length;
+		// file ids are only unique within a volume, and every file in a directory is on the same one
+		unsigned __int32 volume;
+		// the disk the volume is on, so that reads can be queued by disk
+		device_index device;
+	};
+
+	struct file_record
+	{
+		unsigned __int64 size;
+		// 0 if it isn't known
+		unsigned __int64 file_id;
+		unsigned __int64 name;
+		directory_index directory;
+		unsigned __int32 name_length;
+	};
+
+	// a directory with no parent has its whole path as its name
+	directory_index add_directory(directory_index parent, const wchar_t* name, size_t name_length, unsigned __int32 volume, device_index device);
+	device_index add_device(const device_info& info);
+	file_index add_file(directory_index directory, const wchar_t* name, size_t name_length, unsigned __int64 size, unsigned __int64 file_id);
+
+	// moves every file in other into this table, leaving other empty. the files' directories must already be in this table,
+	// which is how the scan threads work: one shared table of directories, and a table of files per thread.
+	// returns the index that other's first file now has.
+	file_index take_files(file_table& other);
+
+	const directory_record& directory(directory_index index) const
+	{
+		return directories[index];
+	}
+
+	const file_record& file(file_index index) const
+	{
+		return files[index];
+	}
+
+	const device_info& device(device_index index) const
+	{
+		return devices[index];
+	}
+
+	size_t device_count() const
+	{
+		return devices.size();
+	}
+
+	size_t file_count() const
+	{
+		return files.size();
+	}
+
+	std::wstring directory_path(directory_index index) const;
+	std::wstring path_of(file_index index) const;
+
+	void swap(file_table& rhs)
+	{
+		directories.swap(rhs.directories);
+		devices.swap(rhs.devices);
+		files.swap(rhs.files);
+		blocks.swap(rhs.blocks);
+	}
+
+private:
+	const wchar_t* name_at(unsigned __int64 position) const;
+	unsigned __int64 store_name(const wchar_t* name, size_t name_length);
+	void append_path(std::wstring& path, directory_index index) const;
+
+	std::deque<directory_record> directories;
+	std::vector<device_info> devices;
+	std::deque<file_record> files;
+	// a name's position is its block number in the top bits and its offset within the block in the bottom ones
+	std::vector<std::vector<wchar_t> > blocks;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef FINGERPRINT_HPP
+#define FINGERPRINT_HPP
+
+// identifies a particular version of a particular file. if any of these change, whatever was cached about the file is stale.
+struct file_identity
+{
+	unsigned __int64 volume;
+	unsigned __int64 file_id;
+	unsigned __int64 size;
+	unsigned __int64 last_write_time;
+	unsigned __int64 change_time;
+
+	bool operator==(const file_identity& rhs) const
+	{
+		return volume == rhs.volume && file_id == rhs.file_id && size == rhs.size && last_write_time == rhs.last_write_time && change_time == rhs.change_time;
+	}
+};
+
+struct content_hash
+{
+	unsigned __int64 low;
+	unsigned __int64 high;
+
+	bool operator==(const content_hash& rhs) const
+	{
+		return low == rhs.low && high == rhs.high;
+	}
+
+	bool operator<(const content_hash& rhs) const
+	{
+		return high != rhs.high ? high < rhs.high : low < rhs.low;
+	}
+};
+
+// content hashes from earlier runs, kept in a file that is mapped read-only as an open-addressed table, so that any number of
+// threads can look things up without taking a lock. hashes computed during this run are kept to one side and written out,
+// together with everything that was already there, by save().
+struct hash_cache
+{
+	explicit hash_cache(const std::wstring& path_);
+	~hash_cache();
+
+	bool find(const file_identity& identity, content_hash& hash) const;
+	void insert(const file_identity& identity, const content_hash& hash);
+	void save();
+
+	unsigned __int64 hits() const;
+	unsigned __int64 misses() const;
+
+private:
+	struct entry
+	{
+		file_identity identity;
+		content_hash hash;
+	};
+
+	struct header
+	{
+		unsigned __int32 magic;
+		unsigned __int32 version;
+		unsigned __int64 slot_count;
+		unsigned __int64 entry_count;
+	};
+
+	static size_t slot_for(const file_identity& identity, unsigned __int64 slot_count);
+
+	std::wstring path;
+	util::mapped_file mapped;
+	const header* table_header;
+	const entry* slots;
+	CRITICAL_SECTION lock;
+	std::vector<entry> added;
+	mutable volatile __int64 hit_count;
+	mutable volatile __int64 miss_count;
+
+	hash_cache(const hash_cache&);
+	hash_cache& operator=(const hash_cache&);
+};
+
+// the identity of an open file, as far as the cache is concerned
+bool identify_file(HANDLE file, file_identity& identity);
+
+// hashes each file in the group (or takes the hash from the cache, when the file hasn't changed) and splits the group on the results.
+// returns the groups of more than one member, as indices into names in ascending order, ordered by their first member.
+// further names for a file already in the group are left out, as n_way_compare does for hard links.
+std::vector<std::vector<size_t> > fingerprint_groups(const std::vector<std::wstring>& names, void* buffer, size_t buffer_size, hash_cache* cache);
+
+#endif
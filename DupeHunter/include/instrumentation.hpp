@@ -0,0 +1,142 @@
+#ifndef INSTRUMENTATION_HPP
+#define INSTRUMENTATION_HPP
+
+// counters and timers for finding out where a run's time goes. each thread adds to totals of its own, so nothing is shared while the
+// work is going on, and everything sits behind a single flag: while it's off, each counter or timer costs a load and a branch.
+namespace instrumentation
+{
+	enum timer
+	{
+		// listing directories, including filtering the names in them
+		traversal_timer,
+		filter_timer,
+		open_timer,
+		// reading, or waiting on reads that are in flight
+		read_timer,
+		// comparing blocks once they've been read, or hashing them
+		compare_timer,
+		report_timer,
+		timer_count
+	};
+
+	enum counter
+	{
+		directories_listed,
+		names_filtered,
+		files_found,
+		files_opened,
+		read_calls,
+		bytes_read,
+		groups_compared,
+		files_compared,
+		// the size of every file in each group that has been compared, read or not
+		bytes_compared,
+		counter_count
+	};
+
+	// the parts of a run, one after the other
+	enum phase
+	{
+		scan_phase,
+		compare_phase,
+		// whatever's left after comparing, such as saving the hash cache
+		finish_phase,
+		done_phase,
+		phase_count = done_phase
+	};
+
+	struct thread_totals
+	{
+		unsigned __int64 counters[counter_count];
+		unsigned __int64 ticks[timer_count];
+		// keeps each thread's totals off the cache lines of the next thread's
+		unsigned __int8 padding[64];
+	};
+
+	extern bool enabled;
+
+	// must be called before any other threads are started
+	void turn_on();
+
+	// the calling thread's totals, made the first time it asks
+	thread_totals& this_thread();
+
+	inline void count(counter which, unsigned __int64 amount = 1)
+	{
+		if(enabled) {
+			this_thread().counters[which] += amount;
+		}
+	}
+
+	inline unsigned __int64 now()
+	{
+		LARGE_INTEGER ticks = {0};
+		::QueryPerformanceCounter(&ticks);
+		return static_cast<unsigned __int64>(ticks.QuadPart);
+	}
+
+	// adds the time from construction to destruction to one of the calling thread's timers
+	struct scoped_timer
+	{
+		explicit scoped_timer(timer which_) : which(which_), start(enabled ? now() : 0)
+		{
+		}
+
+		~scoped_timer()
+		{
+			if(start != 0) {
+				this_thread().ticks[which] += now() - start;
+			}
+		}
+
+	private:
+		const timer which;
+		const unsigned __int64 start;
+
+		scoped_timer(const scoped_timer&);
+		scoped_timer& operator=(const scoped_timer&);
+	};
+
+	// runs f under one of the calling thread's timers, handing back whatever it returns
+	template<typename F>
+	auto timed(timer which, F f) -> decltype(f())
+	{
+		scoped_timer timing(which);
+		return f();
+	}
+
+	// ends the phase that's under way and starts the next
+	void enter_phase(phase next);
+
+	// how much comparing there is to do in all, so that progress can be measured against it
+	void set_compare_totals(size_t group_count, unsigned __int64 byte_count);
+
+	// a group's time from starting to being finished with, which goes into a latency histogram for groups of its size
+	void record_group(unsigned __int64 file_size, size_t file_count, unsigned __int64 ticks);
+
+	// everything gathered so far, as a single JSON object on one line
+	void write_json(std::wostream& out);
+
+	// writes a line on how the run is going every interval, from a thread of its own, until it goes away
+	struct progress_meter
+	{
+		progress_meter(double interval_seconds, std::wostream& out_);
+		~progress_meter();
+
+	private:
+		static DWORD WINAPI thread_proc(LPVOID parameter);
+		void run();
+
+		const DWORD interval;
+		std::wostream& out;
+		CRITICAL_SECTION lock;
+		CONDITION_VARIABLE stopping;
+		bool stop;
+		HANDLE thread;
+
+		progress_meter(const progress_meter&);
+		progress_meter& operator=(const progress_meter&);
+	};
+}
+
+#endif
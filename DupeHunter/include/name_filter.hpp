@@ -0,0 +1,57 @@
+#ifndef NAME_FILTER_HPP
+#define NAME_FILTER_HPP
+
+// decides whether a file name passes the include and exclude patterns: it must match at least one include, and no excludes.
+// everything is compiled up front, so that each name is decided in a single pass over its characters:
+//  - wildcards that are just a suffix (*.txt, *~) are looked up by hash
+//  - the remaining wildcards are combined into one DFA, as many of them as fit in its state limit
+//  - regexes, which neither of those can handle, are tried afterwards, and only if they could change the answer
+// matching is case-insensitive throughout. wildcards follow the usual rules: * and ? don't match \, / or :, and a . also matches the end of the name.
+struct name_filter
+{
+	name_filter(const std::vector<std::wstring>& include_wildcards, const std::vector<std::wstring>& include_regexes, const std::vector<std::wstring>& exclude_wildcards, const std::vector<std::wstring>& exclude_regexes);
+
+	bool permitted(const wchar_t* name, size_t length) const;
+
+	bool permitted(const std::wstring& name) const
+	{
+		return permitted(name.c_str(), name.size());
+	}
+
+	// the regex equivalent of a wildcard, as used for those that don't fit in the DFA
+	static std::wstring wildcard_to_regex(const std::wstring& wildcard);
+
+private:
+	enum { include_match = 1, exclude_match = 2 };
+
+	struct suffix_entry
+	{
+		std::wstring suffix;
+		unsigned int matches;
+	};
+
+	// returns the union of the match flags of every suffix that name ends with
+	unsigned int match_suffixes(const wchar_t* name, size_t length, size_t first_separator) const;
+	// returns the DFA's match flags for name
+	unsigned int match_wildcards(const wchar_t* name, size_t length) const;
+
+	// builds the DFA for wildcards, or returns false, leaving no DFA, if it would need too many states
+	bool compile_wildcards(const std::vector<std::pair<std::wstring, unsigned int> >& wildcards);
+
+	// the distinct suffix lengths, and the suffixes themselves keyed by a hash of their length and characters
+	std::vector<size_t> suffix_lengths;
+	std::unordered_map<unsigned __int64, std::vector<suffix_entry> > suffixes;
+
+	// characters are mapped to classes, and the DFA's transitions are indexed by state and class. state 0 is the dead state.
+	std::vector<unsigned int> ascii_classes;
+	std::unordered_map<wchar_t, unsigned int> other_classes;
+	unsigned int class_count;
+	std::vector<unsigned int> transitions;
+	std::vector<unsigned int> accepting;
+	bool has_dfa;
+
+	std::vector<boost::wregex> include_regexes;
+	std::vector<boost::wregex> exclude_regexes;
+};
+
+#endif
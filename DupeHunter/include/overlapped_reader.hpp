@@ -0,0 +1,51 @@
+#ifndef OVERLAPPED_READER_HPP
+#define OVERLAPPED_READER_HPP
+
+// keeps up to queue_depth reads in flight across a group of files opened with FILE_FLAG_OVERLAPPED, completing them through an I/O completion port.
+// reads are issued a block at a time into numbered buffer sets, so that one set can be filled while the caller works on another.
+// each set reads only the files it is given, in the order it is given them, so files can be dropped from one block to the next.
+struct overlapped_reader
+{
+	overlapped_reader(const std::vector<HANDLE>& files_, size_t set_count, size_t queue_depth_);
+	~overlapped_reader();
+
+	// queues a read of length bytes at offset from each file in order into the given buffers. reads are issued in the order that they were queued.
+	// a file must not be closed while it has a read in flight.
+	void start(size_t set, const std::vector<size_t>& order, unsigned __int64 offset, const std::vector<unsigned __int8*>& buffers, DWORD length);
+
+	// waits for every read in the set, returning false if any of them failed or hit the end of file. a file whose read failed reads 0 bytes.
+	bool finish(size_t set, std::vector<DWORD>& bytes_read);
+
+private:
+	struct read_set
+	{
+		read_set() : length(0), next_to_issue(0), outstanding(0), active(false), succeeded(true)
+		{
+		}
+
+		std::vector<OVERLAPPED> overlapped;
+		std::vector<size_t> order;
+		std::vector<unsigned __int8*> buffers;
+		std::vector<DWORD> bytes_read;
+		DWORD length;
+		size_t next_to_issue;
+		size_t outstanding;
+		bool active;
+		bool succeeded;
+	};
+
+	void issue();
+	void complete_one();
+
+	const std::vector<HANDLE>& files;
+	const size_t queue_depth;
+	HANDLE port;
+	std::vector<read_set> sets;
+	std::deque<size_t> issue_order;
+	size_t in_flight;
+
+	overlapped_reader(const overlapped_reader&);
+	overlapped_reader& operator=(const overlapped_reader&);
+};
+
+#endif
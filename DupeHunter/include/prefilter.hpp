@@ -0,0 +1,20 @@
+#ifndef PREFILTER_HPP
+#define PREFILTER_HPP
+
+struct prefilter_statistics
+{
+	prefilter_statistics() : candidates_eliminated(0), bytes_saved(0)
+	{
+	}
+
+	unsigned __int64 candidates_eliminated;
+	// the most that the eliminated candidates could have cost n_way_compare to read, less what sampling them cost
+	unsigned __int64 bytes_saved;
+};
+
+// reads sample_count small aligned samples from each file (the head, the tail, and evenly spaced points in between) and splits the group
+// on their contents. returns the sub-groups that still have more than one member, each as indices into names in ascending order,
+// ordered by their first member. groups of files too small for sampling to be worthwhile come back whole.
+std::vector<std::vector<size_t> > sample_prefilter(unsigned __int64 file_size, const std::vector<std::wstring>& names, size_t sample_count, prefilter_statistics& statistics);
+
+#endif
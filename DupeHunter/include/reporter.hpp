@@ -0,0 +1,90 @@
+#ifndef REPORTER_HPP
+#define REPORTER_HPP
+
+#include "traversal.hpp"
+#include "scheduler.hpp"
+
+enum report_format
+{
+	human_format,
+	// one JSON object per duplicate set
+	json_lines_format,
+	// every name in a duplicate set, hard links included, each followed by a NUL, with an empty name to end the set
+	nul_format
+};
+
+// gathers text and writes it to standard output a large block at a time, rather than a line at a time.
+// a console is given the text as it stands; anything else, such as a file or a pipe, gets UTF-8.
+struct buffered_output
+{
+	buffered_output();
+	~buffered_output();
+
+	void write(const wchar_t* text, size_t length);
+
+	void write(const std::wstring& text)
+	{
+		write(text.c_str(), text.size());
+	}
+
+	void flush();
+
+private:
+	void write_out(const wchar_t* text, size_t length);
+
+	HANDLE output;
+	bool console;
+	bool failed;
+	std::vector<wchar_t> buffer;
+	std::vector<char> encoded;
+
+	buffered_output(const buffered_output&);
+	buffered_output& operator=(const buffered_output&);
+};
+
+// writes duplicate sets out straight away, for --watch, whose sets don't come from any one table. each is said to have appeared or gone away,
+// which the NUL-separated format has no way of saying, so it isn't supported.
+void write_changed_sets(buffered_output& output, report_format format, unsigned __int64 file_size, const std::vector<std::vector<std::wstring> >& sets, bool appeared);
+
+// writes out each group's duplicate sets on a thread of its own, so that a slow console or pipe never holds up comparing.
+// groups are written in the order they're reported, and whatever has been reported is flushed whenever the thread catches up.
+struct reporter
+{
+	reporter(report_format format_, const file_table& table_, const link_map_type& links_);
+	~reporter();
+
+	// hands a group over to be written; doesn't wait for it
+	void report(unsigned __int64 file_size, size_t file_count, const duplicate_sets_type& duplicates);
+
+	// waits until everything reported so far has been written out. any failure on the writing thread is rethrown here.
+	void finish();
+
+private:
+	struct group_report
+	{
+		unsigned __int64 file_size;
+		size_t file_count;
+		duplicate_sets_type duplicates;
+	};
+
+	static DWORD WINAPI thread_proc(LPVOID parameter);
+	void run();
+	void write_group(const group_report& group);
+
+	const report_format format;
+	const file_table& table;
+	const link_map_type& links;
+	buffered_output output;
+
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE changed;
+	std::deque<group_report> pending;
+	bool finishing;
+	std::exception_ptr failure;
+	HANDLE thread;
+
+	reporter(const reporter&);
+	reporter& operator=(const reporter&);
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef SCAN_INDEX_HPP
+#define SCAN_INDEX_HPP
+
+// the on-disk index is a header, then the directories sorted by path hash, then every directory's entries, then all the names.
+// everything is fixed size and addressed by offset, so a mapped index is usable as it stands.
+struct indexed_directory
+{
+	unsigned __int64 path_hash;
+	unsigned __int64 last_write_time;
+	unsigned __int64 change_time;
+	unsigned __int64 path_offset;
+	unsigned __int64 first_entry;
+	unsigned __int32 path_length;
+	unsigned __int32 entry_count;
+};
+
+struct indexed_entry
+{
+	unsigned __int64 name_offset;
+	unsigned __int32 name_length;
+	unsigned __int32 attributes;
+	unsigned __int64 size;
+	unsigned __int64 file_id;
+	unsigned __int64 last_write_time;
+};
+
+// the index written by an earlier run, mapped read-only. a directory whose timestamps are unchanged since then has the same
+// entries as it did, so they can be taken from here instead of being enumerated again.
+struct scan_index
+{
+	explicit scan_index(const std::wstring& path);
+
+	const indexed_directory* find(const std::wstring& directory) const;
+
+	const indexed_entry* entries_of(const indexed_directory& directory) const
+	{
+		return entries + directory.first_entry;
+	}
+
+	const wchar_t* name_of(const indexed_entry& entry) const
+	{
+		return names + entry.name_offset;
+	}
+
+private:
+	util::mapped_file mapped;
+	const indexed_directory* directories;
+	unsigned __int64 directory_count;
+	const indexed_entry* entries;
+	const wchar_t* names;
+
+	scan_index(const scan_index&);
+	scan_index& operator=(const scan_index&);
+};
+
+// the directories visited by one scan thread, for writing out as the next index
+struct scan_index_builder
+{
+	void add_directory(const std::wstring& path, unsigned __int64 last_write_time, unsigned __int64 change_time);
+	// adds an entry to the directory most recently added
+	void add_entry(const wchar_t* name, size_t name_length, DWORD attributes, unsigned __int64 size, unsigned __int64 file_id, unsigned __int64 last_write_time);
+	// takes back the directory most recently added, along with its entries, for when it couldn't be listed in full
+	void remove_last_directory();
+
+	void swap(scan_index_builder& rhs)
+	{
+		directories.swap(rhs.directories);
+		entries.swap(rhs.entries);
+		names.swap(rhs.names);
+	}
+
+	std::vector<indexed_directory> directories;
+	std::vector<indexed_entry> entries;
+	std::vector<wchar_t> names;
+};
+
+bool write_scan_index(const std::wstring& path, const std::vector<const scan_index_builder*>& parts);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include "traversal.hpp"
+#include "compare.hpp"
+#include "prefilter.hpp"
+
+// each set is the files in the table that are identical
+typedef std::vector<std::vector<file_table::file_index> > duplicate_sets_type;
+typedef std::function<void (unsigned __int64 file_size, size_t file_count, const duplicate_sets_type& duplicates)> group_reporter_type;
+
+// compares every size group in files, whose entries are in table, on compare_threads threads (0 means one per processor), with all the groups in flight
+// sharing buffer_budget bytes between them. each disk that the files are on has its own queue of groups and its own limit on how many of them
+// may be compared at once, so groups on different disks go in parallel. report is called on the calling thread, once per group, in order of size.
+// returns what the sampling prefilter managed to weed out across all the groups.
+prefilter_statistics compare_groups(const file_table& table, const size_groups& files, size_t buffer_budget, size_t compare_threads, const compare_options& options, const group_reporter_type& report);
+
+#endif
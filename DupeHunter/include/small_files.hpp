@@ -0,0 +1,31 @@
+#ifndef SMALL_FILES_HPP
+#define SMALL_FILES_HPP
+
+struct compare_options;
+
+// files no bigger than this are read whole, many size groups at a time, rather than a group at a time by n_way_compare
+const unsigned __int64 small_file_limit(64 * 1024);
+
+// one size group of a batch. the last reference_count names are references, just as for n_way_compare.
+struct small_group
+{
+	small_group() : file_size(0), reference_count(0)
+	{
+	}
+
+	unsigned __int64 file_size;
+	std::vector<std::wstring> names;
+	size_t reference_count;
+};
+
+// how much of the buffer compare_small_groups needs for a group of file_count files of file_size bytes
+size_t small_group_buffer_size(unsigned __int64 file_size, size_t file_count);
+
+// reads every file of every group whole, with up to options.queue_depth files being opened, read, and closed at once, and then splits each group
+// into sets of identical files, in name order. with options.physical_order, every file is opened first, the reads are made in the order the files
+// sit on disk, and block clones aren't read at all. files are always read, never mapped, whatever options.map_files says.
+// buffer must hold every group's small_group_buffer_size. names that can't be read, or that are hard links to a name earlier in their group,
+// are taken out of the groups' names. returns each group's sets, in the order the groups were given.
+std::vector<std::vector<std::vector<std::wstring> > > compare_small_groups(std::vector<small_group>& groups, void* buffer, const compare_options& options);
+
+#endif
@@ -18,8 +18,14 @@
 
 #include <cstring>
 #include <map>
+#include <unordered_map>
+#include <set>
+#include <deque>
+#include <list>
 #include <string>
 #include <vector>
+#include <iterator>
+#include <exception>
 #include <fstream>
 #include <iostream>
 #include <algorithm>
@@ -30,3 +36,6 @@
 #include <boost/program_options.hpp>
 
 #include <utility/scopeguard.hpp>
+#include <utility/work_stealing_pool.hpp>
+#include <utility/xxhash64.hpp>
+#include <utility/mapped_file.hpp>
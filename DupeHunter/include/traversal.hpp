@@ -0,0 +1,63 @@
+#ifndef TRAVERSAL_HPP
+#define TRAVERSAL_HPP
+
+#include "file_table.hpp"
+
+struct name_filter;
+
+// the files that share their size with at least one other, all in one array sorted by size, with each size's files a run of it
+struct size_groups
+{
+	struct group
+	{
+		unsigned __int64 size;
+		size_t first;
+		size_t count;
+		// how many of the group's files, at the end of its run, come from reference sources
+		size_t references;
+	};
+
+	std::vector<file_table::file_index> files;
+	std::vector<group> groups;
+};
+
+// the other names of files in the size groups that have hard links, keyed by the name in the size groups
+typedef std::unordered_map<file_table::file_index, std::vector<file_table::file_index> > link_map_type;
+
+struct scan_options
+{
+	scan_options() : threads(0), reference_sources(0), two_pass(false)
+	{
+	}
+
+	// 0 means one per processor
+	size_t threads;
+	// how many of the sources, at the end, are references, whose files are only there to be compared with the files from the others
+	size_t reference_sources;
+	// walk everything twice: first keeping only each file's size, then keeping only the files whose size more than one file has.
+	// the extra listing is paid for with memory, as files with a unique size (usually most of them) are never stored at all.
+	bool two_pass;
+	// where to keep the directory index between runs; empty for none
+	std::wstring index_path;
+};
+
+struct scan_statistics
+{
+	scan_statistics() : directories_reused(0), directories_enumerated(0)
+	{
+	}
+
+	// directories whose entries were taken from the index, and those that had to be listed
+	unsigned __int64 directories_reused;
+	unsigned __int64 directories_enumerated;
+};
+
+// walks every source in parallel, putting everything that passes the name filters into table, and grouping it by size in files.
+// empty files, files whose size nothing else has, and sizes that only references have, are left out of the groups. hard links to a file already found go into links
+// rather than files, so that they are never compared.
+// the files in each size group come out in the same order that a depth-first walk of the sources, one after the other, would produce.
+// returns the number of files that passed the filters. with two_pass, the table only has the files that made it into the size groups
+// (along with their hard links) in it.
+unsigned __int64 populate_files(file_table& table, size_groups& files, link_map_type& links, const name_filter& filter, const std::vector<std::wstring>& sources, const scan_options& options, scan_statistics& statistics);
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <windows.h>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+
+#include <utility/scopeguard.hpp>
+
+namespace util
+{
+	// a read-only view of the whole of an existing file
+	struct mapped_file
+	{
+		mapped_file() : file(INVALID_HANDLE_VALUE), mapping(nullptr), view(nullptr), length(0)
+		{
+		}
+
+		~mapped_file()
+		{
+			close();
+		}
+
+		// false if the file doesn't exist, is empty, or can't be mapped; GetLastError says which
+		bool open(const std::wstring& path)
+		{
+			close();
+			file = ::CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, 0);
+			if(file == INVALID_HANDLE_VALUE) {
+				return false;
+			}
+			LARGE_INTEGER size = {0};
+			if(FALSE == ::GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+				close();
+				return false;
+			}
+			mapping = ::CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+			view = mapping != nullptr ? ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+			if(view == nullptr) {
+				const DWORD error(::GetLastError());
+				close();
+				::SetLastError(error);
+				return false;
+			}
+			length = static_cast<unsigned __int64>(size.QuadPart);
+			return true;
+		}
+
+		void close()
+		{
+			if(view != nullptr) {
+				::UnmapViewOfFile(view);
+			}
+			if(mapping != nullptr) {
+				::CloseHandle(mapping);
+			}
+			if(file != INVALID_HANDLE_VALUE) {
+				::CloseHandle(file);
+			}
+			file = INVALID_HANDLE_VALUE;
+			mapping = nullptr;
+			view = nullptr;
+			length = 0;
+		}
+
+		const void* data() const
+		{
+			return view;
+		}
+
+		unsigned __int64 size() const
+		{
+			return length;
+		}
+
+	private:
+		HANDLE file;
+		HANDLE mapping;
+		const void* view;
+		unsigned __int64 length;
+
+		mapped_file(const mapped_file&);
+		mapped_file& operator=(const mapped_file&);
+	};
+
+	// writes each piece in turn to a new file at path, replacing anything already there
+	inline bool write_file(const std::wstring& path, const std::vector<std::pair<const void*, size_t> >& pieces)
+	{
+		HANDLE output(::CreateFileW(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, 0));
+		if(output == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		ON_BLOCK_EXIT([=] { ::CloseHandle(output); });
+		for(auto it(pieces.cbegin()), end(pieces.cend()); it != end; ++it) {
+			const unsigned __int8* data(static_cast<const unsigned __int8*>(it->first));
+			for(size_t remaining(it->second); remaining != 0;) {
+				const DWORD chunk(static_cast<DWORD>(std::min<size_t>(remaining, 64 * 1024 * 1024)));
+				DWORD written(0);
+				if(FALSE == ::WriteFile(output, data, chunk, &written, NULL) || written != chunk) {
+					return false;
+				}
+				data += chunk;
+				remaining -= chunk;
+			}
+		}
+		return true;
+	}
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef RADIX_SORT_HPP
+#define RADIX_SORT_HPP
+
+#include <vector>
+#include <algorithm>
+
+#include <utility/work_stealing_pool.hpp>
+
+namespace util
+{
+	// a stable sort on a 64-bit key, a byte at a time from the bottom, with each pass split across the pool's threads.
+	// every thread counts the digits in its own slice, the counts are turned into where each slice's share of each digit starts,
+	// and then every thread scatters its slice independently of the others.
+	// a pass whose byte is the same in every key doesn't move anything, so it is skipped; for file sizes that is most of the top bytes.
+	template<typename T, typename Key>
+	void parallel_radix_sort(std::vector<T>& items, Key key, work_stealing_pool& pool)
+	{
+		const size_t count(items.size());
+		if(count < 2) {
+			return;
+		}
+		// slices smaller than this cost more to hand out than they save
+		const size_t minimum_slice(64 * 1024);
+		const size_t slices(std::max<size_t>(1, std::min(pool.size(), count / minimum_slice)));
+		const size_t slice_size((count + slices - 1) / slices);
+
+		std::vector<T> scratch(count);
+		std::vector<T>* source(&items);
+		std::vector<T>* target(&scratch);
+		std::vector<size_t> offsets(slices * 256);
+		for(unsigned int shift(0); shift < 64; shift += 8) {
+			std::fill(offsets.begin(), offsets.end(), 0);
+			for(size_t slice(0); slice < slices; ++slice) {
+				pool.submit([=, &offsets, &key] (size_t) {
+					size_t* const counts(&offsets[slice * 256]);
+					for(size_t i(slice * slice_size), end(std::min(count, (slice + 1) * slice_size)); i < end; ++i) {
+						++counts[static_cast<size_t>(key((*source)[i]) >> shift) & 0xff];
+					}
+				});
+			}
+			pool.wait();
+
+			// digit by digit, and slice by slice within each digit, which is what keeps equal keys in the order they started in
+			bool moves(true);
+			size_t position(0);
+			for(size_t digit(0); digit < 256; ++digit) {
+				const size_t digit_start(position);
+				for(size_t slice(0); slice < slices; ++slice) {
+					const size_t digit_count(offsets[(slice * 256) + digit]);
+					offsets[(slice * 256) + digit] = position;
+					position += digit_count;
+				}
+				if(position - digit_start == count) {
+					moves = false;
+				}
+			}
+			if(!moves) {
+				continue;
+			}
+
+			for(size_t slice(0); slice < slices; ++slice) {
+				pool.submit([=, &offsets, &key] (size_t) {
+					size_t* const next(&offsets[slice * 256]);
+					for(size_t i(slice * slice_size), end(std::min(count, (slice + 1) * slice_size)); i < end; ++i) {
+						(*target)[next[static_cast<size_t>(key((*source)[i]) >> shift) & 0xff]++] = (*source)[i];
+					}
+				});
+			}
+			pool.wait();
+			std::swap(source, target);
+		}
+		if(source != &items) {
+			items.swap(scratch);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef WORK_STEALING_POOL_HPP
+#define WORK_STEALING_POOL_HPP
+
+#include <windows.h>
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <functional>
+
+#include <utility/scopeguard.hpp>
+
+namespace util
+{
+	// a fixed set of worker threads, each with its own deque of tasks.
+	// workers push and pop at the back of their own deque, and when it runs dry they steal from the front of somebody else's,
+	// so the oldest (and, for recursive work such as directory walks, typically the largest) pieces of work are what get moved between threads.
+	// tasks are told which worker is running them so that they can submit follow-up work to that worker's own deque.
+	struct work_stealing_pool
+	{
+		typedef std::function<void (size_t)> task_type;
+
+		explicit work_stealing_pool(size_t thread_count) : queues(thread_count == 0 ? 1 : thread_count), pending(0), queued(0), stopping(false), next_queue(0)
+		{
+			::InitializeSRWLock(&idle_lock);
+			::InitializeConditionVariable(&work_available);
+			::InitializeConditionVariable(&work_complete);
+			for(size_t i(0); i < queues.size(); ++i) {
+				queues[i] = new worker_queue;
+			}
+			for(size_t i(0); i < queues.size(); ++i) {
+				thread_start* start(new thread_start(this, i));
+				HANDLE thread(::CreateThread(nullptr, 0, &work_stealing_pool::thread_proc, start, 0, nullptr));
+				if(thread == nullptr) {
+					delete start;
+					continue;
+				}
+				threads.push_back(thread);
+			}
+			// a worker that didn't start leaves its deque to be stolen from by the others, but with no workers at all nothing would ever run
+			if(threads.empty()) {
+				for(auto it(queues.begin()), end(queues.end()); it != end; ++it) {
+					delete *it;
+				}
+				throw std::exception("Could not start any worker threads");
+			}
+		}
+
+		~work_stealing_pool()
+		{
+			::AcquireSRWLockExclusive(&idle_lock);
+			stopping = true;
+			::WakeAllConditionVariable(&work_available);
+			::ReleaseSRWLockExclusive(&idle_lock);
+			for(auto it(threads.begin()), end(threads.end()); it != end; ++it) {
+				::WaitForSingleObject(*it, INFINITE);
+				::CloseHandle(*it);
+			}
+			for(auto it(queues.begin()), end(queues.end()); it != end; ++it) {
+				delete *it;
+			}
+		}
+
+		size_t size() const
+		{
+			return queues.size();
+		}
+
+		// submit from outside the pool; work is dealt out round-robin
+		void submit(task_type task)
+		{
+			const size_t target(static_cast<size_t>(::InterlockedIncrement(&next_queue)) % queues.size());
+			submit(std::move(task), target);
+		}
+
+		// submit to a particular worker's deque; tasks use this with their own worker index
+		void submit(task_type task, size_t worker)
+		{
+			::InterlockedIncrement(&pending);
+			{
+				worker_queue& q(*queues[worker]);
+				::EnterCriticalSection(&q.lock);
+				ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&q.lock); });
+				q.tasks.push_back(std::move(task));
+			}
+			::InterlockedIncrement(&queued);
+			::AcquireSRWLockExclusive(&idle_lock);
+			::WakeConditionVariable(&work_available);
+			::ReleaseSRWLockExclusive(&idle_lock);
+		}
+
+		// block until every submitted task, including any that tasks submitted in turn, has run.
+		// the first exception thrown by a task is rethrown here.
+		void wait()
+		{
+			::AcquireSRWLockExclusive(&idle_lock);
+			while(pending != 0) {
+				::SleepConditionVariableSRW(&work_complete, &idle_lock, INFINITE, 0);
+			}
+			std::exception_ptr failure(first_failure);
+			first_failure = std::exception_ptr();
+			::ReleaseSRWLockExclusive(&idle_lock);
+			if(failure != std::exception_ptr()) {
+				std::rethrow_exception(failure);
+			}
+		}
+
+	private:
+		struct worker_queue
+		{
+			worker_queue()
+			{
+				::InitializeCriticalSection(&lock);
+			}
+
+			~worker_queue()
+			{
+				::DeleteCriticalSection(&lock);
+			}
+
+			CRITICAL_SECTION lock;
+			std::deque<task_type> tasks;
+		};
+
+		struct thread_start
+		{
+			thread_start(work_stealing_pool* pool_, size_t index_) : pool(pool_), index(index_)
+			{
+			}
+
+			work_stealing_pool* pool;
+			size_t index;
+		};
+
+		static DWORD WINAPI thread_proc(LPVOID parameter)
+		{
+			std::unique_ptr<thread_start> start(static_cast<thread_start*>(parameter));
+			start->pool->run(start->index);
+			return 0;
+		}
+
+		bool pop_local(size_t worker, task_type& task)
+		{
+			worker_queue& q(*queues[worker]);
+			::EnterCriticalSection(&q.lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&q.lock); });
+			if(q.tasks.empty()) {
+				return false;
+			}
+			task = std::move(q.tasks.back());
+			q.tasks.pop_back();
+			return true;
+		}
+
+		bool steal(size_t thief, task_type& task)
+		{
+			for(size_t i(1); i < queues.size(); ++i) {
+				worker_queue& q(*queues[(thief + i) % queues.size()]);
+				::EnterCriticalSection(&q.lock);
+				ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&q.lock); });
+				if(!q.tasks.empty()) {
+					task = std::move(q.tasks.front());
+					q.tasks.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void run(size_t worker)
+		{
+			for(;;) {
+				task_type task;
+				if(pop_local(worker, task) || steal(worker, task)) {
+					::InterlockedDecrement(&queued);
+					try {
+						task(worker);
+					} catch(...) {
+						::AcquireSRWLockExclusive(&idle_lock);
+						if(first_failure == std::exception_ptr()) {
+							first_failure = std::current_exception();
+						}
+						::ReleaseSRWLockExclusive(&idle_lock);
+					}
+					if(0 == ::InterlockedDecrement(&pending)) {
+						::AcquireSRWLockExclusive(&idle_lock);
+						::WakeAllConditionVariable(&work_complete);
+						::ReleaseSRWLockExclusive(&idle_lock);
+					}
+					continue;
+				}
+				// submitters bump queued before they take the lock to wake us, so checking it under the lock can't miss a wakeup
+				::AcquireSRWLockExclusive(&idle_lock);
+				ON_BLOCK_EXIT([&] { ::ReleaseSRWLockExclusive(&idle_lock); });
+				if(stopping) {
+					return;
+				}
+				if(queued == 0) {
+					::SleepConditionVariableSRW(&work_available, &idle_lock, INFINITE, 0);
+				}
+			}
+		}
+
+		std::vector<worker_queue*> queues;
+		std::vector<HANDLE> threads;
+		volatile long pending;
+		volatile long queued;
+		bool stopping;
+		volatile long next_queue;
+		std::exception_ptr first_failure;
+		SRWLOCK idle_lock;
+		CONDITION_VARIABLE work_available;
+		CONDITION_VARIABLE work_complete;
+
+		work_stealing_pool(const work_stealing_pool&);
+		work_stealing_pool& operator=(const work_stealing_pool&);
+	};
+}
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef XXHASH64_HPP
+#define XXHASH64_HPP
+
+#include <cstring>
+
+namespace util
+{
+	// streaming XXH64, as described at https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+	struct xxhash64
+	{
+		explicit xxhash64(unsigned __int64 seed = 0) : total_length(0), buffered(0)
+		{
+			accumulators[0] = seed + prime1 + prime2;
+			accumulators[1] = seed + prime2;
+			accumulators[2] = seed;
+			accumulators[3] = seed - prime1;
+			initial_seed = seed;
+		}
+
+		void update(const void* data, size_t length)
+		{
+			const unsigned __int8* position(static_cast<const unsigned __int8*>(data));
+			const unsigned __int8* const end(position + length);
+			total_length += length;
+
+			if(buffered + length < sizeof(stripe)) {
+				std::memcpy(stripe + buffered, position, length);
+				buffered += length;
+				return;
+			}
+			if(buffered != 0) {
+				const size_t needed(sizeof(stripe) - buffered);
+				std::memcpy(stripe + buffered, position, needed);
+				consume(stripe);
+				position += needed;
+				buffered = 0;
+			}
+			while(static_cast<size_t>(end - position) >= sizeof(stripe)) {
+				consume(position);
+				position += sizeof(stripe);
+			}
+			buffered = static_cast<size_t>(end - position);
+			std::memcpy(stripe, position, buffered);
+		}
+
+		unsigned __int64 digest() const
+		{
+			unsigned __int64 hash;
+			if(total_length >= sizeof(stripe)) {
+				hash = rotate_left(accumulators[0], 1) + rotate_left(accumulators[1], 7) + rotate_left(accumulators[2], 12) + rotate_left(accumulators[3], 18);
+				for(size_t i(0); i < 4; ++i) {
+					hash = merge(hash, accumulators[i]);
+				}
+			}
+			else {
+				hash = initial_seed + prime5;
+			}
+			hash += total_length;
+
+			const unsigned __int8* position(stripe);
+			const unsigned __int8* const end(stripe + buffered);
+			for(; end - position >= 8; position += 8) {
+				hash ^= round(0, read64(position));
+				hash = rotate_left(hash, 27) * prime1 + prime4;
+			}
+			if(end - position >= 4) {
+				hash ^= static_cast<unsigned __int64>(read32(position)) * prime1;
+				hash = rotate_left(hash, 23) * prime2 + prime3;
+				position += 4;
+			}
+			for(; position != end; ++position) {
+				hash ^= static_cast<unsigned __int64>(*position) * prime5;
+				hash = rotate_left(hash, 11) * prime1;
+			}
+
+			hash ^= hash >> 33;
+			hash *= prime2;
+			hash ^= hash >> 29;
+			hash *= prime3;
+			hash ^= hash >> 32;
+			return hash;
+		}
+
+	private:
+		static const unsigned __int64 prime1 = 0x9e3779b185ebca87ULL;
+		static const unsigned __int64 prime2 = 0xc2b2ae3d27d4eb4fULL;
+		static const unsigned __int64 prime3 = 0x165667b19e3779f9ULL;
+		static const unsigned __int64 prime4 = 0x85ebca77c2b2ae63ULL;
+		static const unsigned __int64 prime5 = 0x27d4eb2f165667c5ULL;
+
+		static unsigned __int64 rotate_left(unsigned __int64 value, int bits)
+		{
+			return (value << bits) | (value >> (64 - bits));
+		}
+
+		static unsigned __int64 read64(const unsigned __int8* p)
+		{
+			unsigned __int64 value;
+			std::memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static unsigned __int32 read32(const unsigned __int8* p)
+		{
+			unsigned __int32 value;
+			std::memcpy(&value, p, sizeof(value));
+			return value;
+		}
+
+		static unsigned __int64 round(unsigned __int64 accumulator, unsigned __int64 input)
+		{
+			accumulator += input * prime2;
+			accumulator = rotate_left(accumulator, 31);
+			return accumulator * prime1;
+		}
+
+		static unsigned __int64 merge(unsigned __int64 hash, unsigned __int64 accumulator)
+		{
+			hash ^= round(0, accumulator);
+			return hash * prime1 + prime4;
+		}
+
+		void consume(const unsigned __int8* p)
+		{
+			for(size_t i(0); i < 4; ++i) {
+				accumulators[i] = round(accumulators[i], read64(p + (i * 8)));
+			}
+		}
+
+		unsigned __int64 accumulators[4];
+		unsigned __int64 initial_seed;
+		unsigned __int64 total_length;
+		unsigned __int8 stripe[32];
+		size_t buffered;
+	};
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef WATCHER_HPP
+#define WATCHER_HPP
+
+#include "file_table.hpp"
+#include "compare.hpp"
+#include "reporter.hpp"
+
+struct name_filter;
+
+// change notifications for every source directory and everything below it. it's made before the first full scan, so that nothing
+// that changes while the scan is going on is missed; the changes just queue up until they're asked for.
+// sources that are files rather than directories aren't watched.
+struct directory_watcher
+{
+	// the paths that changed, each mapped to whether it was created (or renamed into place), rather than changed or removed
+	typedef std::map<std::wstring, bool> change_map_type;
+
+	explicit directory_watcher(const std::vector<std::wstring>& sources);
+	~directory_watcher();
+
+	// waits for a change, then until there have been none for settle milliseconds, so that a file is looked at once it's been written
+	// rather than part way through, but never for more than longest milliseconds after the first change, however many more keep coming.
+	// directories that changed too much for their notifications to keep up go into overflowed, and have to be looked at in full.
+	// returns false, having gathered nothing, if stop was signalled first.
+	bool wait(HANDLE stop, DWORD settle, DWORD longest, change_map_type& changes, std::vector<std::wstring>& overflowed);
+
+private:
+	struct watched_directory
+	{
+		std::wstring path;
+		HANDLE handle;
+		OVERLAPPED overlapped;
+		// FILE_NOTIFY_INFORMATION records must be 4-byte aligned
+		std::vector<unsigned __int64> buffer;
+	};
+
+	bool arm(watched_directory& directory);
+	void gather(const watched_directory& directory, DWORD bytes, change_map_type& changes) const;
+	void close(watched_directory& directory);
+
+	// a list, as each directory's OVERLAPPED has to stay put while a read is pending on it
+	std::list<watched_directory> directories;
+
+	directory_watcher(const directory_watcher&);
+	directory_watcher& operator=(const directory_watcher&);
+};
+
+// the duplicate sets found so far, as paths, by the size of their files
+typedef std::map<unsigned __int64, std::vector<std::vector<std::wstring> > > duplicate_index_type;
+
+struct watch_options
+{
+	watch_options() : buffer_size(0), compare_threads(0), format(human_format)
+	{
+	}
+
+	size_t buffer_size;
+	size_t compare_threads;
+	compare_options compare;
+	report_format format;
+};
+
+// keeps the files in table, and the duplicates among them, up to date from the watcher's notifications until Ctrl+C is pressed.
+// only the size groups that a change touches are compared again, and the duplicate sets that appear or go away as a result are written out
+// straight away. duplicates must start out as what comparing table found, and is kept up to date along with everything else.
+void watch_for_changes(directory_watcher& watcher, const file_table& table, duplicate_index_type& duplicates, const name_filter& filter, const watch_options& options, std::wostream& status);
+
+#endif
@@ -3,188 +3,34 @@
 
 #include "stdafx.h"
 
-typedef std::map<unsigned __int64, std::vector<std::wstring> > size_map_type;
-
-bool permitted_name(const std::wstring& name, const std::vector<boost::wregex>& include_patterns, const std::vector<boost::wregex>& exclude_patterns) {
-	for(auto ipit(include_patterns.cbegin()), ipend(include_patterns.cend()); ipit != ipend; ++ipit) {
-		if(boost::regex_match(name, *ipit)) {
-			for(auto epit(exclude_patterns.cbegin()), epend(exclude_patterns.cend()); epit != epend; ++epit) {
-				if(boost::regex_match(name, *epit)) {
-					return false;
-				}
-			}
-			return true;
-		}
-	}
-	return false;
-}
-
-unsigned __int64 populate_files(size_map_type& files, const std::vector<boost::wregex>& include_patterns, const std::vector<boost::wregex>& exclude_patterns, const std::wstring& basePath) {
-	WIN32_FILE_ATTRIBUTE_DATA attributes = {0};
-	::GetFileAttributesExW(basePath.c_str(), GetFileExInfoStandard, &attributes);
-
-	if((attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != FILE_ATTRIBUTE_DIRECTORY) {
-		DWORD buffer_size(::GetFullPathNameW(basePath.c_str(), 0, nullptr, nullptr));
-		std::unique_ptr<wchar_t[]> buffer(new wchar_t[buffer_size]);
-		wchar_t* file_name(nullptr);
-		::GetFullPathNameW(basePath.c_str(), buffer_size, buffer.get(), &file_name);
-		if(permitted_name(file_name, include_patterns, exclude_patterns)) {
-			files[((static_cast<unsigned __int64>(attributes.nFileSizeHigh) << 32) + static_cast<unsigned __int64>(attributes.nFileSizeLow))].push_back(basePath);
-			return 1;
-		}
-		return 0;
-	}
-
-	unsigned __int64 count(0);
-	const std::wstring search_path(basePath + (basePath[basePath.size() - 1] == L'\\' ? L"*" : L"\\*"));
-	WIN32_FIND_DATAW found = {0};
-	HANDLE finder(::FindFirstFileW(search_path.c_str(), &found));
-	ON_BLOCK_EXIT([=] { ::FindClose(finder); });
-	do {
-		static const wchar_t* dot(L".");
-		static const wchar_t* dotdot(L"..");
-		if(0 == std::wcscmp(found.cFileName, dot) || 0 == std::wcscmp(found.cFileName, dotdot)) {
-			continue;
-		}
-		const std::wstring file_path(basePath + (basePath[basePath.size() - 1] == L'\\' ? L"" : L"\\") + found.cFileName);
-		if((found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY) {
-			if((found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != FILE_ATTRIBUTE_REPARSE_POINT) {
-				count += populate_files(files, include_patterns, exclude_patterns, file_path);
-			}
-		}
-		else {
-			if(permitted_name(found.cFileName, include_patterns, exclude_patterns)) {
-				files[((static_cast<unsigned __int64>(found.nFileSizeHigh) << 32) + static_cast<unsigned __int64>(found.nFileSizeLow))].push_back(file_path);
-				++count;
-			}
-		}
-	}
-	while(FALSE != ::FindNextFileW(finder, &found));
-	return count;
-}
-
-bool read_multi_file(const std::vector<HANDLE>& files, const std::vector<unsigned __int8*>& buffers, const size_t buffer_size, std::vector<DWORD>& bytes_read) {
-	bool result(true);
-	for(size_t i(0); i < files.size(); ++i) {
-		result &= FALSE != ::ReadFile(files[i], buffers[i], buffer_size, &bytes_read[i], NULL) && 0 != bytes_read[i];
-	}
-	return result;
-}
-
-template<typename T>
-T round_to_next_multiple(T num, T factor) {
-	return ((num + factor - 1) / factor) * factor;
-}
-
-template<typename T>
-T round_to_previous_multiple(T num, T factor) {
-	return (num / factor) * factor;
-}
-
-std::vector<std::vector<std::wstring> > n_way_compare(unsigned __int64 file_size, std::vector<std::wstring>& names, void* buffer, const size_t total_buffer_size) {
-	// we size the buffer such that it can hold as much of each file as possible, subject to the constraint that it must not use more than roughly our total buffer size
-	// if we can't read each file in totality, we just carve up our buffer space evenly
-	if(names.size() > total_buffer_size) {
-		throw std::exception("Buffer too small for this number of files");
-	}
-	static const unsigned __int64 sector_size(4096); // TODO get the right size
-	const unsigned __int64 rounded_file_size(round_to_next_multiple(file_size, sector_size));
-	const bool aligned_reads    = (static_cast<unsigned __int64>(names.size()) * sector_size      ) <= static_cast<unsigned __int64>(total_buffer_size);
-	const bool read_whole_files = (static_cast<unsigned __int64>(names.size()) * rounded_file_size) <= static_cast<unsigned __int64>(total_buffer_size);
-	const unsigned __int64 buffer_size = aligned_reads ? (read_whole_files ? rounded_file_size
-	                                                                       : round_to_previous_multiple(total_buffer_size / (static_cast<unsigned __int64>(names.size()) * sector_size), sector_size))
-	                                                   : static_cast<unsigned __int64>(total_buffer_size) / static_cast<unsigned __int64>(names.size());
-
-	std::vector<HANDLE> files(names.size());
-	std::set<unsigned __int64> file_ids;
-	for(size_t i(0); i < names.size();) {
-		files[i] = ::CreateFileW(names[i].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | (aligned_reads ? FILE_FLAG_NO_BUFFERING : 0), 0);
-		if(files[i] == INVALID_HANDLE_VALUE) {
-			std::wcerr << L"Could not open file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
-			names.erase(names.begin() + i);
-			files.erase(files.begin() + i);
-			continue;
-		}
-		BY_HANDLE_FILE_INFORMATION info = {0};
-		::GetFileInformationByHandle(files[i], &info);
-		// skip hard linked "duplicates" as they occupy zero additional space
-		// TODO it would be nice to keep their names hanging around, for reporting purposes.
-		const unsigned __int64 file_id((static_cast<unsigned __int64>(info.nFileIndexHigh) << 32) + info.nFileIndexLow);
-		if(file_ids.find(file_id) != file_ids.end()) {
-			std::wcerr << L"Skipping file " << names[i] << L" due to hard links" << std::endl;
-			::CloseHandle(files[i]);
-			names.erase(names.begin() + i);
-			files.erase(files.begin() + i);
-			continue;
-		}
-		file_ids.insert(file_id);
-		++i;
-	}
-	ON_BLOCK_EXIT([=] {
-		std::for_each(files.begin(), files.end(), &::CloseHandle);
-	});
-
-	if(names.size() <= 1) {
-		return std::vector<std::vector<std::wstring> >();
-	}
-
-	std::vector<unsigned __int8*> buffers(names.size());
-	for(size_t i(0); i < names.size(); ++i) {
-		buffers[i] = static_cast<unsigned __int8*>(buffer) + (i * buffer_size);
-	}
-	std::vector<DWORD> bytes_read(names.size());
-
-	// even with vector<bool>'s compact representation, this can be a large array
-	// (in the order of hundreds of MB), so while a rectangular representation
-	// would be easier, I will make it triangular, and halve memory usage.
-	// This means that comparison_result[a][b] stores the result of the 
-	// comparison between files[a] and files[a + b + 1]
-	typedef std::vector<std::vector<bool> > comparison_result_type;
-	comparison_result_type comparison_results(names.size());
-	for(size_t i(0), lim(comparison_results.size()); i < lim; ++i) {
-		comparison_results[i].resize(names.size() - i - 1, true);
-	}
-
-	bool work_to_do(true);
-	while(work_to_do && false != read_multi_file(files, buffers, buffer_size, bytes_read)) {
-		work_to_do = false;
-		for(size_t i(0), lim(names.size()); i < lim - 1; ++i) {
-			for(size_t j(i + 1); j < lim; ++j) {
-				if(comparison_results[i][j - i - 1] != false) {
-					comparison_results[i][j - i - 1] = bytes_read[i] == bytes_read[j] ? 0 == std::memcmp(buffers[i], buffers[j], bytes_read[i])
-					                                                                  : false;
-				}
-				work_to_do |= comparison_results[i][j - i - 1];
-			}
-		}
-	}
-
-	std::vector<std::vector<std::wstring> > duplicate_sets;
-	std::vector<bool> already_used(names.size(), false);
-	for(size_t i(0), lim(names.size()); i < lim - 1; ++i) {
-		if(!already_used[i]) {
-			std::vector<std::wstring> duplicates;
-			duplicates.push_back(names[i]);
-			for(size_t j(i + 1); j < lim; ++j) {
-				if(comparison_results[i][j - i - 1]) {
-					already_used[j] = true;
-					duplicates.push_back(names[j]);
-				}
-			}
-			if(duplicates.size() > 1) {
-				duplicate_sets.push_back(duplicates);
-			}
-		}
-	}
-	return duplicate_sets;
-}
+#include "traversal.hpp"
+#include "name_filter.hpp"
+#include "scheduler.hpp"
+#include "fingerprint.hpp"
+#include "reporter.hpp"
+#include "dedupe.hpp"
+#include "instrumentation.hpp"
+#include "watcher.hpp"
 
 int wmain(int argc, wchar_t* argv[])
 try {
 	namespace po = boost::program_options;
 
 	size_t buffer_size(0);
+	scan_options scanning;
+	size_t compare_threads(0);
+	compare_options options;
+	std::wstring io_mode;
+	std::wstring output_format;
+	std::wstring hash_cache_path;
+	std::wstring dedupe_method_name;
+	dedupe_options deduping;
+	std::wstring undo_path;
+	std::wstring stats_format;
+	double progress_interval(0.0);
+	bool watching(false);
 	std::vector<std::wstring> directories;
+	std::vector<std::wstring> references;
 	std::vector<std::wstring> inc_patterns;
 	std::vector<std::wstring> inc_epatterns;
 	std::vector<std::wstring> exc_patterns;
@@ -192,13 +38,34 @@ try {
 
 	po::options_description desc("Allowed options");
 	desc.add_options()
-		("help",                                                                             "show this message")
-		("buffer-size", po::wvalue<size_t>(&buffer_size)->default_value(1024 * 1024 * 1024), "set maximum buffer size")
-		("source",      po::wvalue<std::vector<std::wstring> >(&directories)->composing(),   "directories to search")
-		("include,i",   po::wvalue<std::vector<std::wstring> >(&inc_patterns)->composing(),  "wildcard filename pattern to include")
-		("einclude,I",  po::wvalue<std::vector<std::wstring> >(&inc_epatterns)->composing(), "regex filename pattern to include")
-		("exclude,x",   po::wvalue<std::vector<std::wstring> >(&exc_patterns)->composing(),  "wildcard filename pattern to exclude")
-		("eexclude,X",  po::wvalue<std::vector<std::wstring> >(&exc_epatterns)->composing(), "regex filename pattern to exclude")
+		("help",                                                                                 "show this message")
+		("buffer-size",     po::wvalue<size_t>(&buffer_size)->default_value(1024 * 1024 * 1024), "set maximum buffer size")
+		("scan-threads",    po::wvalue<size_t>(&scanning.threads)->default_value(0),              "number of threads to search directories with (0 for one per processor)")
+		("scan-index",      po::wvalue<std::wstring>(&scanning.index_path),                       "file to keep the directory tree in between runs, so that unchanged directories aren't listed again")
+		("two-pass",        po::bool_switch(&scanning.two_pass),                                  "search everything twice, the first time only for sizes, so that files with a unique size are never stored; uses far less memory")
+		("compare-threads", po::wvalue<size_t>(&compare_threads)->default_value(0),               "number of size groups to compare at once (0 for one per processor)")
+		("queue-depth",     po::wvalue<size_t>(&options.queue_depth)->default_value(32),          "number of reads to keep in flight for each size group (1 to read synchronously)")
+		("max-open-files",  po::wvalue<size_t>(&options.max_open_files)->default_value(512),       "most files of a size group to have open at once; bigger groups are compared in waves")
+		("physical-order",  po::bool_switch(&options.physical_order),                             "read files in the order they are laid out on disk, and match up block clones without reading them; costs an extra open of one file in every size group of files over 64 KB before comparing starts")
+		("io-mode",         po::wvalue<std::wstring>(&io_mode)->default_value(L"read", "read"),   "read: read files into the buffer; mmap: compare straight from mappings of the files (files of 64 KB or less are always read)")
+		("samples",         po::wvalue<size_t>(&options.sample_count)->default_value(5),          "number of blocks to sample from each large file before comparing in full (0 to disable)")
+		("fingerprint",     po::bool_switch(&options.fingerprint),                                "group files by a hash of their contents rather than comparing them")
+		("verify",          po::bool_switch(&options.verify),                                     "with --fingerprint, compare files that share a hash byte by byte")
+		("format",          po::wvalue<std::wstring>(&output_format)->default_value(L"human", "human"), "human: readable report; jsonl: a JSON object per duplicate set; nul: NUL-separated names, with an empty name after each set")
+		("hash-cache",      po::wvalue<std::wstring>(&hash_cache_path),                           "with --fingerprint, file to keep hashes in between runs, so that unchanged files aren't read")
+		("dedupe",          po::wvalue<std::wstring>(&dedupe_method_name),                        "reflink: make duplicates share the first file's clusters (ReFS only); hardlink: replace duplicates with hard links to the first file")
+		("dry-run",         po::bool_switch(&deduping.dry_run),                                   "with --dedupe, say what would be done without doing it")
+		("undo-log",        po::wvalue<std::wstring>(&deduping.undo_log_path),                    "with --dedupe, file to record what was done in, so that it can be undone")
+		("undo",            po::wvalue<std::wstring>(&undo_path),                                 "undo everything recorded in an undo log, then exit")
+		("stats",           po::wvalue<std::wstring>(&stats_format),                              "json: at exit, write where the time went, counts of what was done, and how long groups took to compare to standard error")
+		("progress",        po::wvalue<double>(&progress_interval)->default_value(0.0),           "seconds between progress lines on standard error (0 for none)")
+		("watch",           po::bool_switch(&watching),                                           "after the first full pass, keep watching the sources and report duplicate sets as they appear and go away, until Ctrl+C")
+		("source",          po::wvalue<std::vector<std::wstring> >(&directories)->composing(),   "directories to search")
+		("reference",       po::wvalue<std::vector<std::wstring> >(&references)->composing(),    "directories whose files are only compared with those from the sources, never with each other")
+		("include,i",       po::wvalue<std::vector<std::wstring> >(&inc_patterns)->composing(),  "wildcard filename pattern to include")
+		("einclude,I",      po::wvalue<std::vector<std::wstring> >(&inc_epatterns)->composing(), "regex filename pattern to include")
+		("exclude,x",       po::wvalue<std::vector<std::wstring> >(&exc_patterns)->composing(),  "wildcard filename pattern to exclude")
+		("eexclude,X",      po::wvalue<std::vector<std::wstring> >(&exc_epatterns)->composing(), "regex filename pattern to exclude")
 	;
 
 	po::positional_options_description p;
@@ -213,71 +80,184 @@ try {
 		return -1;
 	}
 
+	if(!undo_path.empty()) {
+		return undo_dedupe(undo_path, std::wcerr) ? 0 : -2;
+	}
+
 	if(!vm.count("source")) {
 		std::cerr << desc << std::endl;
 		return -1;
 	}
 
-	void* buffer(::VirtualAlloc(nullptr, buffer_size,  MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
-	ON_BLOCK_EXIT([=] { ::VirtualFree(buffer, 0, MEM_RELEASE); });
+	if(io_mode != L"read" && io_mode != L"mmap") {
+		std::cerr << desc << std::endl;
+		return -1;
+	}
+	options.map_files = io_mode == L"mmap";
 
-	if(inc_patterns.size() == 0 && inc_epatterns.size() == 0) {
-		inc_patterns.push_back(L"*");
+	if(output_format != L"human" && output_format != L"jsonl" && output_format != L"nul") {
+		std::cerr << desc << std::endl;
+		return -1;
+	}
+	if(!dedupe_method_name.empty() && dedupe_method_name != L"reflink" && dedupe_method_name != L"hardlink") {
+		std::cerr << desc << std::endl;
+		return -1;
+	}
+	deduping.method = dedupe_method_name == L"reflink" ? reflink_dedupe : dedupe_method_name == L"hardlink" ? hardlink_dedupe : no_dedupe;
+	// neither a clone nor a link checks the data for itself, so only files that have really been compared may be given away
+	if(deduping.method != no_dedupe && options.fingerprint && !options.verify) {
+		std::cerr << "--dedupe needs --verify when used with --fingerprint" << std::endl;
+		return -1;
 	}
 
-	std::vector<boost::wregex> include_patterns;
-	std::vector<boost::wregex> exclude_patterns;
+	if(watching && output_format == L"nul") {
+		std::cerr << "--watch can't be used with --format=nul" << std::endl;
+		return -1;
+	}
+	// files that keep changing are exactly the ones that shouldn't be given away on the strength of a single look
+	if(watching && deduping.method != no_dedupe) {
+		std::cerr << "--watch can't be used with --dedupe" << std::endl;
+		return -1;
+	}
+	// watching has to know about every file, as any of them could gain a duplicate
+	if(watching && scanning.two_pass) {
+		std::cerr << "--watch can't be used with --two-pass" << std::endl;
+		return -1;
+	}
+	if(watching && !references.empty()) {
+		std::cerr << "--watch can't be used with --reference" << std::endl;
+		return -1;
+	}
+	// deduplicating keeps the first file of each set, which would be one from the sources rather than the reference it matched
+	if(deduping.method != no_dedupe && !references.empty()) {
+		std::cerr << "--dedupe can't be used with --reference" << std::endl;
+		return -1;
+	}
+
+	if(!stats_format.empty() && stats_format != L"json") {
+		std::cerr << desc << std::endl;
+		return -1;
+	}
+	// counting and timing are only switched on if something is going to look at them
+	if(!stats_format.empty() || progress_interval > 0.0) {
+		instrumentation::turn_on();
+	}
 
-	const boost::wregex wildcard_transform(L"([+{}()\\[\\]$\\^|])|(\\*)|(\\?)|(\\.)|([\\\\/:])");
-	// this has to be double-escaped because we want the result to be properly escaped to produce a regex itself.
-	// It would be nice to have raw strings!
-	const std::wstring wildcard_replacement(L"(?1\\\\$1)(?2[^\\\\\\\\/\\:]*)(?3[^\\\\\\\\/\\:])(?4\\(\\?\\:\\\\.|$\\))(?5[\\\\\\\\\\\\/\\:])");
+	const report_format format(output_format == L"jsonl" ? json_lines_format : output_format == L"nul" ? nul_format : human_format);
+	// standard output only ever gets the duplicate sets, written by buffered_output. status goes to standard error in every format, so that
+	// redirected output never has lines from the CRT's own buffer, in the ANSI code page, mixed in with the UTF-8.
+	std::wostream& status(std::wcerr);
 
-	for(auto it(inc_patterns.cbegin()), end(inc_patterns.cend()); it != end; ++it) {
-		include_patterns.push_back(boost::wregex(boost::regex_replace(*it, wildcard_transform, wildcard_replacement, boost::format_all), boost::regex::icase));
+	if(inc_patterns.size() == 0 && inc_epatterns.size() == 0) {
+		inc_patterns.push_back(L"*");
 	}
-	for(auto it(exc_patterns.cbegin()), end(exc_patterns.cend()); it != end; ++it) {
-		exclude_patterns.push_back(boost::wregex(boost::regex_replace(*it, wildcard_transform, wildcard_replacement, boost::format_all), boost::regex::icase));
+
+	const name_filter filter(inc_patterns, inc_epatterns, exc_patterns, exc_epatterns);
+
+	std::unique_ptr<hash_cache> cache;
+	if(options.fingerprint && !hash_cache_path.empty()) {
+		cache.reset(new hash_cache(hash_cache_path));
+		options.cache = cache.get();
 	}
-	for(auto it(inc_epatterns.cbegin()), end(inc_epatterns.cend()); it != end; ++it) {
-		include_patterns.push_back(boost::wregex(*it, boost::regex::icase));
+
+	for(auto it(directories.cbegin()), end(directories.cend()); it != end; ++it) {
+		status << L"Searching " << *it << std::endl;
 	}
-	for(auto it(exc_epatterns.cbegin()), end(exc_epatterns.cend()); it != end; ++it) {
-		exclude_patterns.push_back(boost::wregex(*it, boost::regex::icase));
+	for(auto it(references.cbegin()), end(references.cend()); it != end; ++it) {
+		status << L"Comparing against " << *it << std::endl;
 	}
 
-	size_map_type files;
-	unsigned __int64 total_files(0);
+	std::unique_ptr<instrumentation::progress_meter> progress;
+	if(progress_interval > 0.0) {
+		progress.reset(new instrumentation::progress_meter(progress_interval, std::wcerr));
+	}
+	instrumentation::enter_phase(instrumentation::scan_phase);
 
-	for(auto it(directories.cbegin()), end(directories.cend()); it != end; ++it) {
-		std::wcout << L"Searching " << *it << std::endl;
-		total_files += populate_files(files, include_patterns, exclude_patterns, *it);
+	// started before the scan, so that whatever changes while it's going on is seen to afterwards
+	std::unique_ptr<directory_watcher> watcher;
+	if(watching) {
+		watcher.reset(new directory_watcher(directories));
 	}
 
-	std::wcout << L"Found " << total_files << L" files matching search criteria" << std::endl;
-	unsigned __int64 files_read(total_files);
-	for(auto it(files.cbegin()), end(files.cend()); it != end;) {
-		if(it->first == 0 || it->second.size() == 1) {
-			files_read -= it->second.size();
-			files.erase(it++);
-		}
-		else {
-			++it;
-		}
+	// anything written after this might not be what was compared
+	FILETIME scan_started = {0};
+	::GetSystemTimeAsFileTime(&scan_started);
+	deduping.compared_since = (static_cast<unsigned __int64>(scan_started.dwHighDateTime) << 32) | scan_started.dwLowDateTime;
+
+	file_table table;
+	size_groups files;
+	link_map_type links;
+	scan_statistics scanned;
+	// references go after the sources, which is how the scan tells them apart
+	std::vector<std::wstring> sources(directories);
+	sources.insert(sources.end(), references.begin(), references.end());
+	scanning.reference_sources = references.size();
+	const unsigned __int64 total_files(populate_files(table, files, links, filter, sources, scanning, scanned));
+	if(!scanning.index_path.empty()) {
+		status << L"Scan index supplied " << scanned.directories_reused << L" directories, " << scanned.directories_enumerated << L" were listed" << std::endl;
 	}
+
+	status << L"Found " << total_files << L" files matching search criteria" << std::endl;
+	const unsigned __int64 files_read(files.files.size());
 	unsigned __int64 total_duplicates(0);
-	std::wcout << L"Comparing " << files_read << L" files with non-unique sizes" << std::endl;
-	for(auto it(files.begin()), end(files.end()); it != end; ++it) {
-		std::wcout << L"Comparing " << it->second.size() << L" files of size " << it->first << std::endl;
-		std::vector<std::vector<std::wstring> > duplicates(n_way_compare(it->first, it->second, buffer, buffer_size));
-		size_t count(0);
+	status << L"Comparing " << files_read << L" files with non-unique sizes" << std::endl;
+	instrumentation::enter_phase(instrumentation::compare_phase);
+	reporter output(format, table, links);
+	duplicate_index_type found;
+	std::unique_ptr<deduplicator> dedupe;
+	if(deduping.method != no_dedupe) {
+		dedupe.reset(new deduplicator(deduping, table, std::wcerr));
+	}
+	const prefilter_statistics prefiltered(compare_groups(table, files, buffer_size, compare_threads, options, [&] (unsigned __int64 file_size, size_t file_count, const duplicate_sets_type& duplicates) {
 		for(auto it(duplicates.cbegin()), end(duplicates.cend()); it != end; ++it) {
-			std::wcout << L"\tDuplicate set " << ++count << std::endl;
-			for(std::vector<std::wstring>::const_iterator nit(it->begin()), nend(it->end()); nit != nend; ++nit) {
-				std::wcout << L"\t\t" << *nit << std::endl;
-			}
 			total_duplicates += it->size();
 		}
+		output.report(file_size, file_count, duplicates);
+		if(dedupe) {
+			dedupe->add(file_size, duplicates);
+		}
+		if(watcher) {
+			std::vector<std::vector<std::wstring> >& sets(found[file_size]);
+			for(auto it(duplicates.cbegin()), end(duplicates.cend()); it != end; ++it) {
+				std::vector<std::wstring> paths;
+				for(auto fit(it->cbegin()), fend(it->cend()); fit != fend; ++fit) {
+					paths.push_back(table.path_of(*fit));
+				}
+				sets.push_back(paths);
+			}
+		}
+	}));
+	output.finish();
+	instrumentation::enter_phase(instrumentation::finish_phase);
+	if(dedupe) {
+		const dedupe_statistics deduped(dedupe->finish());
+		status << L"Deduplicated " << deduped.files_deduplicated << L" files, reclaiming " << deduped.bytes_reclaimed << L" bytes; " << deduped.files_skipped << L" files were skipped" << std::endl;
+	}
+	if(cache) {
+		status << L"Hash cache supplied " << cache->hits() << L" hashes, " << cache->misses() << L" files were read" << std::endl;
+		// saving lets go of the cache's table, so while watching it's only saved once the watching is over
+		if(!watcher) {
+			cache->save();
+		}
+	}
+	if(options.sample_count != 0 && !options.fingerprint) {
+		status << L"Sampling eliminated " << prefiltered.candidates_eliminated << L" candidates, saving up to " << prefiltered.bytes_saved << L" bytes of reads" << std::endl;
+	}
+	if(watcher) {
+		watch_options watch;
+		watch.buffer_size = buffer_size;
+		watch.compare_threads = compare_threads;
+		watch.compare = options;
+		watch.format = format;
+		watch_for_changes(*watcher, table, found, filter, watch, status);
+		if(cache) {
+			cache->save();
+		}
+	}
+	instrumentation::enter_phase(instrumentation::done_phase);
+	progress.reset();
+	if(!stats_format.empty()) {
+		instrumentation::write_json(std::wcerr);
 	}
 
 	return total_duplicates > std::numeric_limits<int>::max() ? std::numeric_limits<int>::max() : static_cast<int>(total_duplicates);
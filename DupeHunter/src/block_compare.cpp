@@ -0,0 +1,218 @@
+// block_compare.cpp : comparing one block against many, with the widest vector instructions the processor has
+//
+
+#include "stdafx.h"
+
+#include "block_compare.hpp"
+
+#include <intrin.h>
+#include <emmintrin.h>
+// VS2012 brought the AVX2 intrinsics and VS2017 the AVX-512 ones; older compilers just get the narrower kernels
+#if _MSC_VER >= 1700
+#define HAVE_AVX2_KERNEL
+#include <immintrin.h>
+#endif
+#if _MSC_VER >= 1910 && defined(_M_X64)
+#define HAVE_AVX512_KERNEL
+#endif
+
+namespace {
+	// each candidate is compared a stripe at a time, so that the reference's stripe is still in L1 when the next candidate gets to it
+	const size_t stripe_size(4096);
+
+	typedef size_t (*difference_function)(const unsigned __int8* lhs, const unsigned __int8* rhs, size_t length);
+
+	unsigned long lowest_set_bit(unsigned __int64 bits) {
+		unsigned long index(0);
+		if(0 != static_cast<unsigned long>(bits)) {
+			_BitScanForward(&index, static_cast<unsigned long>(bits));
+			return index;
+		}
+		_BitScanForward(&index, static_cast<unsigned long>(bits >> 32));
+		return index + 32;
+	}
+
+	// each of these returns the offset of the first byte that differs, or length if they're the same
+	size_t first_difference_scalar(const unsigned __int8* lhs, const unsigned __int8* rhs, size_t length) {
+		size_t i(0);
+		for(; i + sizeof(unsigned __int64) <= length; i += sizeof(unsigned __int64)) {
+			unsigned __int64 l, r;
+			std::memcpy(&l, lhs + i, sizeof(l));
+			std::memcpy(&r, rhs + i, sizeof(r));
+			if(l != r) {
+				break;
+			}
+		}
+		for(; i < length && lhs[i] == rhs[i]; ++i) {
+		}
+		return i;
+	}
+
+	size_t first_difference_sse2(const unsigned __int8* lhs, const unsigned __int8* rhs, size_t length) {
+		size_t i(0);
+		for(; i + sizeof(__m128i) <= length; i += sizeof(__m128i)) {
+			const __m128i equal(_mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lhs + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(rhs + i))));
+			const unsigned int different(static_cast<unsigned int>(_mm_movemask_epi8(equal)) ^ 0xffffu);
+			if(different != 0) {
+				return i + lowest_set_bit(different);
+			}
+		}
+		return i + first_difference_scalar(lhs + i, rhs + i, length - i);
+	}
+
+#ifdef HAVE_AVX2_KERNEL
+	size_t first_difference_avx2(const unsigned __int8* lhs, const unsigned __int8* rhs, size_t length) {
+		size_t i(0);
+		unsigned int different(0);
+		for(; i + sizeof(__m256i) <= length; i += sizeof(__m256i)) {
+			const __m256i equal(_mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(lhs + i)), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rhs + i))));
+			different = ~static_cast<unsigned int>(_mm256_movemask_epi8(equal));
+			if(different != 0) {
+				break;
+			}
+		}
+		// leaving the upper halves dirty would slow down any SSE code that runs afterwards
+		_mm256_zeroupper();
+		if(different != 0) {
+			return i + lowest_set_bit(different);
+		}
+		return i + first_difference_scalar(lhs + i, rhs + i, length - i);
+	}
+#endif
+
+#ifdef HAVE_AVX512_KERNEL
+	size_t first_difference_avx512(const unsigned __int8* lhs, const unsigned __int8* rhs, size_t length) {
+		size_t i(0);
+		unsigned __int64 different(0);
+		for(; i + sizeof(__m512i) <= length; i += sizeof(__m512i)) {
+			different = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(lhs + i), _mm512_loadu_si512(rhs + i));
+			if(different != 0) {
+				break;
+			}
+		}
+		_mm256_zeroupper();
+		if(different != 0) {
+			return i + lowest_set_bit(different);
+		}
+		return i + first_difference_scalar(lhs + i, rhs + i, length - i);
+	}
+#endif
+
+	struct kernel_description {
+		difference_function function;
+		const char* name;
+	};
+
+	const kernel_description kernels[kernel_count] = {
+		{ &first_difference_scalar, "scalar" },
+		{ &first_difference_sse2,   "SSE2"   },
+#ifdef HAVE_AVX2_KERNEL
+		{ &first_difference_avx2,   "AVX2"   },
+#else
+		{ nullptr,                  "AVX2"   },
+#endif
+#ifdef HAVE_AVX512_KERNEL
+		{ &first_difference_avx512, "AVX-512"},
+#else
+		{ nullptr,                  "AVX-512"},
+#endif
+	};
+
+	struct processor_features {
+		processor_features() : sse2(false), avx2(false), avx512(false) {
+			int info[4] = {0};
+			__cpuid(info, 0);
+			const int highest_leaf(info[0]);
+			__cpuid(info, 1);
+			sse2 = (info[3] & (1 << 26)) != 0;
+#ifdef HAVE_AVX2_KERNEL
+			// the processor having the instructions isn't enough; the OS has to save the wider registers across context switches too
+			const bool osxsave((info[2] & (1 << 27)) != 0);
+			const unsigned __int64 saved_state(osxsave ? _xgetbv(0) : 0);
+			if(highest_leaf >= 7) {
+				__cpuidex(info, 7, 0);
+				avx2 = (saved_state & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+				// AVX-512F and AVX-512BW, with the opmask and both halves of the ZMM registers saved
+				avx512 = (saved_state & 0xe6) == 0xe6 && (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0;
+			}
+#else
+			(void)highest_leaf;
+#endif
+		}
+
+		bool sse2;
+		bool avx2;
+		bool avx512;
+	};
+
+	const processor_features features;
+}
+
+bool kernel_supported(block_compare_kernel kernel) {
+	if(kernel >= kernel_count || kernels[kernel].function == nullptr) {
+		return false;
+	}
+	switch(kernel) {
+	case sse2_kernel:
+		return features.sse2;
+	case avx2_kernel:
+		return features.avx2;
+	case avx512_kernel:
+		return features.avx512;
+	default:
+		return true;
+	}
+}
+
+block_compare_kernel best_kernel() {
+	static const block_compare_kernel widest_first[] = { avx512_kernel, avx2_kernel, sse2_kernel };
+	for(size_t i(0); i < sizeof(widest_first) / sizeof(widest_first[0]); ++i) {
+		if(kernel_supported(widest_first[i])) {
+			return widest_first[i];
+		}
+	}
+	return scalar_kernel;
+}
+
+const char* kernel_name(block_compare_kernel kernel) {
+	return kernel < kernel_count ? kernels[kernel].name : "unknown";
+}
+
+namespace {
+	const block_compare_kernel default_kernel(best_kernel());
+}
+
+size_t compare_one_to_many(const unsigned __int8* reference, const unsigned __int8* const* candidates, size_t candidate_count, size_t length, unsigned __int64* matches) {
+	return compare_one_to_many(default_kernel, reference, candidates, candidate_count, length, matches);
+}
+
+size_t compare_one_to_many(block_compare_kernel kernel, const unsigned __int8* reference, const unsigned __int8* const* candidates, size_t candidate_count, size_t length, unsigned __int64* matches) {
+	const difference_function first_difference(kernels[kernel].function);
+
+	// the match bits double as the set of candidates still worth comparing
+	const size_t words(match_words(candidate_count));
+	for(size_t w(0); w < words; ++w) {
+		matches[w] = ~0ULL;
+	}
+	if(candidate_count % 64 != 0) {
+		matches[words - 1] = (1ULL << (candidate_count % 64)) - 1;
+	}
+
+	size_t first_mismatch(length);
+	size_t remaining(candidate_count);
+	for(size_t offset(0); offset < length && remaining != 0; offset += stripe_size) {
+		const size_t stripe(std::min(stripe_size, length - offset));
+		for(size_t w(0); w < words; ++w) {
+			for(unsigned __int64 live(matches[w]); live != 0; live &= live - 1) {
+				const unsigned long bit(lowest_set_bit(live));
+				const size_t difference(first_difference(reference + offset, candidates[(w * 64) + bit] + offset, stripe));
+				if(difference != stripe) {
+					matches[w] &= ~(1ULL << bit);
+					first_mismatch = std::min(first_mismatch, offset + difference);
+					--remaining;
+				}
+			}
+		}
+	}
+	return first_mismatch;
+}
@@ -0,0 +1,696 @@
+// compare.cpp : byte-by-byte comparison of files of the same size
+//
+
+#include "stdafx.h"
+
+#include "compare.hpp"
+#include "overlapped_reader.hpp"
+#include "block_compare.hpp"
+#include "extents.hpp"
+#include "instrumentation.hpp"
+
+namespace {
+	const unsigned __int64 sector_size(4096); // TODO get the right size
+
+	typedef std::vector<size_t> equivalence_class;
+}
+
+// members are bucketed by digest and then each file is compared only with its bucket's representative, so the work is linear in the class size.
+// references sort after everything else, so they never get to be a representative, and a reference that differs from every other file in its
+// bucket is simply left out rather than compared with the other references.
+void split_class(const std::vector<size_t>& members, const std::vector<unsigned __int8*>& buffers, const std::vector<DWORD>& bytes_read, size_t first_reference, std::vector<std::vector<size_t> >& refined) {
+	if(members.front() >= first_reference) {
+		return;
+	}
+	if(members.size() == 2) {
+		const size_t a(members[0]), b(members[1]);
+		unsigned __int64 matched(0);
+		if(bytes_read[a] == bytes_read[b] && bytes_read[a] == compare_one_to_many(buffers[a], &buffers[b], 1, bytes_read[a], &matched)) {
+			refined.push_back(members);
+		}
+		return;
+	}
+
+	std::vector<std::pair<unsigned __int64, size_t> > digests;
+	digests.reserve(members.size());
+	for(auto it(members.cbegin()), end(members.cend()); it != end; ++it) {
+		digests.push_back(std::make_pair(block_digest(buffers[*it], bytes_read[*it]), *it));
+	}
+	// sorting on (digest, index) keeps each bucket in name order
+	std::sort(digests.begin(), digests.end());
+
+	for(size_t first(0), last(0); first < digests.size(); first = last) {
+		for(last = first + 1; last < digests.size() && digests[last].first == digests[first].first; ++last) {
+		}
+		if(last - first < 2) {
+			continue;
+		}
+		equivalence_class pending;
+		pending.reserve(last - first);
+		for(size_t i(first); i < last; ++i) {
+			pending.push_back(digests[i].second);
+		}
+		// a digest collision leaves some members behind; they get another pass against a representative of their own
+		std::vector<const unsigned __int8*> candidates;
+		std::vector<unsigned __int64> matches;
+		while(pending.size() > 1 && pending.front() < first_reference) {
+			const size_t representative(pending.front());
+			// everything that read as much as the representative is checked against it in a single pass over its block
+			candidates.clear();
+			for(size_t i(1); i < pending.size(); ++i) {
+				if(bytes_read[pending[i]] == bytes_read[representative]) {
+					candidates.push_back(buffers[pending[i]]);
+				}
+			}
+			matches.assign(match_words(candidates.size()), 0);
+			if(!candidates.empty()) {
+				compare_one_to_many(buffers[representative], &candidates[0], candidates.size(), bytes_read[representative], &matches[0]);
+			}
+			equivalence_class matched(1, representative);
+			equivalence_class rest;
+			for(size_t i(1), candidate(0); i < pending.size(); ++i) {
+				const bool same_length(bytes_read[pending[i]] == bytes_read[representative]);
+				if(same_length && is_match(&matches[0], candidate)) {
+					matched.push_back(pending[i]);
+				}
+				else {
+					rest.push_back(pending[i]);
+				}
+				if(same_length) {
+					++candidate;
+				}
+			}
+			if(matched.size() > 1) {
+				refined.push_back(std::move(matched));
+			}
+			pending.swap(rest);
+		}
+	}
+}
+
+namespace {
+	// the most of each file that is mapped at once
+	const unsigned __int64 max_window_size(64 * 1024 * 1024);
+	// the most of each file that is read at once, which keeps every read's length within a DWORD
+	const unsigned __int64 max_block_size(1024 * 1024 * 1024);
+
+	unsigned __int64 allocation_granularity() {
+		SYSTEM_INFO system_info = {0};
+		::GetSystemInfo(&system_info);
+		return system_info.dwAllocationGranularity;
+	}
+
+	// PrefetchVirtualMemory is only there on Windows 8 and later; without it, mapped files are just faulted in as they're compared
+	struct memory_range {
+		void* address;
+		SIZE_T size;
+	};
+	typedef BOOL (WINAPI *prefetch_function)(HANDLE, ULONG_PTR, memory_range*, ULONG);
+	const prefetch_function prefetch_virtual_memory(reinterpret_cast<prefetch_function>(::GetProcAddress(::GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory")));
+
+	bool read_at(HANDLE file, unsigned __int64 offset, unsigned __int8* buffer, DWORD length, DWORD& bytes_read) {
+		OVERLAPPED position = {0};
+		position.Offset = static_cast<DWORD>(offset);
+		position.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		return FALSE != ::ReadFile(file, buffer, length, &bytes_read, &position) && bytes_read == length;
+	}
+
+	// a mapped file that gets truncated, or whose disk goes away, faults when it's touched rather than failing a ReadFile.
+	// this file is built with /EHa, so that the fault unwinds f's frames, destructors and all, on its way out.
+	bool run_guarded(const std::function<void ()>& f) {
+		__try {
+			f();
+		} __except(GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH) {
+			return false;
+		}
+		return true;
+	}
+}
+
+namespace {
+	// classes keep their members in name order, so ordering them by their first member reports sets in the order they were found
+	std::vector<std::vector<std::wstring> > duplicate_sets_in_order(const std::vector<std::wstring>& names, std::vector<equivalence_class>& classes) {
+		std::sort(classes.begin(), classes.end(), [] (const equivalence_class& lhs, const equivalence_class& rhs) {
+			return lhs.front() < rhs.front();
+		});
+		std::vector<std::vector<std::wstring> > duplicate_sets;
+		duplicate_sets.reserve(classes.size());
+		for(auto it(classes.cbegin()), end(classes.cend()); it != end; ++it) {
+			std::vector<std::wstring> duplicates;
+			duplicates.reserve(it->size());
+			for(auto mit(it->cbegin()), mend(it->cend()); mit != mend; ++mit) {
+				duplicates.push_back(names[*mit]);
+			}
+			duplicate_sets.push_back(std::move(duplicates));
+		}
+		return duplicate_sets;
+	}
+}
+
+unsigned __int64 block_digest(const unsigned __int8* block, size_t length) {
+	static const unsigned __int64 multiplier(0x9e3779b97f4a7c15ULL);
+	unsigned __int64 digest(length * multiplier);
+	const size_t words(length / sizeof(unsigned __int64));
+	for(size_t i(0); i < words; ++i) {
+		unsigned __int64 word;
+		std::memcpy(&word, block + (i * sizeof(unsigned __int64)), sizeof(word));
+		digest = (digest ^ word) * multiplier;
+		digest ^= digest >> 29;
+	}
+	for(size_t i(words * sizeof(unsigned __int64)); i < length; ++i) {
+		digest = (digest ^ block[i]) * multiplier;
+	}
+	return digest ^ (digest >> 32);
+}
+
+size_t desired_buffer_size(unsigned __int64 file_size, size_t file_count, size_t total_buffer_size) {
+	// enough to read every file in one go; anything less than that just means more, smaller, reads
+	const unsigned __int64 whole_files(static_cast<unsigned __int64>(file_count) * round_to_next_multiple(file_size, sector_size));
+	return whole_files < static_cast<unsigned __int64>(total_buffer_size) ? static_cast<size_t>(whole_files) : total_buffer_size;
+}
+
+// a file whose read fails reads 0 bytes
+bool read_multi_file(const std::vector<HANDLE>& files, const std::vector<size_t>& order, const std::vector<unsigned __int8*>& buffers, const size_t buffer_size, std::vector<DWORD>& bytes_read) {
+	instrumentation::scoped_timer reading(instrumentation::read_timer);
+	bool result(true);
+	for(auto it(order.cbegin()), end(order.cend()); it != end; ++it) {
+		const size_t i(*it);
+		result &= FALSE != ::ReadFile(files[i], buffers[i], buffer_size, &bytes_read[i], NULL) && 0 != bytes_read[i];
+		instrumentation::count(instrumentation::bytes_read, bytes_read[i]);
+	}
+	instrumentation::count(instrumentation::read_calls, order.size());
+	return result;
+}
+
+namespace {
+	// the most files of a group that are compared at once, given the handle limit and the buffer
+	size_t wave_size(size_t total_buffer_size, const compare_options& options) {
+		return std::max<size_t>(2, std::min<size_t>(options.max_open_files, total_buffer_size / static_cast<size_t>(sector_size)));
+	}
+
+	// buckets members by a digest of their first block, read one file at a time. members that can't be read are dropped.
+	std::vector<equivalence_class> first_block_buckets(const std::vector<std::wstring>& names, void* buffer) {
+		std::vector<std::pair<unsigned __int64, size_t> > digests;
+		digests.reserve(names.size());
+		for(size_t i(0); i < names.size(); ++i) {
+			// the cache gets to keep what's read here, for when the same block is compared properly
+			HANDLE file(instrumentation::timed(instrumentation::open_timer, [&] {
+				return ::CreateFileW(names[i].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+			}));
+			if(file == INVALID_HANDLE_VALUE) {
+				std::wcerr << L"Could not open file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+				continue;
+			}
+			instrumentation::count(instrumentation::files_opened);
+			ON_BLOCK_EXIT([=] { ::CloseHandle(file); });
+			DWORD bytes_read(0);
+			if(FALSE == instrumentation::timed(instrumentation::read_timer, [&] { return ::ReadFile(file, buffer, static_cast<DWORD>(sector_size), &bytes_read, NULL); })) {
+				std::wcerr << L"Could not read file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+				continue;
+			}
+			instrumentation::count(instrumentation::read_calls);
+			instrumentation::count(instrumentation::bytes_read, bytes_read);
+			digests.push_back(std::make_pair(block_digest(static_cast<const unsigned __int8*>(buffer), bytes_read), i));
+		}
+		std::sort(digests.begin(), digests.end());
+
+		std::vector<equivalence_class> buckets;
+		for(size_t first(0), last(0); first < digests.size(); first = last) {
+			for(last = first + 1; last < digests.size() && digests[last].first == digests[first].first; ++last) {
+			}
+			if(last - first < 2) {
+				continue;
+			}
+			buckets.push_back(equivalence_class());
+			for(size_t i(first); i < last; ++i) {
+				buckets.back().push_back(digests[i].second);
+			}
+		}
+		return buckets;
+	}
+
+	// compares a bucket too big to open all at once, a wave at a time. each wave is a batch of files not yet placed along with the
+	// representatives of some of the classes found so far, and only the representatives are carried from one wave to the next, so
+	// neither the handles nor the buffer needed grow with the size of the bucket.
+	// a reference that matches none of the classes so far is left out, rather than starting a class of its own, so representatives are never references.
+	void compare_in_waves(unsigned __int64 file_size, const std::vector<std::wstring>& names, const equivalence_class& bucket, void* buffer, const size_t total_buffer_size, size_t wave, size_t first_reference, const compare_options& options, std::vector<equivalence_class>& classes) {
+		// the front of each class is its representative
+		std::vector<equivalence_class> found;
+		const size_t batch_size(std::max<size_t>(1, wave / 2));
+		for(size_t next(0); next < bucket.size();) {
+			// each pending entry is a file from this batch, followed by any others from the batch that have turned out to match it
+			std::vector<equivalence_class> pending;
+			for(const size_t end(std::min(bucket.size(), next + batch_size)); next < end; ++next) {
+				pending.push_back(equivalence_class(1, bucket[next]));
+			}
+			const size_t representatives_per_wave(wave - pending.size());
+			size_t first_class(0);
+			do {
+				const size_t last_class(std::min(found.size(), first_class + representatives_per_wave));
+				std::vector<std::wstring> wave_names;
+				std::unordered_map<std::wstring, size_t> slots;
+				for(size_t c(first_class); c < last_class; ++c) {
+					slots[names[found[c].front()]] = wave_names.size();
+					wave_names.push_back(names[found[c].front()]);
+				}
+				const size_t representative_count(wave_names.size());
+				size_t wave_references(0);
+				for(auto it(pending.cbegin()), end(pending.cend()); it != end; ++it) {
+					slots[names[it->front()]] = wave_names.size();
+					wave_names.push_back(names[it->front()]);
+					if(it->front() >= first_reference) {
+						++wave_references;
+					}
+				}
+				if(wave_names.size() < 2) {
+					break;
+				}
+
+				// the pending files keep bucket order, so the references among them come after everything else in the wave
+				const std::vector<std::vector<std::wstring> > sets(n_way_compare(file_size, wave_names, buffer, total_buffer_size, options, wave_references));
+				std::vector<bool> absorbed(pending.size(), false);
+				for(auto it(sets.cbegin()), end(sets.cend()); it != end; ++it) {
+					// sets keep wave order, so a representative (and representatives all differ, so there's at most one) comes first
+					const size_t leader(slots[it->front()]);
+					equivalence_class& target(leader < representative_count ? found[first_class + leader] : pending[leader - representative_count]);
+					for(auto mit(it->cbegin() + 1), mend(it->cend()); mit != mend; ++mit) {
+						const size_t slot(slots[*mit]);
+						// only possible if a file changed between waves
+						if(slot < representative_count) {
+							continue;
+						}
+						target.insert(target.end(), pending[slot - representative_count].begin(), pending[slot - representative_count].end());
+						absorbed[slot - representative_count] = true;
+					}
+				}
+				std::vector<equivalence_class> unmatched;
+				for(size_t i(0); i < pending.size(); ++i) {
+					if(!absorbed[i]) {
+						unmatched.push_back(std::move(pending[i]));
+					}
+				}
+				pending.swap(unmatched);
+				first_class = last_class;
+			}
+			while(!pending.empty() && first_class < found.size());
+			// anything that matched none of the classes so far starts one of its own
+			for(auto it(pending.begin()), end(pending.end()); it != end; ++it) {
+				if(it->front() < first_reference) {
+					found.push_back(std::move(*it));
+				}
+			}
+		}
+		for(auto it(found.begin()), end(found.end()); it != end; ++it) {
+			if(it->size() > 1) {
+				std::sort(it->begin(), it->end());
+				classes.push_back(std::move(*it));
+			}
+		}
+	}
+}
+
+std::vector<std::vector<std::wstring> > n_way_compare(unsigned __int64 file_size, std::vector<std::wstring>& names, void* buffer, const size_t total_buffer_size, const compare_options& options, size_t reference_count) {
+	// references are only there to be compared with everything else
+	if(reference_count >= names.size()) {
+		return std::vector<std::vector<std::wstring> >();
+	}
+	const size_t wave(wave_size(total_buffer_size, options));
+	if(names.size() > wave) {
+		// nothing in one first-block bucket can match anything in another, and most buckets are small enough to compare outright
+		const size_t first_reference(names.size() - reference_count);
+		std::vector<equivalence_class> classes;
+		const std::vector<equivalence_class> buckets(first_block_buckets(names, buffer));
+		for(auto it(buckets.cbegin()), end(buckets.cend()); it != end; ++it) {
+			// buckets are in name order, so one that starts with a reference has nothing else in it
+			if(it->front() >= first_reference) {
+				continue;
+			}
+			if(it->size() > wave) {
+				compare_in_waves(file_size, names, *it, buffer, total_buffer_size, wave, first_reference, options, classes);
+				continue;
+			}
+			std::vector<std::wstring> bucket_names;
+			std::unordered_map<std::wstring, size_t> indices;
+			for(auto bit(it->cbegin()), bend(it->cend()); bit != bend; ++bit) {
+				bucket_names.push_back(names[*bit]);
+				indices[names[*bit]] = *bit;
+			}
+			const size_t bucket_references(it->cend() - std::lower_bound(it->cbegin(), it->cend(), first_reference));
+			const std::vector<std::vector<std::wstring> > sets(n_way_compare(file_size, bucket_names, buffer, total_buffer_size, options, bucket_references));
+			for(auto sit(sets.cbegin()), send(sets.cend()); sit != send; ++sit) {
+				classes.push_back(equivalence_class());
+				for(auto mit(sit->cbegin()), mend(sit->cend()); mit != mend; ++mit) {
+					classes.back().push_back(indices[*mit]);
+				}
+			}
+		}
+		return duplicate_sets_in_order(names, classes);
+	}
+
+	// we size the buffer such that it can hold as much of each file as possible, subject to the constraint that it must not use more than roughly our total buffer size
+	// if we can't read each file in totality, we just carve up our buffer space evenly
+	if(names.size() > total_buffer_size) {
+		throw std::exception("Buffer too small for this number of files");
+	}
+	const unsigned __int64 rounded_file_size(round_to_next_multiple(file_size, sector_size));
+	const bool aligned_reads    = (static_cast<unsigned __int64>(names.size()) * sector_size      ) <= static_cast<unsigned __int64>(total_buffer_size);
+	const bool read_whole_files = (static_cast<unsigned __int64>(names.size()) * rounded_file_size) <= static_cast<unsigned __int64>(total_buffer_size);
+	const unsigned __int64 buffer_size = aligned_reads ? (read_whole_files ? rounded_file_size
+	                                                                       : round_to_previous_multiple(total_buffer_size / static_cast<unsigned __int64>(names.size()), sector_size))
+	                                                   : static_cast<unsigned __int64>(total_buffer_size) / static_cast<unsigned __int64>(names.size());
+	// mapped files are compared a window at a time straight out of the page cache. the buffer is only touched for files that can't be mapped,
+	// each of which reads its window into its own slice instead.
+	const unsigned __int64 window_size(options.map_files ? std::min(std::min(round_to_previous_multiple(static_cast<unsigned __int64>(total_buffer_size) / names.size(), allocation_granularity()), max_window_size),
+	                                                                round_to_next_multiple(file_size, allocation_granularity()))
+	                                                     : 0);
+	const bool mapped(window_size != 0);
+	// with reads queued asynchronously, a file that doesn't fit in one go gets two half-size buffers, so that the next block
+	// can be read into one while the last is compared in the other
+	const bool asynchronous(!mapped && options.queue_depth > 1);
+	const unsigned __int64 half_buffer_size(aligned_reads ? round_to_previous_multiple(buffer_size / 2, sector_size) : buffer_size / 2);
+	const size_t buffer_sets(asynchronous && !read_whole_files && half_buffer_size != 0 ? 2 : 1);
+	// each buffer set has its own part of the buffer, so one can be laid out afresh while the other is still being compared
+	const unsigned __int64 set_size(aligned_reads ? round_to_previous_multiple(static_cast<unsigned __int64>(total_buffer_size) / buffer_sets, sector_size)
+	                                              : static_cast<unsigned __int64>(total_buffer_size) / buffer_sets);
+
+	const DWORD flags(mapped ? FILE_FLAG_SEQUENTIAL_SCAN
+	                         : FILE_FLAG_SEQUENTIAL_SCAN | (aligned_reads ? FILE_FLAG_NO_BUFFERING : 0) | (asynchronous ? FILE_FLAG_OVERLAPPED : 0));
+
+	std::vector<HANDLE> files(names.size());
+	std::set<std::pair<DWORD, unsigned __int64> > file_ids;
+	auto forget = [&] (size_t i) {
+		if(i >= names.size() - reference_count) {
+			--reference_count;
+		}
+		names.erase(names.begin() + i);
+		files.erase(files.begin() + i);
+	};
+	for(size_t i(0); i < names.size();) {
+		files[i] = instrumentation::timed(instrumentation::open_timer, [&] {
+			return ::CreateFileW(names[i].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, flags, 0);
+		});
+		if(files[i] == INVALID_HANDLE_VALUE) {
+			std::wcerr << L"Could not open file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			forget(i);
+			continue;
+		}
+		BY_HANDLE_FILE_INFORMATION info = {0};
+		const bool identified(FALSE != ::GetFileInformationByHandle(files[i], &info));
+		// sizes can come from the scan index, which doesn't notice files changing size in place. a file that's grown could otherwise
+		// match another on the file_size bytes that are compared, and a file that's shrunk has nothing left to compare.
+		if(identified && ((static_cast<unsigned __int64>(info.nFileSizeHigh) << 32) + info.nFileSizeLow) != file_size) {
+			std::wcerr << L"File " << names[i] << L" is no longer " << file_size << L" bytes, ignoring" << std::endl;
+			::CloseHandle(files[i]);
+			forget(i);
+			continue;
+		}
+		// skip hard linked "duplicates" as they occupy zero additional space. the walk has already set aside any links it could identify
+		// along with their names; this only catches the ones it couldn't. a file with no id can't be told to be a link at all.
+		const std::pair<DWORD, unsigned __int64> file_id(info.dwVolumeSerialNumber, (static_cast<unsigned __int64>(info.nFileIndexHigh) << 32) + info.nFileIndexLow);
+		if(identified && file_ids.find(file_id) != file_ids.end()) {
+			std::wcerr << L"Skipping file " << names[i] << L" due to hard links" << std::endl;
+			::CloseHandle(files[i]);
+			forget(i);
+			continue;
+		}
+		if(identified) {
+			file_ids.insert(file_id);
+		}
+		instrumentation::count(instrumentation::files_opened);
+		++i;
+	}
+	// files that can't match anything any more are closed early, and are left as INVALID_HANDLE_VALUE
+	ON_BLOCK_EXIT([&] {
+		for(auto it(files.cbegin()), end(files.cend()); it != end; ++it) {
+			if(*it != INVALID_HANDLE_VALUE) {
+				::CloseHandle(*it);
+			}
+		}
+	});
+
+	if(names.size() <= 1 || reference_count == names.size()) {
+		return std::vector<std::vector<std::wstring> >();
+	}
+	const size_t first_reference(names.size() - reference_count);
+	// a class is finished with once it's down to one file, or to nothing but references
+	auto finished = [&] (const equivalence_class& c) {
+		return c.size() < 2 || c.front() >= first_reference;
+	};
+
+	std::vector<std::vector<unsigned __int8*> > buffers(buffer_sets, std::vector<unsigned __int8*>(names.size()));
+	std::vector<DWORD> bytes_read(names.size());
+
+	// files are read in the order given here. with physical ordering that's the order they sit on disk, and a file whose data is the very
+	// same clusters as an earlier one's isn't read at all, but matched up with that file at the end.
+	std::vector<size_t> read_order;
+	std::vector<std::pair<size_t, size_t> > clones;
+	if(options.physical_order) {
+		std::vector<file_extents> extents(names.size());
+		std::vector<std::pair<std::pair<DWORD, unsigned __int64>, size_t> > locations;
+		for(size_t i(0); i < names.size(); ++i) {
+			query_extents(files[i], extents[i]);
+			size_t original(0);
+			for(; original < i && !extents[original].shares_all_clusters(extents[i]); ++original) {
+			}
+			if(original < i) {
+				clones.push_back(std::make_pair(original, i));
+				continue;
+			}
+			locations.push_back(std::make_pair(std::make_pair(extents[i].volume, extents[i].first_cluster()), i));
+		}
+		std::sort(locations.begin(), locations.end());
+		for(auto it(locations.cbegin()), end(locations.cend()); it != end; ++it) {
+			read_order.push_back(it->second);
+		}
+	}
+	else {
+		for(size_t i(0); i < names.size(); ++i) {
+			read_order.push_back(i);
+		}
+	}
+
+	// rather than remembering the result of every pairwise comparison, keep the files that are still identical so far in
+	// equivalence classes, and split each class apart block by block. a class that gets down to one member is finished with.
+	std::vector<equivalence_class> classes(1, equivalence_class(read_order));
+	std::sort(classes[0].begin(), classes[0].end());
+	if(finished(classes[0])) {
+		classes.clear();
+	}
+
+	// a file is live for as long as it's in a class with some other file. once it isn't, nothing can match it, so it's read no further.
+	std::vector<bool> live(names.size(), false);
+	auto find_live = [&] () {
+		std::fill(live.begin(), live.end(), false);
+		for(auto it(classes.cbegin()), end(classes.cend()); it != end; ++it) {
+			for(auto mit(it->cbegin()), mend(it->cend()); mit != mend; ++mit) {
+				live[*mit] = true;
+			}
+		}
+	};
+	auto live_order = [&] () -> std::vector<size_t> {
+		find_live();
+		std::vector<size_t> order;
+		for(auto it(read_order.cbegin()), end(read_order.cend()); it != end; ++it) {
+			if(live[*it]) {
+				order.push_back(*it);
+			}
+		}
+		return order;
+	};
+	// only the files still being read share the set's part of the buffer, so every file that drops out makes the blocks of the rest bigger
+	auto lay_out = [&] (size_t set, const std::vector<size_t>& order, unsigned __int64 offset) -> DWORD {
+		const unsigned __int64 share(set_size / order.size());
+		unsigned __int64 block(std::min(std::min(share, max_block_size), round_to_next_multiple(file_size - offset, sector_size)));
+		if(aligned_reads) {
+			block = round_to_previous_multiple(block, sector_size);
+		}
+		unsigned __int8* const base(static_cast<unsigned __int8*>(buffer) + (set * set_size));
+		for(size_t k(0); k < order.size(); ++k) {
+			buffers[set][order[k]] = base + (k * block);
+		}
+		return static_cast<DWORD>(block);
+	};
+	// a file that read nothing has shrunk or gone bad since it was opened, and leaves its class
+	auto drop_unreadable = [&] (const std::vector<size_t>& order) {
+		find_live();
+		std::vector<bool> unreadable(names.size(), false);
+		bool any(false);
+		for(auto it(order.cbegin()), end(order.cend()); it != end; ++it) {
+			if(live[*it] && bytes_read[*it] == 0) {
+				std::wcerr << L"Could not read file " << names[*it] << L" to the end, ignoring" << std::endl;
+				unreadable[*it] = true;
+				any = true;
+			}
+		}
+		if(!any) {
+			return;
+		}
+		for(auto it(classes.begin()), end(classes.end()); it != end; ++it) {
+			it->erase(std::remove_if(it->begin(), it->end(), [&] (size_t i) { return unreadable[i]; }), it->end());
+		}
+		classes.erase(std::remove_if(classes.begin(), classes.end(), finished), classes.end());
+	};
+	// closes every file that's no longer live, other than any with a read still in flight
+	auto close_finished = [&] (const std::vector<size_t>& in_flight) {
+		find_live();
+		for(auto it(in_flight.cbegin()), end(in_flight.cend()); it != end; ++it) {
+			live[*it] = true;
+		}
+		for(size_t i(0); i < files.size(); ++i) {
+			if(!live[i] && files[i] != INVALID_HANDLE_VALUE) {
+				::CloseHandle(files[i]);
+				files[i] = INVALID_HANDLE_VALUE;
+			}
+		}
+	};
+
+	auto refine = [&] (const std::vector<unsigned __int8*>& block) {
+		instrumentation::scoped_timer comparing(instrumentation::compare_timer);
+		std::vector<equivalence_class> refined;
+		for(auto it(classes.cbegin()), end(classes.cend()); it != end; ++it) {
+			split_class(*it, block, bytes_read, first_reference, refined);
+		}
+		classes.swap(refined);
+	};
+
+	if(mapped) {
+		std::vector<HANDLE> mappings(files.size());
+		for(size_t i(0); i < files.size(); ++i) {
+			mappings[i] = ::CreateFileMappingW(files[i], NULL, PAGE_READONLY, 0, 0, NULL);
+			if(mappings[i] == nullptr) {
+				std::wcerr << L"Could not map file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", reading it instead" << std::endl;
+			}
+		}
+		ON_BLOCK_EXIT([&] {
+			for(auto it(mappings.cbegin()), end(mappings.cend()); it != end; ++it) {
+				if(*it != nullptr) {
+					::CloseHandle(*it);
+				}
+			}
+		});
+
+		std::vector<unsigned __int8*> block(files.size());
+		std::vector<memory_range> ranges;
+		bool faulted(false);
+		for(unsigned __int64 offset(0); offset < file_size && !classes.empty() && !faulted; offset += window_size) {
+			const DWORD length(static_cast<DWORD>(std::min(window_size, file_size - offset)));
+			std::vector<bool> unreadable(files.size(), false);
+			ranges.clear();
+			for(auto it(classes.cbegin()), end(classes.cend()); it != end; ++it) {
+				for(auto mit(it->cbegin()), mend(it->cend()); mit != mend; ++mit) {
+					const size_t i(*mit);
+					block[i] = mappings[i] != nullptr ? static_cast<unsigned __int8*>(::MapViewOfFile(mappings[i], FILE_MAP_READ, static_cast<DWORD>(offset >> 32), static_cast<DWORD>(offset), length))
+					                                  : nullptr;
+					bytes_read[i] = length;
+					// a mapped window is paged in rather than read, but it's brought in from the disk all the same
+					instrumentation::count(instrumentation::bytes_read, length);
+					if(block[i] != nullptr) {
+						const memory_range range = { block[i], length };
+						ranges.push_back(range);
+						continue;
+					}
+					block[i] = static_cast<unsigned __int8*>(buffer) + (i * window_size);
+					instrumentation::count(instrumentation::read_calls);
+					if(!instrumentation::timed(instrumentation::read_timer, [&] { return read_at(files[i], offset, block[i], length, bytes_read[i]); })) {
+						std::wcerr << L"Could not read file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+						unreadable[i] = true;
+					}
+				}
+			}
+			ON_BLOCK_EXIT([&] {
+				for(auto it(ranges.cbegin()), end(ranges.cend()); it != end; ++it) {
+					::UnmapViewOfFile(it->address);
+				}
+			});
+			if(prefetch_virtual_memory != nullptr && !ranges.empty()) {
+				instrumentation::scoped_timer prefetching(instrumentation::read_timer);
+				prefetch_virtual_memory(::GetCurrentProcess(), ranges.size(), &ranges[0], 0);
+			}
+
+			// files that couldn't be read have nothing to be compared by, so they leave their classes here
+			for(auto it(classes.begin()), end(classes.end()); it != end; ++it) {
+				it->erase(std::remove_if(it->begin(), it->end(), [&] (size_t i) { return unreadable[i]; }), it->end());
+			}
+			classes.erase(std::remove_if(classes.begin(), classes.end(), finished), classes.end());
+
+			faulted = !run_guarded([&] { refine(block); });
+		}
+		if(faulted) {
+			std::wcerr << L"A mapped file of size " << file_size << L" could not be paged in, comparing its group by reading instead" << std::endl;
+			// the retry opens every file again, so this attempt's handles go first to keep within the open file limit
+			for(size_t i(0); i < files.size(); ++i) {
+				if(mappings[i] != nullptr) {
+					::CloseHandle(mappings[i]);
+					mappings[i] = nullptr;
+				}
+				if(files[i] != INVALID_HANDLE_VALUE) {
+					::CloseHandle(files[i]);
+					files[i] = INVALID_HANDLE_VALUE;
+				}
+			}
+			compare_options reading(options);
+			reading.map_files = false;
+			return n_way_compare(file_size, names, buffer, total_buffer_size, reading, reference_count);
+		}
+	}
+	else if(!asynchronous) {
+		for(unsigned __int64 offset(0); offset < file_size && !classes.empty();) {
+			close_finished(std::vector<size_t>());
+			const std::vector<size_t> order(live_order());
+			const DWORD block_size(lay_out(0, order, offset));
+			read_multi_file(files, order, buffers[0], block_size, bytes_read);
+			drop_unreadable(order);
+			refine(buffers[0]);
+			offset += block_size;
+		}
+	}
+	else {
+		overlapped_reader reader(files, buffer_sets, options.queue_depth);
+		std::vector<std::vector<size_t> > orders(buffer_sets);
+		// where the next block to be started begins
+		unsigned __int64 offset(0);
+		auto start = [&] (size_t set) {
+			orders[set] = live_order();
+			const DWORD block_size(lay_out(set, orders[set], offset));
+			reader.start(set, orders[set], offset, buffers[set], block_size);
+			offset += block_size;
+		};
+		if(!classes.empty()) {
+			start(0);
+		}
+		for(size_t current(0); !classes.empty(); current = (current + 1) % buffer_sets) {
+			reader.finish(current, bytes_read);
+			const size_t next((current + 1) % buffer_sets);
+			const bool more(offset < file_size);
+			// the next block is started before this one is compared, so it still reads any files that this one is about to rule out
+			if(more && buffer_sets == 2) {
+				start(next);
+			}
+			drop_unreadable(orders[current]);
+			refine(buffers[current]);
+			close_finished(more && buffer_sets == 2 ? orders[next] : std::vector<size_t>());
+			if(classes.empty() || !more) {
+				break;
+			}
+			if(buffer_sets == 1) {
+				start(next);
+			}
+		}
+	}
+
+	// clones go in with the file they share their clusters with, or make a set with it if it matched nothing else, unless both are references
+	for(auto it(clones.cbegin()), end(clones.cend()); it != end; ++it) {
+		auto found(std::find_if(classes.begin(), classes.end(), [&] (const equivalence_class& c) {
+			return std::binary_search(c.begin(), c.end(), it->first);
+		}));
+		if(found == classes.end()) {
+			if(it->first >= first_reference) {
+				continue;
+			}
+			classes.push_back(equivalence_class(1, it->first));
+			found = classes.end() - 1;
+		}
+		found->insert(std::upper_bound(found->begin(), found->end(), it->second), it->second);
+	}
+	return duplicate_sets_in_order(names, classes);
+}
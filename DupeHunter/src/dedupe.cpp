@@ -0,0 +1,458 @@
+// dedupe.cpp : making duplicates share their data, by block cloning or hard links
+//
+
+#include "stdafx.h"
+
+#include <sstream>
+
+#include "dedupe.hpp"
+
+// block cloning arrived with Windows Server 2016, so older SDKs don't know about it
+#ifndef FSCTL_DUPLICATE_EXTENTS_TO_FILE
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 209, METHOD_BUFFERED, FILE_WRITE_DATA)
+typedef struct _DUPLICATE_EXTENTS_DATA {
+	HANDLE FileHandle;
+	LARGE_INTEGER SourceFileOffset;
+	LARGE_INTEGER TargetFileOffset;
+	LARGE_INTEGER ByteCount;
+} DUPLICATE_EXTENTS_DATA;
+#endif
+#ifndef FSCTL_GET_INTEGRITY_INFORMATION
+#define FSCTL_GET_INTEGRITY_INFORMATION CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 159, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define FSCTL_SET_INTEGRITY_INFORMATION CTL_CODE(FILE_DEVICE_FILE_SYSTEM, 160, METHOD_BUFFERED, FILE_READ_DATA | FILE_WRITE_DATA)
+typedef struct _FSCTL_GET_INTEGRITY_INFORMATION_BUFFER {
+	WORD ChecksumAlgorithm;
+	WORD Reserved;
+	DWORD Flags;
+	DWORD ChecksumChunkSizeInBytes;
+	DWORD ClusterSizeInBytes;
+} FSCTL_GET_INTEGRITY_INFORMATION_BUFFER;
+typedef struct _FSCTL_SET_INTEGRITY_INFORMATION_BUFFER {
+	WORD ChecksumAlgorithm;
+	WORD Reserved;
+	DWORD Flags;
+} FSCTL_SET_INTEGRITY_INFORMATION_BUFFER;
+#endif
+#ifndef FILE_SUPPORTS_BLOCK_REFCOUNTING
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
+#endif
+
+namespace {
+	// each clone call is kept well under the 4 GiB that ReFS will take in one go
+	const unsigned __int64 clone_chunk_size(1ULL << 30);
+	const DWORD copy_chunk_size(1024 * 1024);
+	// the name a file is built under before it takes the place of the original
+	const wchar_t temporary_suffix[] = L"~dupehunter";
+
+	std::wstring error_text(const wchar_t* what, const std::wstring& path, DWORD error) {
+		std::wostringstream text;
+		text << L"Could not " << what << L" " << path << L" with error 0x" << std::hex << error << std::dec << L", skipping";
+		return text.str();
+	}
+
+	unsigned __int64 file_time(const FILETIME& time) {
+		return (static_cast<unsigned __int64>(time.dwHighDateTime) << 32) + static_cast<unsigned __int64>(time.dwLowDateTime);
+	}
+
+	// anything that has been written to since the comparison started may not match any more
+	bool unchanged(const BY_HANDLE_FILE_INFORMATION& info, unsigned __int64 file_size, unsigned __int64 compared_since) {
+		const unsigned __int64 size((static_cast<unsigned __int64>(info.nFileSizeHigh) << 32) + static_cast<unsigned __int64>(info.nFileSizeLow));
+		return size == file_size && file_time(info.ftLastWriteTime) < compared_since;
+	}
+
+	// what a clone target has to be made to agree with
+	struct clone_source {
+		DWORD cluster_size;
+		FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity;
+		bool sparse;
+	};
+
+	bool prepare_clone_source(HANDLE source, const BY_HANDLE_FILE_INFORMATION& info, clone_source& clone) {
+		DWORD flags(0);
+		if(FALSE == ::GetVolumeInformationByHandleW(source, nullptr, 0, nullptr, nullptr, &flags, nullptr, 0) || (flags & FILE_SUPPORTS_BLOCK_REFCOUNTING) == 0) {
+			::SetLastError(ERROR_NOT_SUPPORTED);
+			return false;
+		}
+		DWORD returned(0);
+		if(FALSE == ::DeviceIoControl(source, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &clone.integrity, sizeof(clone.integrity), &returned, nullptr)) {
+			return false;
+		}
+		clone.cluster_size = clone.integrity.ClusterSizeInBytes;
+		clone.sparse = (info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) != 0;
+		return true;
+	}
+
+	// the target has to match the source's sparseness and integrity streams before ReFS will let the two share clusters
+	bool clone_into(HANDLE source, const clone_source& clone, HANDLE target, const BY_HANDLE_FILE_INFORMATION& target_info, unsigned __int64 file_size) {
+		DWORD returned(0);
+		if(clone.sparse && (target_info.dwFileAttributes & FILE_ATTRIBUTE_SPARSE_FILE) == 0) {
+			if(FALSE == ::DeviceIoControl(target, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr)) {
+				return false;
+			}
+		}
+		FSCTL_GET_INTEGRITY_INFORMATION_BUFFER target_integrity = {0};
+		if(FALSE == ::DeviceIoControl(target, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &target_integrity, sizeof(target_integrity), &returned, nullptr)) {
+			return false;
+		}
+		if(target_integrity.ChecksumAlgorithm != clone.integrity.ChecksumAlgorithm) {
+			FSCTL_SET_INTEGRITY_INFORMATION_BUFFER integrity = { clone.integrity.ChecksumAlgorithm, 0, clone.integrity.Flags };
+			if(FALSE == ::DeviceIoControl(target, FSCTL_SET_INTEGRITY_INFORMATION, &integrity, sizeof(integrity), nullptr, 0, &returned, nullptr)) {
+				return false;
+			}
+		}
+		for(unsigned __int64 offset(0); offset < file_size; offset += clone_chunk_size) {
+			DUPLICATE_EXTENTS_DATA extents = {0};
+			extents.FileHandle = source;
+			extents.SourceFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+			extents.TargetFileOffset.QuadPart = static_cast<LONGLONG>(offset);
+			// ranges have to be whole clusters; the last one can be rounded up because it runs past the end of both files
+			const unsigned __int64 length(std::min(clone_chunk_size, file_size - offset));
+			extents.ByteCount.QuadPart = static_cast<LONGLONG>(((length + clone.cluster_size - 1) / clone.cluster_size) * clone.cluster_size);
+			if(FALSE == ::DeviceIoControl(target, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &returned, nullptr)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// the hard link is made under a temporary name first, so that the target is only ever replaced, never missing
+	bool link_over(const std::wstring& source_path, const std::wstring& target_path) {
+		const std::wstring temporary_path(target_path + temporary_suffix);
+		if(FALSE == ::CreateHardLinkW(temporary_path.c_str(), source_path.c_str(), nullptr)) {
+			return false;
+		}
+		if(FALSE == ::MoveFileExW(temporary_path.c_str(), target_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			const DWORD error(::GetLastError());
+			::DeleteFileW(temporary_path.c_str());
+			::SetLastError(error);
+			return false;
+		}
+		return true;
+	}
+
+	// a line of the undo log
+	struct undo_action {
+		bool hard_link;
+		std::wstring source;
+		std::wstring target;
+	};
+
+	size_t processor_count() {
+		SYSTEM_INFO system_info = {0};
+		::GetSystemInfo(&system_info);
+		return system_info.dwNumberOfProcessors;
+	}
+
+	bool same_file(const BY_HANDLE_FILE_INFORMATION& lhs, const BY_HANDLE_FILE_INFORMATION& rhs) {
+		return lhs.dwVolumeSerialNumber == rhs.dwVolumeSerialNumber && lhs.nFileIndexHigh == rhs.nFileIndexHigh && lhs.nFileIndexLow == rhs.nFileIndexLow;
+	}
+
+	// writes a fresh copy of source's data, and puts it in place of target. if check_target is set, target has to still have the same
+	// contents as source, as it won't if it was changed after being cloned; it's read alongside to make sure.
+	bool copy_over(const std::wstring& source_path, const std::wstring& target_path, bool check_target, std::wstring& failure) {
+		HANDLE source(::CreateFileW(source_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0));
+		if(source == INVALID_HANDLE_VALUE) {
+			failure = error_text(L"open", source_path, ::GetLastError());
+			return false;
+		}
+		ON_BLOCK_EXIT([&] {
+			if(source != INVALID_HANDLE_VALUE) {
+				::CloseHandle(source);
+			}
+		});
+		HANDLE target(::CreateFileW(target_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0));
+		if(target == INVALID_HANDLE_VALUE) {
+			failure = error_text(L"open", target_path, ::GetLastError());
+			return false;
+		}
+		ON_BLOCK_EXIT([&] {
+			if(target != INVALID_HANDLE_VALUE) {
+				::CloseHandle(target);
+			}
+		});
+		BY_HANDLE_FILE_INFORMATION target_info = {0};
+		::GetFileInformationByHandle(target, &target_info);
+
+		const std::wstring temporary_path(target_path + temporary_suffix);
+		HANDLE copy(::CreateFileW(temporary_path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_NEW, FILE_FLAG_SEQUENTIAL_SCAN, 0));
+		if(copy == INVALID_HANDLE_VALUE) {
+			failure = error_text(L"create", temporary_path, ::GetLastError());
+			return false;
+		}
+		bool copied(false);
+		ON_BLOCK_EXIT([&] {
+			if(copy != INVALID_HANDLE_VALUE) {
+				::CloseHandle(copy);
+			}
+			if(!copied) {
+				::DeleteFileW(temporary_path.c_str());
+			}
+		});
+
+		std::vector<unsigned __int8> buffer(copy_chunk_size);
+		std::vector<unsigned __int8> check(check_target ? copy_chunk_size : 0);
+		for(;;) {
+			DWORD bytes_read(0);
+			if(FALSE == ::ReadFile(source, &buffer[0], copy_chunk_size, &bytes_read, nullptr)) {
+				failure = error_text(L"read", source_path, ::GetLastError());
+				return false;
+			}
+			if(check_target) {
+				DWORD check_read(0);
+				if(FALSE == ::ReadFile(target, &check[0], copy_chunk_size, &check_read, nullptr)) {
+					failure = error_text(L"read", target_path, ::GetLastError());
+					return false;
+				}
+				if(check_read != bytes_read || 0 != std::memcmp(&buffer[0], &check[0], bytes_read)) {
+					failure = target_path + L" no longer matches " + source_path + L", skipping";
+					return false;
+				}
+			}
+			if(bytes_read == 0) {
+				break;
+			}
+			DWORD written(0);
+			if(FALSE == ::WriteFile(copy, &buffer[0], bytes_read, &written, nullptr) || written != bytes_read) {
+				failure = error_text(L"write", temporary_path, ::GetLastError());
+				return false;
+			}
+		}
+		::SetFileTime(copy, &target_info.ftCreationTime, &target_info.ftLastAccessTime, &target_info.ftLastWriteTime);
+		::CloseHandle(copy);
+		copy = INVALID_HANDLE_VALUE;
+		// a hard link's source is the very file being replaced, so neither can be held open while it is
+		::CloseHandle(target);
+		target = INVALID_HANDLE_VALUE;
+		::CloseHandle(source);
+		source = INVALID_HANDLE_VALUE;
+
+		if(FALSE == ::MoveFileExW(temporary_path.c_str(), target_path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+			failure = error_text(L"replace", target_path, ::GetLastError());
+			return false;
+		}
+		copied = true;
+		::SetFileAttributesW(target_path.c_str(), target_info.dwFileAttributes);
+		return true;
+	}
+}
+
+deduplicator::deduplicator(const dedupe_options& options_, const file_table& table_, std::wostream& messages_) : options(options_), table(table_), messages(messages_), undo_log(INVALID_HANDLE_VALUE), pool(processor_count()) {
+	::InitializeCriticalSection(&lock);
+	if(!options.dry_run && !options.undo_log_path.empty()) {
+		undo_log = ::CreateFileW(options.undo_log_path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, 0, 0);
+		if(undo_log == INVALID_HANDLE_VALUE) {
+			::DeleteCriticalSection(&lock);
+			throw std::exception("could not open the undo log");
+		}
+		// a new log starts with a byte order mark, so that it reads as UTF-16 in anything else that opens it
+		LARGE_INTEGER size = {0};
+		if(FALSE != ::GetFileSizeEx(undo_log, &size) && size.QuadPart == 0) {
+			const wchar_t mark(0xfeff);
+			DWORD written(0);
+			::WriteFile(undo_log, &mark, sizeof(mark), &written, nullptr);
+		}
+	}
+}
+
+deduplicator::~deduplicator() {
+	try {
+		pool.wait();
+	} catch(...) {
+	}
+	if(undo_log != INVALID_HANDLE_VALUE) {
+		::CloseHandle(undo_log);
+	}
+	::DeleteCriticalSection(&lock);
+}
+
+void deduplicator::add(unsigned __int64 file_size, const duplicate_sets_type& duplicates) {
+	for(auto it(duplicates.cbegin()), end(duplicates.cend()); it != end; ++it) {
+		const std::vector<file_table::file_index> files(*it);
+		pool.submit([this, file_size, files] (size_t) {
+			this->deduplicate_set(file_size, files);
+		});
+	}
+}
+
+dedupe_statistics deduplicator::finish() {
+	pool.wait();
+	return statistics;
+}
+
+void deduplicator::message(const std::wstring& text) {
+	::EnterCriticalSection(&lock);
+	ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+	messages << text << std::endl;
+}
+
+void deduplicator::skipped() {
+	::EnterCriticalSection(&lock);
+	ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+	++statistics.files_skipped;
+}
+
+// each line of the log is the method, the file that was kept, and the file that was made to share its data, separated by tabs
+void deduplicator::record(const std::wstring& source, const std::wstring& target, unsigned __int64 file_size) {
+	const std::wstring line((options.method == reflink_dedupe ? L"reflink\t" : L"hardlink\t") + source + L"\t" + target + L"\r\n");
+	::EnterCriticalSection(&lock);
+	ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+	++statistics.files_deduplicated;
+	statistics.bytes_reclaimed += file_size;
+	if(undo_log != INVALID_HANDLE_VALUE) {
+		DWORD written(0);
+		if(FALSE == ::WriteFile(undo_log, line.c_str(), static_cast<DWORD>(line.size() * sizeof(wchar_t)), &written, nullptr)) {
+			messages << L"Could not write to undo log " << options.undo_log_path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+		}
+	}
+}
+
+void deduplicator::deduplicate_set(unsigned __int64 file_size, const std::vector<file_table::file_index>& files) {
+	const std::wstring source_path(table.path_of(files[0]));
+	const unsigned __int32 source_volume(table.directory(table.file(files[0]).directory).volume);
+	const wchar_t* const verb(options.method == reflink_dedupe ? L"clone" : L"link");
+
+	// while a clone is being made, nothing else gets to write to the source; a hard link has to let go of it before it can be made
+	HANDLE source(::CreateFileW(source_path.c_str(), GENERIC_READ, FILE_SHARE_READ | (options.method == hardlink_dedupe ? FILE_SHARE_WRITE | FILE_SHARE_DELETE : 0), nullptr, OPEN_EXISTING, 0, 0));
+	BY_HANDLE_FILE_INFORMATION source_info = {0};
+	clone_source clone = {0};
+	std::wstring failure;
+	if(source == INVALID_HANDLE_VALUE) {
+		failure = error_text(L"open", source_path, ::GetLastError());
+	}
+	else if(FALSE == ::GetFileInformationByHandle(source, &source_info) || !unchanged(source_info, file_size, options.compared_since)) {
+		failure = source_path + L" has changed since it was compared, skipping its duplicates";
+	}
+	else if(options.method == reflink_dedupe && !prepare_clone_source(source, source_info, clone)) {
+		failure = error_text(L"prepare to clone", source_path, ::GetLastError());
+	}
+	ON_BLOCK_EXIT([=] {
+		if(source != INVALID_HANDLE_VALUE) {
+			::CloseHandle(source);
+		}
+	});
+	if(!failure.empty()) {
+		message(failure);
+		for(size_t i(1); i < files.size(); ++i) {
+			skipped();
+		}
+		return;
+	}
+
+	for(size_t i(1); i < files.size(); ++i) {
+		const std::wstring target_path(table.path_of(files[i]));
+		if(table.directory(table.file(files[i]).directory).volume != source_volume) {
+			message(target_path + L" is not on the same volume as " + source_path + L", skipping");
+			skipped();
+			continue;
+		}
+		if(options.dry_run) {
+			message(std::wstring(L"Would ") + verb + L" " + target_path + L" to " + source_path);
+			continue;
+		}
+
+		// held open with writers shut out until the clone is done; for a hard link, only long enough to check it
+		HANDLE target(::CreateFileW(target_path.c_str(), GENERIC_READ | (options.method == reflink_dedupe ? GENERIC_WRITE : 0), FILE_SHARE_READ | (options.method == hardlink_dedupe ? FILE_SHARE_WRITE | FILE_SHARE_DELETE : 0), nullptr, OPEN_EXISTING, 0, 0));
+		if(target == INVALID_HANDLE_VALUE) {
+			message(error_text(L"open", target_path, ::GetLastError()));
+			skipped();
+			continue;
+		}
+		ON_BLOCK_EXIT([&] {
+			if(target != INVALID_HANDLE_VALUE) {
+				::CloseHandle(target);
+			}
+		});
+		BY_HANDLE_FILE_INFORMATION target_info = {0};
+		if(FALSE == ::GetFileInformationByHandle(target, &target_info) || !unchanged(target_info, file_size, options.compared_since)) {
+			message(target_path + L" has changed since it was compared, skipping");
+			skipped();
+			continue;
+		}
+		if(same_file(source_info, target_info)) {
+			continue;
+		}
+
+		bool done(false);
+		if(options.method == reflink_dedupe) {
+			done = clone_into(source, clone, target, target_info, file_size);
+		}
+		else {
+			::CloseHandle(target);
+			target = INVALID_HANDLE_VALUE;
+			done = link_over(source_path, target_path);
+		}
+		if(!done) {
+			message(error_text(verb, target_path, ::GetLastError()));
+			skipped();
+			continue;
+		}
+		record(source_path, target_path, file_size);
+	}
+}
+
+bool undo_dedupe(const std::wstring& undo_log_path, std::wostream& messages) {
+	HANDLE log(::CreateFileW(undo_log_path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0));
+	if(log == INVALID_HANDLE_VALUE) {
+		messages << L"Could not open undo log " << undo_log_path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+		return false;
+	}
+	ON_BLOCK_EXIT([=] { ::CloseHandle(log); });
+	LARGE_INTEGER size = {0};
+	::GetFileSizeEx(log, &size);
+	std::wstring text(static_cast<size_t>(size.QuadPart) / sizeof(wchar_t), L'\0');
+	DWORD bytes_read(0);
+	if(!text.empty() && (FALSE == ::ReadFile(log, &text[0], static_cast<DWORD>(text.size() * sizeof(wchar_t)), &bytes_read, nullptr) || bytes_read != text.size() * sizeof(wchar_t))) {
+		messages << L"Could not read undo log " << undo_log_path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+		return false;
+	}
+
+	std::vector<undo_action> actions;
+	size_t position(!text.empty() && text[0] == 0xfeff ? 1 : 0);
+	while(position < text.size()) {
+		size_t line_end(text.find(L"\r\n", position));
+		if(line_end == std::wstring::npos) {
+			line_end = text.size();
+		}
+		const std::wstring line(text, position, line_end - position);
+		position = line_end + 2;
+		const size_t first_tab(line.find(L'\t'));
+		const size_t second_tab(first_tab == std::wstring::npos ? std::wstring::npos : line.find(L'\t', first_tab + 1));
+		if(second_tab == std::wstring::npos) {
+			continue;
+		}
+		const undo_action a = { line.compare(0, first_tab, L"hardlink") == 0, line.substr(first_tab + 1, second_tab - first_tab - 1), line.substr(second_tab + 1) };
+		actions.push_back(a);
+	}
+
+	bool all_undone(true);
+	for(auto it(actions.crbegin()), end(actions.crend()); it != end; ++it) {
+		// a hard link has to still be one; if it was replaced since, there's nothing of ours left to undo
+		if(it->hard_link) {
+			BY_HANDLE_FILE_INFORMATION source_info = {0}, target_info = {0};
+			HANDLE source(::CreateFileW(it->source.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, 0));
+			HANDLE target(::CreateFileW(it->target.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, 0));
+			const bool linked(source != INVALID_HANDLE_VALUE && target != INVALID_HANDLE_VALUE
+			               && FALSE != ::GetFileInformationByHandle(source, &source_info) && FALSE != ::GetFileInformationByHandle(target, &target_info)
+			               && same_file(source_info, target_info));
+			if(source != INVALID_HANDLE_VALUE) {
+				::CloseHandle(source);
+			}
+			if(target != INVALID_HANDLE_VALUE) {
+				::CloseHandle(target);
+			}
+			if(!linked) {
+				messages << it->target << L" is no longer a hard link to " << it->source << L", skipping" << std::endl;
+				all_undone = false;
+				continue;
+			}
+		}
+		std::wstring failure;
+		if(!copy_over(it->source, it->target, !it->hard_link, failure)) {
+			messages << failure << std::endl;
+			all_undone = false;
+			continue;
+		}
+		messages << L"Gave " << it->target << L" its own copy of " << it->source << std::endl;
+	}
+	return all_undone;
+}
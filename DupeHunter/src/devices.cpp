@@ -0,0 +1,67 @@
+// devices.cpp : finding the disks behind volumes, and how hard each can be driven
+//
+
+#include "stdafx.h"
+
+#include "devices.hpp"
+
+namespace {
+	const size_t rotational_concurrency(1);
+	const size_t solid_state_concurrency(32);
+	const size_t unknown_concurrency(4);
+
+	// \\?\Volume{guid}, without the trailing backslash, opens the volume itself rather than its root directory
+	std::wstring volume_device_path(HANDLE handle) {
+		const DWORD length(::GetFinalPathNameByHandleW(handle, nullptr, 0, VOLUME_NAME_GUID));
+		if(length == 0) {
+			return std::wstring();
+		}
+		std::vector<wchar_t> buffer(length + 1);
+		if(::GetFinalPathNameByHandleW(handle, &buffer[0], static_cast<DWORD>(buffer.size()), VOLUME_NAME_GUID) == 0) {
+			return std::wstring();
+		}
+		const std::wstring path(&buffer[0]);
+		const std::wstring::size_type end(path.find(L'\\', 4));
+		return end == std::wstring::npos ? path : path.substr(0, end);
+	}
+}
+
+device_info identify_device(HANDLE handle, DWORD volume) {
+	device_info device;
+	device.volume = volume;
+	if(handle == INVALID_HANDLE_VALUE) {
+		return device;
+	}
+	const std::wstring volume_path(volume_device_path(handle));
+	if(volume_path.empty()) {
+		return device;
+	}
+	// neither query needs any access to the volume, so this works without elevation
+	HANDLE volume_handle(::CreateFileW(volume_path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, 0));
+	if(volume_handle == INVALID_HANDLE_VALUE) {
+		return device;
+	}
+	ON_BLOCK_EXIT([=] { ::CloseHandle(volume_handle); });
+
+	DWORD returned(0);
+	STORAGE_DEVICE_NUMBER number = {0};
+	if(FALSE != ::DeviceIoControl(volume_handle, IOCTL_STORAGE_GET_DEVICE_NUMBER, nullptr, 0, &number, sizeof(number), &returned, nullptr)) {
+		device.disk_number = number.DeviceNumber;
+	}
+	STORAGE_PROPERTY_QUERY query = {};
+	query.PropertyId = StorageDeviceSeekPenaltyProperty;
+	query.QueryType = PropertyStandardQuery;
+	DEVICE_SEEK_PENALTY_DESCRIPTOR penalty = {0};
+	if(FALSE != ::DeviceIoControl(volume_handle, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &penalty, sizeof(penalty), &returned, nullptr) && returned >= sizeof(penalty)) {
+		device.seek_penalty_known = true;
+		device.seek_penalty = FALSE != penalty.IncursSeekPenalty;
+	}
+	return device;
+}
+
+size_t device_concurrency(const device_info& device) {
+	if(!device.seek_penalty_known) {
+		return unknown_concurrency;
+	}
+	return device.seek_penalty ? rotational_concurrency : solid_state_concurrency;
+}
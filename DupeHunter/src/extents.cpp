@@ -0,0 +1,65 @@
+// extents.cpp : finding where files' data is on disk
+//
+
+#include "stdafx.h"
+
+#include "extents.hpp"
+
+namespace {
+	const unsigned __int64 hole(~0ULL);
+}
+
+unsigned __int64 file_extents::first_cluster() const {
+	for(auto it(runs.cbegin()), end(runs.cend()); it != end; ++it) {
+		if(it->first != hole) {
+			return it->first;
+		}
+	}
+	return hole;
+}
+
+bool file_extents::shares_all_clusters(const file_extents& rhs) const {
+	return first_cluster() != hole && volume == rhs.volume && runs == rhs.runs;
+}
+
+bool query_extents(HANDLE file, file_extents& extents) {
+	extents.runs.clear();
+	BY_HANDLE_FILE_INFORMATION info = {0};
+	if(FALSE == ::GetFileInformationByHandle(file, &info)) {
+		return false;
+	}
+	extents.volume = info.dwVolumeSerialNumber;
+
+	// room for a good few runs at a time; heavily fragmented files take several calls
+	std::vector<unsigned __int64> buffer((sizeof(RETRIEVAL_POINTERS_BUFFER) + (63 * 2 * sizeof(LARGE_INTEGER))) / sizeof(unsigned __int64) + 1);
+	const DWORD buffer_bytes(static_cast<DWORD>(buffer.size() * sizeof(unsigned __int64)));
+	const RETRIEVAL_POINTERS_BUFFER* pointers(reinterpret_cast<const RETRIEVAL_POINTERS_BUFFER*>(&buffer[0]));
+	STARTING_VCN_INPUT_BUFFER start = {0};
+	for(;;) {
+		// the handle may well have been opened for overlapped I/O, in which case the call has to be given somewhere to complete
+		OVERLAPPED o = {0};
+		DWORD returned(0);
+		BOOL ok(::DeviceIoControl(file, FSCTL_GET_RETRIEVAL_POINTERS, &start, sizeof(start), &buffer[0], buffer_bytes, &returned, &o));
+		if(FALSE == ok && ::GetLastError() == ERROR_IO_PENDING) {
+			ok = ::GetOverlappedResult(file, &o, &returned, TRUE);
+		}
+		const DWORD error(FALSE == ok ? ::GetLastError() : ERROR_SUCCESS);
+		if(error == ERROR_HANDLE_EOF) {
+			// no clusters at all: the file is empty, or resident in its MFT record
+			return true;
+		}
+		if(error != ERROR_SUCCESS && error != ERROR_MORE_DATA) {
+			return false;
+		}
+		unsigned __int64 vcn(static_cast<unsigned __int64>(pointers->StartingVcn.QuadPart));
+		for(DWORD i(0); i < pointers->ExtentCount; ++i) {
+			const unsigned __int64 next_vcn(static_cast<unsigned __int64>(pointers->Extents[i].NextVcn.QuadPart));
+			extents.runs.push_back(std::make_pair(static_cast<unsigned __int64>(pointers->Extents[i].Lcn.QuadPart), next_vcn - vcn));
+			vcn = next_vcn;
+		}
+		if(error == ERROR_SUCCESS || pointers->ExtentCount == 0) {
+			return true;
+		}
+		start.StartingVcn.QuadPart = static_cast<LONGLONG>(vcn);
+	}
+}
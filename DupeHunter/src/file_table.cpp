@@ -0,0 +1,92 @@
+// file_table.cpp : compact storage for every directory and file the scan finds
+//
+
+#include "stdafx.h"
+
+#include "file_table.hpp"
+
+namespace {
+	// 2 MiB of names to a block; no name is anywhere near this long, so one always fits in a fresh block
+	const unsigned int block_bits(20);
+	const size_t block_size(static_cast<size_t>(1) << block_bits);
+}
+
+const wchar_t* file_table::name_at(unsigned __int64 position) const {
+	return &blocks[static_cast<size_t>(position >> block_bits)][static_cast<size_t>(position & (block_size - 1))];
+}
+
+unsigned __int64 file_table::store_name(const wchar_t* name, size_t name_length) {
+	if(blocks.empty() || blocks.back().size() + name_length > block_size) {
+		if(name_length > block_size) {
+			throw std::exception("name too long for the file table");
+		}
+		blocks.push_back(std::vector<wchar_t>());
+		blocks.back().reserve(block_size);
+	}
+	std::vector<wchar_t>& block(blocks.back());
+	const unsigned __int64 position((static_cast<unsigned __int64>(blocks.size() - 1) << block_bits) + block.size());
+	block.insert(block.end(), name, name + name_length);
+	return position;
+}
+
+file_table::directory_index file_table::add_directory(directory_index parent, const wchar_t* name, size_t name_length, unsigned __int32 volume, device_index device) {
+	const directory_record record = { store_name(name, name_length), parent, static_cast<unsigned __int32>(name_length), volume, device };
+	directories.push_back(record);
+	return static_cast<directory_index>(directories.size() - 1);
+}
+
+file_table::device_index file_table::add_device(const device_info& info) {
+	devices.push_back(info);
+	return static_cast<device_index>(devices.size() - 1);
+}
+
+file_table::file_index file_table::add_file(directory_index directory, const wchar_t* name, size_t name_length, unsigned __int64 size, unsigned __int64 file_id) {
+	const file_record record = { size, file_id, store_name(name, name_length), directory, static_cast<unsigned __int32>(name_length) };
+	files.push_back(record);
+	return static_cast<file_index>(files.size() - 1);
+}
+
+file_table::file_index file_table::take_files(file_table& other) {
+	const file_index first(static_cast<file_index>(files.size()));
+	// other's blocks go on the end of ours, so its names move up by however many blocks we already had
+	const unsigned __int64 shift(static_cast<unsigned __int64>(blocks.size()) << block_bits);
+	for(auto it(other.blocks.begin()), end(other.blocks.end()); it != end; ++it) {
+		blocks.push_back(std::move(*it));
+	}
+	while(!other.files.empty()) {
+		file_record record(other.files.front());
+		record.name += shift;
+		files.push_back(record);
+		other.files.pop_front();
+	}
+	std::vector<std::vector<wchar_t> >().swap(other.blocks);
+	return first;
+}
+
+void file_table::append_path(std::wstring& path, directory_index index) const {
+	const directory_record& record(directories[index]);
+	if(record.parent != no_directory) {
+		append_path(path, record.parent);
+		if(!path.empty() && path[path.size() - 1] != L'\\') {
+			path.push_back(L'\\');
+		}
+	}
+	path.append(name_at(record.name), record.name_length);
+}
+
+std::wstring file_table::directory_path(directory_index index) const {
+	std::wstring path;
+	append_path(path, index);
+	return path;
+}
+
+std::wstring file_table::path_of(file_index index) const {
+	const file_record& record(files[index]);
+	std::wstring path;
+	append_path(path, record.directory);
+	if(!path.empty() && path[path.size() - 1] != L'\\') {
+		path.push_back(L'\\');
+	}
+	path.append(name_at(record.name), record.name_length);
+	return path;
+}
@@ -0,0 +1,216 @@
+// fingerprint.cpp : content hashes and the persistent cache that lets unchanged files skip being read
+//
+
+#include "stdafx.h"
+
+#include "fingerprint.hpp"
+#include "instrumentation.hpp"
+
+namespace {
+	const unsigned __int32 cache_magic(0x43484844); // "DHHC"
+	const unsigned __int32 cache_version(1);
+	const unsigned __int64 minimum_slot_count(1024);
+
+	// two differently seeded 64-bit hashes, so that grouping on the hash alone is safe at the scale of a whole volume
+	content_hash hash_contents(HANDLE file, void* buffer, size_t buffer_size) {
+		util::xxhash64 low(0);
+		util::xxhash64 high(0x5bd1e9955bd1e995ULL);
+		const DWORD chunk(static_cast<DWORD>(std::min<size_t>(buffer_size, 16 * 1024 * 1024)));
+		DWORD bytes_read(0);
+		while(FALSE != instrumentation::timed(instrumentation::read_timer, [&] { return ::ReadFile(file, buffer, chunk, &bytes_read, NULL); }) && 0 != bytes_read) {
+			instrumentation::count(instrumentation::read_calls);
+			instrumentation::count(instrumentation::bytes_read, bytes_read);
+			instrumentation::scoped_timer hashing(instrumentation::compare_timer);
+			low.update(buffer, bytes_read);
+			high.update(buffer, bytes_read);
+		}
+		const content_hash hash = { low.digest(), high.digest() };
+		return hash;
+	}
+}
+
+hash_cache::hash_cache(const std::wstring& path_) : path(path_), table_header(nullptr), slots(nullptr), hit_count(0), miss_count(0) {
+	::InitializeCriticalSection(&lock);
+	if(!mapped.open(path)) {
+		if(::GetLastError() != ERROR_FILE_NOT_FOUND) {
+			std::wcerr << L"Could not map hash cache " << path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+		}
+		return;
+	}
+	const header* h(static_cast<const header*>(mapped.data()));
+	if(mapped.size() < sizeof(header)
+	|| h->magic != cache_magic
+	|| h->version != cache_version
+	|| h->slot_count == 0
+	|| (h->slot_count & (h->slot_count - 1)) != 0
+	|| mapped.size() != sizeof(header) + (h->slot_count * sizeof(entry))) {
+		std::wcerr << L"Hash cache " << path << L" is not in a format I understand, ignoring" << std::endl;
+		mapped.close();
+		return;
+	}
+	table_header = h;
+	slots = reinterpret_cast<const entry*>(table_header + 1);
+}
+
+hash_cache::~hash_cache() {
+	::DeleteCriticalSection(&lock);
+}
+
+size_t hash_cache::slot_for(const file_identity& identity, unsigned __int64 slot_count) {
+	unsigned __int64 h((identity.file_id ^ (identity.volume * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL);
+	h ^= h >> 33;
+	return static_cast<size_t>(h & (slot_count - 1));
+}
+
+// the mapping is never written while it's in use, so readers need no synchronization at all
+bool hash_cache::find(const file_identity& identity, content_hash& hash) const {
+	if(slots != nullptr) {
+		const unsigned __int64 slot_count(table_header->slot_count);
+		for(size_t i(slot_for(identity, slot_count)), probes(0); probes < slot_count; i = (i + 1) & (slot_count - 1), ++probes) {
+			// zero-length files are never compared, so they never get cached, so a zero size marks an empty slot
+			if(slots[i].identity.size == 0) {
+				break;
+			}
+			if(slots[i].identity == identity) {
+				hash = slots[i].hash;
+				::InterlockedIncrement64(&hit_count);
+				return true;
+			}
+		}
+	}
+	::InterlockedIncrement64(&miss_count);
+	return false;
+}
+
+void hash_cache::insert(const file_identity& identity, const content_hash& hash) {
+	const entry e = { identity, hash };
+	::EnterCriticalSection(&lock);
+	ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+	added.push_back(e);
+}
+
+unsigned __int64 hash_cache::hits() const {
+	return static_cast<unsigned __int64>(hit_count);
+}
+
+unsigned __int64 hash_cache::misses() const {
+	return static_cast<unsigned __int64>(miss_count);
+}
+
+void hash_cache::save() {
+	if(added.empty()) {
+		return;
+	}
+	// a file's newest hash replaces whatever was cached for it before
+	std::map<std::pair<unsigned __int64, unsigned __int64>, entry> entries;
+	if(slots != nullptr) {
+		for(unsigned __int64 i(0); i < table_header->slot_count; ++i) {
+			if(slots[i].identity.size != 0) {
+				entries[std::make_pair(slots[i].identity.volume, slots[i].identity.file_id)] = slots[i];
+			}
+		}
+	}
+	for(auto it(added.cbegin()), end(added.cend()); it != end; ++it) {
+		entries[std::make_pair(it->identity.volume, it->identity.file_id)] = *it;
+	}
+
+	// kept no more than half full, so that probe sequences stay short
+	unsigned __int64 slot_count(minimum_slot_count);
+	while(slot_count < entries.size() * 2) {
+		slot_count *= 2;
+	}
+	std::vector<entry> table(static_cast<size_t>(slot_count));
+	std::memset(&table[0], 0, table.size() * sizeof(entry));
+	for(auto it(entries.cbegin()), end(entries.cend()); it != end; ++it) {
+		size_t i(slot_for(it->second.identity, slot_count));
+		while(table[i].identity.size != 0) {
+			i = (i + 1) & (slot_count - 1);
+		}
+		table[i] = it->second;
+	}
+	const header h = { cache_magic, cache_version, slot_count, static_cast<unsigned __int64>(entries.size()) };
+
+	const std::wstring temporary_path(path + L".tmp");
+	std::vector<std::pair<const void*, size_t> > pieces;
+	pieces.push_back(std::make_pair(static_cast<const void*>(&h), sizeof(h)));
+	pieces.push_back(std::make_pair(static_cast<const void*>(&table[0]), table.size() * sizeof(entry)));
+	if(!util::write_file(temporary_path, pieces)) {
+		std::wcerr << L"Could not write hash cache " << temporary_path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+		return;
+	}
+	// the old table has to be let go of before it can be replaced
+	mapped.close();
+	table_header = nullptr;
+	slots = nullptr;
+	if(FALSE == ::MoveFileExW(temporary_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		std::wcerr << L"Could not replace hash cache " << path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+	}
+}
+
+bool identify_file(HANDLE file, file_identity& identity) {
+	BY_HANDLE_FILE_INFORMATION info = {0};
+	FILE_BASIC_INFO basic = {0};
+	if(FALSE == ::GetFileInformationByHandle(file, &info) || FALSE == ::GetFileInformationByHandleEx(file, FileBasicInfo, &basic, sizeof(basic))) {
+		return false;
+	}
+	identity.volume = info.dwVolumeSerialNumber;
+	identity.file_id = (static_cast<unsigned __int64>(info.nFileIndexHigh) << 32) + info.nFileIndexLow;
+	identity.size = (static_cast<unsigned __int64>(info.nFileSizeHigh) << 32) + info.nFileSizeLow;
+	identity.last_write_time = static_cast<unsigned __int64>(basic.LastWriteTime.QuadPart);
+	identity.change_time = static_cast<unsigned __int64>(basic.ChangeTime.QuadPart);
+	return true;
+}
+
+std::vector<std::vector<size_t> > fingerprint_groups(const std::vector<std::wstring>& names, void* buffer, size_t buffer_size, hash_cache* cache) {
+	std::vector<std::pair<content_hash, size_t> > hashes;
+	hashes.reserve(names.size());
+	std::set<std::pair<unsigned __int64, unsigned __int64> > file_ids;
+	for(size_t i(0); i < names.size(); ++i) {
+		HANDLE file(instrumentation::timed(instrumentation::open_timer, [&] {
+			return ::CreateFileW(names[i].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+		}));
+		if(file == INVALID_HANDLE_VALUE) {
+			std::wcerr << L"Could not open file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			continue;
+		}
+		instrumentation::count(instrumentation::files_opened);
+		ON_BLOCK_EXIT([=] { ::CloseHandle(file); });
+		file_identity identity = {0};
+		const bool identified(identify_file(file, identity));
+		if(identified) {
+			// skip hard linked "duplicates" as they occupy zero additional space
+			if(!file_ids.insert(std::make_pair(identity.volume, identity.file_id)).second) {
+				std::wcerr << L"Skipping file " << names[i] << L" due to hard links" << std::endl;
+				continue;
+			}
+		}
+		content_hash hash = {0};
+		if(!identified || identity.size == 0 || cache == nullptr || !cache->find(identity, hash)) {
+			hash = hash_contents(file, buffer, buffer_size);
+			if(identified && identity.size != 0 && cache != nullptr) {
+				cache->insert(identity, hash);
+			}
+		}
+		hashes.push_back(std::make_pair(hash, i));
+	}
+	// sorting on (hash, index) keeps each group in name order
+	std::sort(hashes.begin(), hashes.end());
+
+	std::vector<std::vector<size_t> > groups;
+	for(size_t first(0), last(0); first < hashes.size(); first = last) {
+		for(last = first + 1; last < hashes.size() && hashes[last].first == hashes[first].first; ++last) {
+		}
+		if(last - first > 1) {
+			std::vector<size_t> group;
+			group.reserve(last - first);
+			for(size_t i(first); i < last; ++i) {
+				group.push_back(hashes[i].second);
+			}
+			groups.push_back(std::move(group));
+		}
+	}
+	std::sort(groups.begin(), groups.end(), [] (const std::vector<size_t>& lhs, const std::vector<size_t>& rhs) {
+		return lhs.front() < rhs.front();
+	});
+	return groups;
+}
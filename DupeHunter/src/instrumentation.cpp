@@ -0,0 +1,289 @@
+// instrumentation.cpp : per-thread counters and timers, progress lines, and the summary at the end of a run
+//
+
+#include "stdafx.h"
+
+#include <sstream>
+#include <iomanip>
+
+#include "instrumentation.hpp"
+
+namespace instrumentation {
+	bool enabled(false);
+}
+
+namespace {
+	// files up to 4 KiB, 64 KiB, 1 MiB, 16 MiB, 256 MiB, and anything larger
+	const size_t size_class_count(6);
+	// up to 1 microsecond, 2, 4, and so on, with the last taking everything longer
+	const size_t latency_bucket_count(40);
+
+	const wchar_t* const timer_names[instrumentation::timer_count] = { L"traversal", L"filter", L"open", L"read", L"compare", L"report" };
+	const wchar_t* const counter_names[instrumentation::counter_count] = { L"directories_listed", L"names_filtered", L"files_found", L"files_opened", L"read_calls",
+	                                                                       L"bytes_read", L"groups_compared", L"files_compared", L"bytes_compared" };
+	const wchar_t* const phase_names[instrumentation::phase_count] = { L"scan", L"compare", L"finish" };
+
+	struct shared_state {
+		shared_state() : slot(::TlsAlloc()), frequency(0), current(instrumentation::done_phase), group_total(0), byte_total(0) {
+			::InitializeCriticalSection(&lock);
+			LARGE_INTEGER ticks_per_second = {0};
+			::QueryPerformanceFrequency(&ticks_per_second);
+			frequency = static_cast<unsigned __int64>(ticks_per_second.QuadPart);
+			std::memset(phase_started, 0, sizeof(phase_started));
+			std::memset(latency, 0, sizeof(latency));
+		}
+
+		~shared_state() {
+			::DeleteCriticalSection(&lock);
+			::TlsFree(slot);
+		}
+
+		const DWORD slot;
+		CRITICAL_SECTION lock;
+		// every thread's totals, which stay put for as long as the process lasts, so a thread can keep hold of its own without the lock
+		std::deque<instrumentation::thread_totals> threads;
+		unsigned __int64 frequency;
+		unsigned __int64 phase_started[instrumentation::done_phase + 1];
+		instrumentation::phase current;
+		size_t group_total;
+		unsigned __int64 byte_total;
+		unsigned __int64 latency[size_class_count][latency_bucket_count];
+
+	private:
+		shared_state(const shared_state&);
+		shared_state& operator=(const shared_state&);
+	};
+
+	shared_state shared;
+
+	double seconds(unsigned __int64 ticks) {
+		return static_cast<double>(ticks) / static_cast<double>(shared.frequency);
+	}
+
+	// the threads write their totals without any locking, so a sum taken while they're running may be a moment out of date
+	instrumentation::thread_totals sum() {
+		instrumentation::thread_totals total = {0};
+		::EnterCriticalSection(&shared.lock);
+		ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+		for(auto it(shared.threads.cbegin()), end(shared.threads.cend()); it != end; ++it) {
+			for(size_t i(0); i < instrumentation::counter_count; ++i) {
+				total.counters[i] += it->counters[i];
+			}
+			for(size_t i(0); i < instrumentation::timer_count; ++i) {
+				total.ticks[i] += it->ticks[i];
+			}
+		}
+		return total;
+	}
+
+	void write_duration(std::wostream& out, double total_seconds) {
+		const unsigned __int64 whole(static_cast<unsigned __int64>(total_seconds));
+		out << (whole / 3600) << L':' << std::setfill(L'0') << std::setw(2) << ((whole / 60) % 60) << L':' << std::setw(2) << (whole % 60) << std::setfill(L' ');
+	}
+}
+
+namespace instrumentation {
+	void turn_on() {
+		enabled = true;
+	}
+
+	thread_totals& this_thread() {
+		thread_totals* totals(static_cast<thread_totals*>(::TlsGetValue(shared.slot)));
+		if(totals == nullptr) {
+			::EnterCriticalSection(&shared.lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+			shared.threads.push_back(thread_totals());
+			totals = &shared.threads.back();
+			::TlsSetValue(shared.slot, totals);
+		}
+		return *totals;
+	}
+
+	void enter_phase(phase next) {
+		if(!enabled) {
+			return;
+		}
+		::EnterCriticalSection(&shared.lock);
+		ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+		shared.phase_started[next] = now();
+		shared.current = next;
+	}
+
+	void set_compare_totals(size_t group_count, unsigned __int64 byte_count) {
+		if(!enabled) {
+			return;
+		}
+		::EnterCriticalSection(&shared.lock);
+		ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+		shared.group_total = group_count;
+		shared.byte_total = byte_count;
+	}
+
+	void record_group(unsigned __int64 file_size, size_t file_count, unsigned __int64 ticks) {
+		if(!enabled) {
+			return;
+		}
+		thread_totals& totals(this_thread());
+		++totals.counters[groups_compared];
+		totals.counters[files_compared] += file_count;
+		totals.counters[bytes_compared] += file_size * file_count;
+
+		const unsigned __int64 microseconds((ticks * 1000000) / shared.frequency);
+		size_t bucket(0);
+		while(bucket + 1 < latency_bucket_count && (1ULL << bucket) < microseconds) {
+			++bucket;
+		}
+		size_t size_class(0);
+		while(size_class + 1 < size_class_count && file_size > (4096ULL << (4 * size_class))) {
+			++size_class;
+		}
+		::EnterCriticalSection(&shared.lock);
+		ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+		++shared.latency[size_class][bucket];
+	}
+
+	void write_json(std::wostream& out) {
+		const thread_totals totals(sum());
+		std::wstringstream text;
+		text << L"{\"phase_seconds\":{";
+		for(size_t p(0); p < phase_count; ++p) {
+			const bool finished(shared.phase_started[p] != 0 && shared.phase_started[p + 1] >= shared.phase_started[p]);
+			text << (p == 0 ? L"" : L",") << L'"' << phase_names[p] << L"\":" << (finished ? seconds(shared.phase_started[p + 1] - shared.phase_started[p]) : 0.0);
+		}
+		// added up across threads, so these can come to more than the run took
+		text << L"},\"thread_seconds\":{";
+		for(size_t i(0); i < timer_count; ++i) {
+			text << (i == 0 ? L"" : L",") << L'"' << timer_names[i] << L"\":" << seconds(totals.ticks[i]);
+		}
+		text << L"},\"counters\":{";
+		for(size_t i(0); i < counter_count; ++i) {
+			text << (i == 0 ? L"" : L",") << L'"' << counter_names[i] << L"\":" << totals.counters[i];
+		}
+		text << L"},\"group_latency\":[";
+		::EnterCriticalSection(&shared.lock);
+		ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+		bool first_class(true);
+		for(size_t c(0); c < size_class_count; ++c) {
+			unsigned __int64 groups(0);
+			for(size_t b(0); b < latency_bucket_count; ++b) {
+				groups += shared.latency[c][b];
+			}
+			if(groups == 0) {
+				continue;
+			}
+			text << (first_class ? L"" : L",") << L"{\"max_file_size\":";
+			first_class = false;
+			if(c + 1 < size_class_count) {
+				text << (4096ULL << (4 * c));
+			}
+			else {
+				text << L"null";
+			}
+			text << L",\"groups\":" << groups << L",\"buckets\":[";
+			bool first_bucket(true);
+			for(size_t b(0); b < latency_bucket_count; ++b) {
+				if(shared.latency[c][b] == 0) {
+					continue;
+				}
+				text << (first_bucket ? L"" : L",") << L"{\"max_microseconds\":";
+				first_bucket = false;
+				if(b + 1 < latency_bucket_count) {
+					text << (1ULL << b);
+				}
+				else {
+					text << L"null";
+				}
+				text << L",\"groups\":" << shared.latency[c][b] << L'}';
+			}
+			text << L"]}";
+		}
+		text << L"]}";
+		out << text.str() << std::endl;
+	}
+
+	progress_meter::progress_meter(double interval_seconds, std::wostream& out_) : interval(static_cast<DWORD>(interval_seconds * 1000.0)), out(out_), stop(false), thread(nullptr) {
+		::InitializeCriticalSection(&lock);
+		::InitializeConditionVariable(&stopping);
+		thread = ::CreateThread(nullptr, 0, &progress_meter::thread_proc, this, 0, nullptr);
+		if(thread == nullptr) {
+			::DeleteCriticalSection(&lock);
+			throw std::exception("could not start the progress thread");
+		}
+	}
+
+	progress_meter::~progress_meter() {
+		{
+			::EnterCriticalSection(&lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+			stop = true;
+			::WakeConditionVariable(&stopping);
+		}
+		::WaitForSingleObject(thread, INFINITE);
+		::CloseHandle(thread);
+		::DeleteCriticalSection(&lock);
+	}
+
+	DWORD WINAPI progress_meter::thread_proc(LPVOID parameter) {
+		static_cast<progress_meter*>(parameter)->run();
+		return 0;
+	}
+
+	// rates are over the last interval, so that they show how things are going now rather than on average
+	void progress_meter::run() {
+		unsigned __int64 last_time(now());
+		thread_totals last(sum());
+		for(;;) {
+			{
+				::EnterCriticalSection(&lock);
+				ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+				if(!stop) {
+					::SleepConditionVariableCS(&stopping, &lock, interval);
+				}
+				if(stop) {
+					return;
+				}
+			}
+			const unsigned __int64 time(now());
+			const thread_totals current(sum());
+			const double elapsed(std::max(seconds(time - last_time), 0.001));
+			phase current_phase(done_phase);
+			size_t group_total(0);
+			unsigned __int64 byte_total(0);
+			unsigned __int64 compare_started(0);
+			{
+				::EnterCriticalSection(&shared.lock);
+				ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&shared.lock); });
+				current_phase = shared.current;
+				group_total = shared.group_total;
+				byte_total = shared.byte_total;
+				compare_started = shared.phase_started[compare_phase];
+			}
+
+			std::wstringstream line;
+			line << std::fixed << std::setprecision(1);
+			if(current_phase == scan_phase) {
+				line << L"Scanning: " << current.counters[directories_listed] << L" directories, " << current.counters[files_found] << L" files found, "
+				     << (static_cast<double>(current.counters[files_found] - last.counters[files_found]) / elapsed) << L" files/s";
+			}
+			else if(current_phase == compare_phase) {
+				const unsigned __int64 groups_done(current.counters[groups_compared]);
+				const unsigned __int64 bytes_done(current.counters[bytes_compared]);
+				line << L"Comparing: " << groups_done << L" of " << group_total << L" groups done, " << (group_total - std::min<unsigned __int64>(groups_done, group_total)) << L" remaining, "
+				     << (static_cast<double>(current.counters[files_compared] - last.counters[files_compared]) / elapsed) << L" files/s, "
+				     << (static_cast<double>(current.counters[bytes_read] - last.counters[bytes_read]) / elapsed / 1.0e6) << L" MB/s, ETA ";
+				// the groups left are assumed to go at the rate the ones so far have, byte for byte
+				if(bytes_done != 0 && compare_started != 0 && byte_total >= bytes_done) {
+					write_duration(line, seconds(time - compare_started) * static_cast<double>(byte_total - bytes_done) / static_cast<double>(bytes_done));
+				}
+				else {
+					line << L"unknown";
+				}
+			}
+			if(!line.str().empty()) {
+				out << line.str() << std::endl;
+			}
+			last_time = time;
+			last = current;
+		}
+	}
+}
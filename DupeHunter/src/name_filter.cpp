@@ -0,0 +1,395 @@
+// name_filter.cpp : include and exclude patterns compiled into a single matcher
+//
+
+#include "stdafx.h"
+
+#include "name_filter.hpp"
+
+namespace {
+	// more than this, and the wildcards are left to the regex engine instead
+	const size_t max_dfa_states(4096);
+
+	// names are never longer than this, but anything that is just gets folded into a bigger buffer
+	const size_t folded_name_size(MAX_PATH);
+
+	const unsigned int separator_class(1);
+
+	bool is_separator(wchar_t c) {
+		return c == L'\\' || c == L'/' || c == L':';
+	}
+
+	// lower-cases length characters into folded, returning the position of the first separator, or length if there isn't one
+	size_t fold_case(const wchar_t* name, size_t length, wchar_t* folded) {
+		size_t first_separator(length);
+		bool ascii(true);
+		for(size_t i(0); i < length; ++i) {
+			const wchar_t c(name[i]);
+			folded[i] = (c >= L'A' && c <= L'Z') ? static_cast<wchar_t>(c + (L'a' - L'A')) : c;
+			ascii &= c < 0x80;
+			if(first_separator == length && is_separator(c)) {
+				first_separator = i;
+			}
+		}
+		if(!ascii) {
+			::CharLowerBuffW(folded, static_cast<DWORD>(length));
+		}
+		return first_separator;
+	}
+
+	std::wstring fold_case(const std::wstring& s) {
+		std::wstring folded(s);
+		if(!folded.empty()) {
+			fold_case(s.c_str(), s.size(), &folded[0]);
+		}
+		return folded;
+	}
+
+	unsigned __int64 hash_suffix(const wchar_t* suffix, size_t length) {
+		unsigned __int64 hash(0xcbf29ce484222325ULL ^ length);
+		for(size_t i(0); i < length; ++i) {
+			hash = (hash ^ static_cast<unsigned __int64>(suffix[i])) * 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	enum token_kind { literal_token, any_char_token, any_run_token, dot_or_end_token, separator_token };
+
+	struct token {
+		token_kind kind;
+		wchar_t c;
+	};
+
+	std::vector<token> tokenize(const std::wstring& wildcard) {
+		std::vector<token> tokens;
+		for(auto it(wildcard.cbegin()), end(wildcard.cend()); it != end; ++it) {
+			token t = { literal_token, *it };
+			switch(*it) {
+			case L'*':
+				t.kind = any_run_token;
+				break;
+			case L'?':
+				t.kind = any_char_token;
+				break;
+			case L'.':
+				t.kind = dot_or_end_token;
+				break;
+			default:
+				if(is_separator(*it)) {
+					t.kind = separator_token;
+				}
+				break;
+			}
+			tokens.push_back(t);
+		}
+		return tokens;
+	}
+
+	// if the wildcard is * followed by plain characters, returns every suffix it amounts to: a trailing . can also match nothing,
+	// so *~. is both ~. and ~
+	bool as_suffixes(const std::vector<token>& tokens, std::vector<std::wstring>& suffixes) {
+		if(tokens.empty() || tokens[0].kind != any_run_token) {
+			return false;
+		}
+		size_t body_end(tokens.size());
+		while(body_end > 1 && tokens[body_end - 1].kind == dot_or_end_token) {
+			--body_end;
+		}
+		std::wstring body;
+		for(size_t i(1); i < body_end; ++i) {
+			// a . followed by anything else can only match a .
+			if(tokens[i].kind != literal_token && tokens[i].kind != dot_or_end_token) {
+				return false;
+			}
+			body.push_back(tokens[i].c);
+		}
+		for(size_t dots(0); dots <= tokens.size() - body_end; ++dots) {
+			suffixes.push_back(body + std::wstring(dots, L'.'));
+		}
+		return true;
+	}
+
+	// the NFA that the DFA is built from has a state for each position in each wildcard; position i is "matched the first i tokens"
+	struct nfa {
+		std::vector<std::vector<token> > patterns;
+		std::vector<unsigned int> pattern_matches;
+		std::vector<unsigned int> offsets;
+		std::vector<unsigned int> class_of_literal;
+		unsigned int dot_class;
+
+		void locate(unsigned int state, size_t& pattern, size_t& position) const {
+			pattern = static_cast<size_t>(std::upper_bound(offsets.begin(), offsets.end(), state) - offsets.begin()) - 1;
+			position = state - offsets[pattern];
+		}
+
+		// adds every state reachable by letting * match nothing
+		void close(std::vector<unsigned int>& states) const {
+			for(size_t i(0); i < states.size(); ++i) {
+				size_t pattern, position;
+				locate(states[i], pattern, position);
+				if(position < patterns[pattern].size() && patterns[pattern][position].kind == any_run_token && std::find(states.begin(), states.end(), states[i] + 1) == states.end()) {
+					states.push_back(states[i] + 1);
+				}
+			}
+			std::sort(states.begin(), states.end());
+		}
+
+		std::vector<unsigned int> step(const std::vector<unsigned int>& states, unsigned int character_class) const {
+			std::vector<unsigned int> next;
+			for(auto it(states.cbegin()), end(states.cend()); it != end; ++it) {
+				size_t pattern, position;
+				locate(*it, pattern, position);
+				const std::vector<token>& tokens(patterns[pattern]);
+				if(position == tokens.size()) {
+					continue;
+				}
+				const size_t t(offsets[pattern] + position);
+				bool advance(false);
+				switch(tokens[position].kind) {
+				case literal_token:
+					advance = class_of_literal[t] == character_class;
+					break;
+				case any_char_token:
+					advance = character_class != separator_class;
+					break;
+				case any_run_token:
+					if(character_class != separator_class) {
+						next.push_back(*it);
+					}
+					break;
+				case dot_or_end_token:
+					advance = character_class == dot_class;
+					break;
+				case separator_token:
+					advance = character_class == separator_class;
+					break;
+				}
+				if(advance) {
+					next.push_back(*it + 1);
+				}
+			}
+			std::sort(next.begin(), next.end());
+			next.erase(std::unique(next.begin(), next.end()), next.end());
+			close(next);
+			return next;
+		}
+
+		// at the end of the name, * and . can both match nothing
+		unsigned int matches_at_end(const std::vector<unsigned int>& states) const {
+			unsigned int matches(0);
+			for(auto it(states.cbegin()), end(states.cend()); it != end; ++it) {
+				size_t pattern, position;
+				locate(*it, pattern, position);
+				const std::vector<token>& tokens(patterns[pattern]);
+				while(position < tokens.size() && (tokens[position].kind == any_run_token || tokens[position].kind == dot_or_end_token)) {
+					++position;
+				}
+				if(position == tokens.size()) {
+					matches |= pattern_matches[pattern];
+				}
+			}
+			return matches;
+		}
+	};
+}
+
+name_filter::name_filter(const std::vector<std::wstring>& include_wildcards, const std::vector<std::wstring>& include_regexes_, const std::vector<std::wstring>& exclude_wildcards, const std::vector<std::wstring>& exclude_regexes_) : class_count(0), has_dfa(false) {
+	std::vector<std::pair<std::wstring, unsigned int> > wildcards;
+	for(auto it(include_wildcards.cbegin()), end(include_wildcards.cend()); it != end; ++it) {
+		wildcards.push_back(std::make_pair(*it, static_cast<unsigned int>(include_match)));
+	}
+	for(auto it(exclude_wildcards.cbegin()), end(exclude_wildcards.cend()); it != end; ++it) {
+		wildcards.push_back(std::make_pair(*it, static_cast<unsigned int>(exclude_match)));
+	}
+
+	std::vector<std::pair<std::wstring, unsigned int> > general;
+	for(auto it(wildcards.cbegin()), end(wildcards.cend()); it != end; ++it) {
+		std::vector<std::wstring> as_suffix;
+		if(!as_suffixes(tokenize(fold_case(it->first)), as_suffix)) {
+			general.push_back(*it);
+			continue;
+		}
+		for(auto sit(as_suffix.cbegin()), send(as_suffix.cend()); sit != send; ++sit) {
+			std::vector<suffix_entry>& bucket(suffixes[hash_suffix(sit->c_str(), sit->size())]);
+			auto existing(std::find_if(bucket.begin(), bucket.end(), [&] (const suffix_entry& e) { return e.suffix == *sit; }));
+			if(existing != bucket.end()) {
+				existing->matches |= it->second;
+				continue;
+			}
+			const suffix_entry entry = { *sit, it->second };
+			bucket.push_back(entry);
+			if(std::find(suffix_lengths.begin(), suffix_lengths.end(), sit->size()) == suffix_lengths.end()) {
+				suffix_lengths.push_back(sit->size());
+			}
+		}
+	}
+	// the DFA takes as many of the wildcards as it can without going past its state limit, halving them until they fit.
+	// only the ones left over are turned into regexes.
+	size_t compiled(general.size());
+	while(compiled != 0 && !compile_wildcards(std::vector<std::pair<std::wstring, unsigned int> >(general.cbegin(), general.cbegin() + compiled))) {
+		compiled /= 2;
+	}
+	if(compiled != general.size()) {
+		for(auto it(general.cbegin() + compiled), end(general.cend()); it != end; ++it) {
+			(it->second == include_match ? include_regexes : exclude_regexes).push_back(boost::wregex(wildcard_to_regex(it->first), boost::regex::icase));
+		}
+	}
+
+	for(auto it(include_regexes_.cbegin()), end(include_regexes_.cend()); it != end; ++it) {
+		include_regexes.push_back(boost::wregex(*it, boost::regex::icase));
+	}
+	for(auto it(exclude_regexes_.cbegin()), end(exclude_regexes_.cend()); it != end; ++it) {
+		exclude_regexes.push_back(boost::wregex(*it, boost::regex::icase));
+	}
+}
+
+bool name_filter::compile_wildcards(const std::vector<std::pair<std::wstring, unsigned int> >& wildcards) {
+	nfa n;
+	// class 0 is every character that no wildcard mentions, and class 1 the separators; each character that is mentioned gets a class of its own
+	ascii_classes.assign(0x80, 0);
+	ascii_classes[L'\\'] = ascii_classes[L'/'] = ascii_classes[L':'] = separator_class;
+	class_count = 2;
+	auto class_of = [&] (wchar_t c) -> unsigned int {
+		if(c < 0x80) {
+			if(ascii_classes[c] == 0) {
+				ascii_classes[c] = class_count++;
+			}
+			return ascii_classes[c];
+		}
+		auto it(other_classes.find(c));
+		if(it == other_classes.end()) {
+			it = other_classes.insert(std::make_pair(c, class_count++)).first;
+		}
+		return it->second;
+	};
+	n.dot_class = class_of(L'.');
+	for(auto it(wildcards.cbegin()), end(wildcards.cend()); it != end; ++it) {
+		n.offsets.push_back(static_cast<unsigned int>(n.class_of_literal.size()));
+		n.patterns.push_back(tokenize(fold_case(it->first)));
+		n.pattern_matches.push_back(it->second);
+		for(auto tit(n.patterns.back().cbegin()), tend(n.patterns.back().cend()); tit != tend; ++tit) {
+			n.class_of_literal.push_back(tit->kind == literal_token ? class_of(tit->c) : 0);
+		}
+		// the position past the last token
+		n.class_of_literal.push_back(0);
+	}
+
+	std::map<std::vector<unsigned int>, unsigned int> ids;
+	std::vector<std::vector<unsigned int> > sets;
+	// state 0 is the dead state: nothing can match from there
+	sets.push_back(std::vector<unsigned int>());
+	ids[sets[0]] = 0;
+	std::vector<unsigned int> start(n.offsets);
+	n.close(start);
+	ids[start] = 1;
+	sets.push_back(start);
+
+	transitions.assign(class_count * 2, 0);
+	for(size_t state(1); state < sets.size(); ++state) {
+		for(unsigned int c(0); c < class_count; ++c) {
+			const std::vector<unsigned int> next(n.step(sets[state], c));
+			auto it(ids.find(next));
+			if(it == ids.end()) {
+				if(sets.size() == max_dfa_states) {
+					transitions.clear();
+					ascii_classes.clear();
+					other_classes.clear();
+					return false;
+				}
+				it = ids.insert(std::make_pair(next, static_cast<unsigned int>(sets.size()))).first;
+				sets.push_back(next);
+				transitions.resize(sets.size() * class_count, 0);
+			}
+			transitions[(state * class_count) + c] = it->second;
+		}
+	}
+	accepting.resize(sets.size());
+	for(size_t state(0); state < sets.size(); ++state) {
+		accepting[state] = n.matches_at_end(sets[state]);
+	}
+	has_dfa = true;
+	return true;
+}
+
+unsigned int name_filter::match_suffixes(const wchar_t* name, size_t length, size_t first_separator) const {
+	unsigned int matches(0);
+	for(auto it(suffix_lengths.cbegin()), end(suffix_lengths.cend()); it != end; ++it) {
+		// the * in front of the suffix can't match a separator
+		if(*it > length || first_separator < length - *it) {
+			continue;
+		}
+		const wchar_t* suffix(name + (length - *it));
+		const auto bucket(suffixes.find(hash_suffix(suffix, *it)));
+		if(bucket == suffixes.end()) {
+			continue;
+		}
+		for(auto eit(bucket->second.cbegin()), eend(bucket->second.cend()); eit != eend; ++eit) {
+			if(eit->suffix.size() == *it && 0 == std::wmemcmp(eit->suffix.c_str(), suffix, *it)) {
+				matches |= eit->matches;
+			}
+		}
+	}
+	return matches;
+}
+
+unsigned int name_filter::match_wildcards(const wchar_t* name, size_t length) const {
+	unsigned int state(1);
+	for(size_t i(0); i < length; ++i) {
+		const wchar_t c(name[i]);
+		unsigned int character_class(0);
+		if(c < 0x80) {
+			character_class = ascii_classes[c];
+		}
+		else {
+			const auto it(other_classes.find(c));
+			character_class = it != other_classes.end() ? it->second : 0;
+		}
+		state = transitions[(state * class_count) + character_class];
+		if(state == 0) {
+			return 0;
+		}
+	}
+	return accepting[state];
+}
+
+bool name_filter::permitted(const wchar_t* name, size_t length) const {
+	wchar_t local[folded_name_size];
+	std::vector<wchar_t> large;
+	wchar_t* folded(local);
+	if(length > folded_name_size) {
+		large.resize(length);
+		folded = &large[0];
+	}
+	const size_t first_separator(fold_case(name, length, folded));
+
+	unsigned int matches(match_suffixes(folded, length, first_separator));
+	if(has_dfa) {
+		matches |= match_wildcards(folded, length);
+	}
+
+	if((matches & exclude_match) != 0) {
+		return false;
+	}
+	if((matches & include_match) == 0) {
+		const std::wstring original(name, length);
+		auto it(std::find_if(include_regexes.cbegin(), include_regexes.cend(), [&] (const boost::wregex& r) { return boost::regex_match(original, r); }));
+		if(it == include_regexes.cend()) {
+			return false;
+		}
+	}
+	if(!exclude_regexes.empty()) {
+		const std::wstring original(name, length);
+		auto it(std::find_if(exclude_regexes.cbegin(), exclude_regexes.cend(), [&] (const boost::wregex& r) { return boost::regex_match(original, r); }));
+		if(it != exclude_regexes.cend()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::wstring name_filter::wildcard_to_regex(const std::wstring& wildcard) {
+	const boost::wregex wildcard_transform(L"([+{}()\\[\\]$\\^|])|(\\*)|(\\?)|(\\.)|([\\\\/:])");
+	// this has to be double-escaped because we want the result to be properly escaped to produce a regex itself.
+	// It would be nice to have raw strings!
+	const std::wstring wildcard_replacement(L"(?1\\\\$1)(?2[^\\\\\\\\/\\:]*)(?3[^\\\\\\\\/\\:])(?4\\(\\?\\:\\\\.|$\\))(?5[\\\\\\\\\\\\/\\:])");
+	return boost::regex_replace(wildcard, wildcard_transform, wildcard_replacement, boost::format_all);
+}
@@ -0,0 +1,122 @@
+// overlapped_reader.cpp : keeps many reads in flight across a group of files
+//
+
+#include "stdafx.h"
+
+#include "overlapped_reader.hpp"
+#include "instrumentation.hpp"
+
+overlapped_reader::overlapped_reader(const std::vector<HANDLE>& files_, size_t set_count, size_t queue_depth_) : files(files_), queue_depth(queue_depth_ == 0 ? 1 : queue_depth_), port(nullptr), sets(set_count), in_flight(0) {
+	port = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+	if(port == nullptr) {
+		throw std::exception("Could not create I/O completion port");
+	}
+	for(size_t i(0); i < files.size(); ++i) {
+		if(nullptr == ::CreateIoCompletionPort(files[i], port, static_cast<ULONG_PTR>(i), 0)) {
+			::CloseHandle(port);
+			throw std::exception("Could not associate file with I/O completion port");
+		}
+	}
+	for(auto it(sets.begin()), end(sets.end()); it != end; ++it) {
+		it->overlapped.resize(files.size());
+		it->bytes_read.resize(files.size());
+	}
+}
+
+overlapped_reader::~overlapped_reader() {
+	// the buffers and handles belong to the caller, so nothing can be left in flight once we're gone
+	if(in_flight != 0) {
+		std::for_each(files.begin(), files.end(), [] (HANDLE file) {
+			if(file != INVALID_HANDLE_VALUE) {
+				::CancelIoEx(file, nullptr);
+			}
+		});
+		// if the port itself has failed there's nothing left to wait on, and destructors mustn't throw
+		try {
+			while(in_flight != 0) {
+				complete_one();
+			}
+		} catch(const std::exception&) {
+		}
+	}
+	::CloseHandle(port);
+}
+
+void overlapped_reader::start(size_t set, const std::vector<size_t>& order, unsigned __int64 offset, const std::vector<unsigned __int8*>& buffers, DWORD length) {
+	read_set& rs(sets[set]);
+	rs.order = order;
+	rs.buffers = buffers;
+	rs.length = length;
+	rs.next_to_issue = 0;
+	rs.outstanding = order.size();
+	rs.active = true;
+	rs.succeeded = true;
+	for(size_t i(0); i < files.size(); ++i) {
+		OVERLAPPED& o(rs.overlapped[i]);
+		std::memset(&o, 0, sizeof(o));
+		o.Offset = static_cast<DWORD>(offset & 0xffffffffULL);
+		o.OffsetHigh = static_cast<DWORD>(offset >> 32);
+		rs.bytes_read[i] = 0;
+	}
+	issue_order.push_back(set);
+	issue();
+}
+
+bool overlapped_reader::finish(size_t set, std::vector<DWORD>& bytes_read) {
+	read_set& rs(sets[set]);
+	instrumentation::scoped_timer waiting(instrumentation::read_timer);
+	for(;;) {
+		issue();
+		if(rs.outstanding == 0) {
+			break;
+		}
+		complete_one();
+	}
+	rs.active = false;
+	bytes_read = rs.bytes_read;
+	return rs.succeeded;
+}
+
+// tops the queue back up to queue_depth, oldest set first
+void overlapped_reader::issue() {
+	while(in_flight < queue_depth && !issue_order.empty()) {
+		read_set& rs(sets[issue_order.front()]);
+		if(rs.next_to_issue == rs.order.size()) {
+			issue_order.pop_front();
+			continue;
+		}
+		const size_t i(rs.order[rs.next_to_issue++]);
+		if(FALSE != ::ReadFile(files[i], rs.buffers[i], rs.length, nullptr, &rs.overlapped[i]) || ::GetLastError() == ERROR_IO_PENDING) {
+			// the completion is queued to the port even when the read finishes immediately
+			++in_flight;
+			instrumentation::count(instrumentation::read_calls);
+			continue;
+		}
+		// reading at or past the end of the file fails outright, and nothing gets queued to the port
+		rs.bytes_read[i] = 0;
+		rs.succeeded = false;
+		--rs.outstanding;
+	}
+}
+
+void overlapped_reader::complete_one() {
+	DWORD transferred(0);
+	ULONG_PTR key(0);
+	OVERLAPPED* o(nullptr);
+	const BOOL ok(::GetQueuedCompletionStatus(port, &transferred, &key, &o, INFINITE));
+	// with no timeout, getting no packet at all means the port has failed, and waiting again would only spin
+	if(o == nullptr) {
+		throw std::exception("Could not wait on I/O completion port");
+	}
+	--in_flight;
+	const size_t i(static_cast<size_t>(key));
+	for(auto it(sets.begin()), end(sets.end()); it != end; ++it) {
+		if(o == &it->overlapped[i]) {
+			it->bytes_read[i] = FALSE != ok ? transferred : 0;
+			instrumentation::count(instrumentation::bytes_read, it->bytes_read[i]);
+			it->succeeded &= FALSE != ok && 0 != transferred;
+			--it->outstanding;
+			break;
+		}
+	}
+}
@@ -0,0 +1,100 @@
+// prefilter.cpp : splits size groups on a few sampled blocks before any full reads
+//
+
+#include "stdafx.h"
+
+#include "prefilter.hpp"
+#include "compare.hpp"
+#include "instrumentation.hpp"
+
+namespace {
+	const unsigned __int64 sample_size(4096); // TODO get the right size
+
+	// the sample offsets, deduplicated, for files too short for them all to be distinct
+	std::vector<unsigned __int64> sample_offsets(unsigned __int64 file_size, size_t sample_count) {
+		std::vector<unsigned __int64> offsets;
+		offsets.push_back(0);
+		if(sample_count > 1) {
+			offsets.push_back(round_to_previous_multiple(file_size - 1, sample_size));
+		}
+		for(size_t i(1); i + 1 < sample_count; ++i) {
+			offsets.push_back(round_to_previous_multiple((file_size / (sample_count - 1)) * i, sample_size));
+		}
+		std::sort(offsets.begin(), offsets.end());
+		offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+		return offsets;
+	}
+}
+
+std::vector<std::vector<size_t> > sample_prefilter(unsigned __int64 file_size, const std::vector<std::wstring>& names, size_t sample_count, prefilter_statistics& statistics) {
+	std::vector<std::vector<size_t> > groups;
+	// a file that is only a handful of samples long is read in one go by n_way_compare about as quickly as it could be sampled
+	if(sample_count == 0 || names.size() < 2 || file_size < static_cast<unsigned __int64>(sample_count) * sample_size * 8) {
+		groups.push_back(std::vector<size_t>(names.size()));
+		for(size_t i(0); i < names.size(); ++i) {
+			groups.back()[i] = i;
+		}
+		return groups;
+	}
+
+	const std::vector<unsigned __int64> offsets(sample_offsets(file_size, sample_count));
+	void* buffer(::VirtualAlloc(nullptr, static_cast<size_t>(sample_size), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+	if(buffer == nullptr) {
+		throw std::bad_alloc();
+	}
+	ON_BLOCK_EXIT([=] { ::VirtualFree(buffer, 0, MEM_RELEASE); });
+
+	std::vector<std::pair<unsigned __int64, size_t> > digests;
+	digests.reserve(names.size());
+	std::vector<unsigned __int64> sampled(names.size(), 0);
+	for(size_t i(0); i < names.size(); ++i) {
+		HANDLE file(instrumentation::timed(instrumentation::open_timer, [&] {
+			return ::CreateFileW(names[i].c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS | FILE_FLAG_NO_BUFFERING, 0);
+		}));
+		if(file == INVALID_HANDLE_VALUE) {
+			std::wcerr << L"Could not open file " << names[i] << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			continue;
+		}
+		instrumentation::count(instrumentation::files_opened);
+		ON_BLOCK_EXIT([=] { ::CloseHandle(file); });
+		// equal samples only mean "maybe equal", so a digest of them is all that needs keeping; n_way_compare checks everything that survives
+		unsigned __int64 digest(0);
+		for(auto it(offsets.cbegin()), end(offsets.cend()); it != end; ++it) {
+			OVERLAPPED position = {0};
+			position.Offset = static_cast<DWORD>(*it & 0xffffffffULL);
+			position.OffsetHigh = static_cast<DWORD>(*it >> 32);
+			DWORD bytes_read(0);
+			if(FALSE == instrumentation::timed(instrumentation::read_timer, [&] { return ::ReadFile(file, buffer, static_cast<DWORD>(sample_size), &bytes_read, &position); })) {
+				bytes_read = 0;
+			}
+			instrumentation::count(instrumentation::read_calls);
+			instrumentation::count(instrumentation::bytes_read, bytes_read);
+			digest = (digest * 0x100000001b3ULL) ^ block_digest(static_cast<const unsigned __int8*>(buffer), bytes_read);
+			sampled[i] += bytes_read;
+		}
+		digests.push_back(std::make_pair(digest, i));
+	}
+	// sorting on (digest, index) keeps each sub-group in name order
+	std::sort(digests.begin(), digests.end());
+
+	for(size_t first(0), last(0); first < digests.size(); first = last) {
+		for(last = first + 1; last < digests.size() && digests[last].first == digests[first].first; ++last) {
+		}
+		if(last - first == 1) {
+			const size_t loner(digests[first].second);
+			++statistics.candidates_eliminated;
+			statistics.bytes_saved += file_size - sampled[loner];
+			continue;
+		}
+		std::vector<size_t> group;
+		group.reserve(last - first);
+		for(size_t i(first); i < last; ++i) {
+			group.push_back(digests[i].second);
+		}
+		groups.push_back(std::move(group));
+	}
+	std::sort(groups.begin(), groups.end(), [] (const std::vector<size_t>& lhs, const std::vector<size_t>& rhs) {
+		return lhs.front() < rhs.front();
+	});
+	return groups;
+}
@@ -0,0 +1,342 @@
+// reporter.cpp : writes the duplicate sets out as they're found, in whichever format was asked for
+//
+
+#include "stdafx.h"
+
+#include "reporter.hpp"
+#include "instrumentation.hpp"
+
+namespace {
+	// characters gathered before anything is written
+	const size_t buffer_size(256 * 1024);
+	// consoles have been known to choke on much bigger writes than this
+	const size_t console_chunk_size(16 * 1024);
+
+	void append_number(std::wstring& text, unsigned __int64 number) {
+		wchar_t digits[20];
+		size_t count(0);
+		do {
+			digits[count++] = static_cast<wchar_t>(L'0' + (number % 10));
+			number /= 10;
+		}
+		while(number != 0);
+		while(count != 0) {
+			text.push_back(digits[--count]);
+		}
+	}
+
+	bool is_high_surrogate(wchar_t c) {
+		return c >= 0xd800 && c <= 0xdbff;
+	}
+
+	bool is_low_surrogate(wchar_t c) {
+		return c >= 0xdc00 && c <= 0xdfff;
+	}
+
+	// NTFS doesn't insist that names are valid UTF-16, so unpaired surrogates are escaped rather than being lost in the conversion to UTF-8
+	void append_json_string(std::wstring& text, const std::wstring& s) {
+		static const wchar_t hex[] = L"0123456789abcdef";
+		text.push_back(L'"');
+		for(size_t i(0); i < s.size(); ++i) {
+			const wchar_t c(s[i]);
+			if(c == L'"' || c == L'\\') {
+				text.push_back(L'\\');
+				text.push_back(c);
+			}
+			else if(is_high_surrogate(c) && i + 1 < s.size() && is_low_surrogate(s[i + 1])) {
+				text.push_back(c);
+				text.push_back(s[++i]);
+			}
+			else if(c < 0x20 || is_high_surrogate(c) || is_low_surrogate(c)) {
+				text.append(L"\\u");
+				text.push_back(hex[(c >> 12) & 0xf]);
+				text.push_back(hex[(c >> 8) & 0xf]);
+				text.push_back(hex[(c >> 4) & 0xf]);
+				text.push_back(hex[c & 0xf]);
+			}
+			else {
+				text.push_back(c);
+			}
+		}
+		text.push_back(L'"');
+	}
+}
+
+buffered_output::buffered_output() : output(::GetStdHandle(STD_OUTPUT_HANDLE)), console(false), failed(false) {
+	DWORD mode(0);
+	console = FALSE != ::GetConsoleMode(output, &mode);
+	buffer.reserve(buffer_size);
+}
+
+buffered_output::~buffered_output() {
+	flush();
+}
+
+void buffered_output::write(const wchar_t* text, size_t length) {
+	// text is never split between writes, so a surrogate pair can't be cut in half by the conversion to UTF-8
+	if(buffer.size() + length > buffer_size) {
+		flush();
+	}
+	if(length > buffer_size) {
+		write_out(text, length);
+		return;
+	}
+	buffer.insert(buffer.end(), text, text + length);
+}
+
+void buffered_output::flush() {
+	if(!buffer.empty()) {
+		write_out(&buffer[0], buffer.size());
+		buffer.clear();
+	}
+}
+
+void buffered_output::write_out(const wchar_t* text, size_t length) {
+	if(failed) {
+		return;
+	}
+	if(console) {
+		for(size_t offset(0); offset < length; offset += console_chunk_size) {
+			DWORD written(0);
+			if(FALSE == ::WriteConsoleW(output, text + offset, static_cast<DWORD>(std::min(console_chunk_size, length - offset)), &written, nullptr)) {
+				failed = true;
+				break;
+			}
+		}
+	}
+	else {
+		const int required(::WideCharToMultiByte(CP_UTF8, 0, text, static_cast<int>(length), nullptr, 0, nullptr, nullptr));
+		encoded.resize(static_cast<size_t>(required));
+		if(required != 0) {
+			::WideCharToMultiByte(CP_UTF8, 0, text, static_cast<int>(length), &encoded[0], required, nullptr, nullptr);
+		}
+		DWORD written(0);
+		if(required != 0 && FALSE == ::WriteFile(output, &encoded[0], static_cast<DWORD>(required), &written, nullptr)) {
+			failed = true;
+		}
+	}
+	if(failed) {
+		std::wcerr << L"Could not write to standard output with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+	}
+}
+
+reporter::reporter(report_format format_, const file_table& table_, const link_map_type& links_) : format(format_), table(table_), links(links_), finishing(false), thread(nullptr) {
+	::InitializeCriticalSection(&lock);
+	::InitializeConditionVariable(&changed);
+	thread = ::CreateThread(nullptr, 0, &reporter::thread_proc, this, 0, nullptr);
+	if(thread == nullptr) {
+		::DeleteCriticalSection(&lock);
+		throw std::exception("could not start the reporting thread");
+	}
+}
+
+reporter::~reporter() {
+	if(thread != nullptr) {
+		try {
+			finish();
+		} catch(...) {
+		}
+	}
+	::DeleteCriticalSection(&lock);
+}
+
+void reporter::report(unsigned __int64 file_size, size_t file_count, const duplicate_sets_type& duplicates) {
+	group_report group;
+	group.file_size = file_size;
+	group.file_count = file_count;
+	group.duplicates = duplicates;
+	::EnterCriticalSection(&lock);
+	ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+	pending.push_back(group_report());
+	pending.back().file_size = group.file_size;
+	pending.back().file_count = group.file_count;
+	pending.back().duplicates.swap(group.duplicates);
+	::WakeConditionVariable(&changed);
+}
+
+void reporter::finish() {
+	if(thread == nullptr) {
+		return;
+	}
+	{
+		::EnterCriticalSection(&lock);
+		ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+		finishing = true;
+		::WakeConditionVariable(&changed);
+	}
+	::WaitForSingleObject(thread, INFINITE);
+	::CloseHandle(thread);
+	thread = nullptr;
+	if(failure != std::exception_ptr()) {
+		std::rethrow_exception(failure);
+	}
+}
+
+DWORD WINAPI reporter::thread_proc(LPVOID parameter) {
+	static_cast<reporter*>(parameter)->run();
+	return 0;
+}
+
+void reporter::run() {
+	try {
+		for(;;) {
+			bool caught_up(false);
+			{
+				::EnterCriticalSection(&lock);
+				ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+				caught_up = pending.empty();
+			}
+			// everything that's arrived so far has been written, so it might as well be seen. this is done outside the lock so that
+			// a slow write never holds up whoever is reporting the next group.
+			if(caught_up) {
+				instrumentation::scoped_timer flushing(instrumentation::report_timer);
+				output.flush();
+			}
+
+			group_report group;
+			{
+				::EnterCriticalSection(&lock);
+				ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+				while(pending.empty() && !finishing) {
+					::SleepConditionVariableCS(&changed, &lock, INFINITE);
+				}
+				if(pending.empty()) {
+					return;
+				}
+				group.file_size = pending.front().file_size;
+				group.file_count = pending.front().file_count;
+				group.duplicates.swap(pending.front().duplicates);
+				pending.pop_front();
+			}
+			write_group(group);
+		}
+	} catch(...) {
+		failure = std::current_exception();
+	}
+}
+
+void reporter::write_group(const group_report& group) {
+	instrumentation::scoped_timer writing(instrumentation::report_timer);
+	std::wstring text;
+	switch(format) {
+	case human_format:
+		text.append(L"Comparing ");
+		append_number(text, group.file_count);
+		text.append(L" files of size ");
+		append_number(text, group.file_size);
+		text.push_back(L'\n');
+		for(size_t i(0); i < group.duplicates.size(); ++i) {
+			text.append(L"\tDuplicate set ");
+			append_number(text, i + 1);
+			text.push_back(L'\n');
+			for(auto it(group.duplicates[i].cbegin()), end(group.duplicates[i].cend()); it != end; ++it) {
+				text.append(L"\t\t");
+				text.append(table.path_of(*it));
+				text.push_back(L'\n');
+				const link_map_type::const_iterator link_group(links.find(*it));
+				if(link_group != links.end()) {
+					for(auto lit(link_group->second.cbegin()), lend(link_group->second.cend()); lit != lend; ++lit) {
+						text.append(L"\t\t\tHard link ");
+						text.append(table.path_of(*lit));
+						text.push_back(L'\n');
+					}
+				}
+			}
+			output.write(text);
+			text.clear();
+		}
+		break;
+	case json_lines_format:
+		for(auto sit(group.duplicates.cbegin()), send(group.duplicates.cend()); sit != send; ++sit) {
+			text.append(L"{\"size\":");
+			append_number(text, group.file_size);
+			text.append(L",\"files\":[");
+			std::wstring hard_links;
+			for(auto it(sit->cbegin()), end(sit->cend()); it != end; ++it) {
+				const std::wstring path(table.path_of(*it));
+				if(it != sit->cbegin()) {
+					text.push_back(L',');
+				}
+				append_json_string(text, path);
+				const link_map_type::const_iterator link_group(links.find(*it));
+				if(link_group != links.end()) {
+					hard_links.push_back(hard_links.empty() ? L'{' : L',');
+					append_json_string(hard_links, path);
+					hard_links.append(L":[");
+					for(auto lit(link_group->second.cbegin()), lend(link_group->second.cend()); lit != lend; ++lit) {
+						if(lit != link_group->second.cbegin()) {
+							hard_links.push_back(L',');
+						}
+						append_json_string(hard_links, table.path_of(*lit));
+					}
+					hard_links.push_back(L']');
+				}
+			}
+			text.push_back(L']');
+			if(!hard_links.empty()) {
+				text.append(L",\"hard_links\":");
+				text.append(hard_links);
+				text.push_back(L'}');
+			}
+			text.append(L"}\n");
+			output.write(text);
+			text.clear();
+		}
+		break;
+	case nul_format:
+		for(auto sit(group.duplicates.cbegin()), send(group.duplicates.cend()); sit != send; ++sit) {
+			for(auto it(sit->cbegin()), end(sit->cend()); it != end; ++it) {
+				text.append(table.path_of(*it));
+				text.push_back(L'\0');
+				const link_map_type::const_iterator link_group(links.find(*it));
+				if(link_group != links.end()) {
+					for(auto lit(link_group->second.cbegin()), lend(link_group->second.cend()); lit != lend; ++lit) {
+						text.append(table.path_of(*lit));
+						text.push_back(L'\0');
+					}
+				}
+			}
+			text.push_back(L'\0');
+			output.write(text);
+			text.clear();
+		}
+		break;
+	}
+	// all that's left is the human format's heading for a group without any duplicates
+	output.write(text);
+}
+
+void write_changed_sets(buffered_output& output, report_format format, unsigned __int64 file_size, const std::vector<std::vector<std::wstring> >& sets, bool appeared) {
+	instrumentation::scoped_timer writing(instrumentation::report_timer);
+	std::wstring text;
+	for(auto sit(sets.cbegin()), send(sets.cend()); sit != send; ++sit) {
+		switch(format) {
+		case human_format:
+			text.append(appeared ? L"New duplicate set of size " : L"Duplicate set gone of size ");
+			append_number(text, file_size);
+			text.push_back(L'\n');
+			for(auto it(sit->cbegin()), end(sit->cend()); it != end; ++it) {
+				text.append(L"\t\t");
+				text.append(*it);
+				text.push_back(L'\n');
+			}
+			break;
+		case json_lines_format:
+			text.append(appeared ? L"{\"event\":\"appeared\",\"size\":" : L"{\"event\":\"gone\",\"size\":");
+			append_number(text, file_size);
+			text.append(L",\"files\":[");
+			for(auto it(sit->cbegin()), end(sit->cend()); it != end; ++it) {
+				if(it != sit->cbegin()) {
+					text.push_back(L',');
+				}
+				append_json_string(text, *it);
+			}
+			text.append(L"]}\n");
+			break;
+		case nul_format:
+			throw std::exception("changes can't be written NUL-separated");
+		}
+		output.write(text);
+		text.clear();
+	}
+}
@@ -0,0 +1,194 @@
+// scan_index.cpp : the persistent directory index that lets unchanged directories skip enumeration
+//
+
+#include "stdafx.h"
+
+#include "scan_index.hpp"
+
+namespace {
+	const unsigned __int32 index_magic(0x49534844); // "DHSI"
+	const unsigned __int32 index_version(1);
+
+	struct header {
+		unsigned __int32 magic;
+		unsigned __int32 version;
+		unsigned __int64 directory_count;
+		unsigned __int64 entry_count;
+		unsigned __int64 name_count;
+	};
+
+	unsigned __int64 hash_path(const wchar_t* path, size_t length) {
+		unsigned __int64 hash(0xcbf29ce484222325ULL);
+		for(size_t i(0); i < length; ++i) {
+			hash = (hash ^ static_cast<unsigned __int64>(path[i])) * 0x100000001b3ULL;
+		}
+		return hash;
+	}
+
+	// whether size bytes, starting with h, hold the counts of records that h says they do, without the sums overflowing
+	bool sized_correctly(const header* h, unsigned __int64 size) {
+		if(size < sizeof(header)) {
+			return false;
+		}
+		unsigned __int64 remaining(size - sizeof(header));
+		const std::pair<unsigned __int64, unsigned __int64> parts[] = { std::make_pair(h->directory_count, static_cast<unsigned __int64>(sizeof(indexed_directory))),
+		                                                                 std::make_pair(h->entry_count,     static_cast<unsigned __int64>(sizeof(indexed_entry))),
+		                                                                 std::make_pair(h->name_count,      static_cast<unsigned __int64>(sizeof(wchar_t))) };
+		for(size_t i(0); i < sizeof(parts) / sizeof(parts[0]); ++i) {
+			if(parts[i].first > remaining / parts[i].second) {
+				return false;
+			}
+			remaining -= parts[i].first * parts[i].second;
+		}
+		return remaining == 0;
+	}
+
+	bool within(unsigned __int64 offset, unsigned __int64 length, unsigned __int64 limit) {
+		return offset <= limit && length <= limit - offset;
+	}
+
+	// every directory's path and entries, and every entry's name, must lie inside the index, or a damaged index would be read out of bounds
+	bool ranges_valid(const header* h, const indexed_directory* directories, const indexed_entry* entries) {
+		for(unsigned __int64 i(0); i < h->directory_count; ++i) {
+			if(!within(directories[i].path_offset, directories[i].path_length, h->name_count)
+			|| !within(directories[i].first_entry, directories[i].entry_count, h->entry_count)) {
+				return false;
+			}
+		}
+		for(unsigned __int64 i(0); i < h->entry_count; ++i) {
+			if(!within(entries[i].name_offset, entries[i].name_length, h->name_count)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool hash_order(const indexed_directory& lhs, const indexed_directory& rhs) {
+		return lhs.path_hash < rhs.path_hash;
+	}
+}
+
+scan_index::scan_index(const std::wstring& path) : directories(nullptr), directory_count(0), entries(nullptr), names(nullptr) {
+	if(!mapped.open(path)) {
+		if(::GetLastError() != ERROR_FILE_NOT_FOUND) {
+			std::wcerr << L"Could not map scan index " << path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+		}
+		return;
+	}
+	const header* h(static_cast<const header*>(mapped.data()));
+	if(mapped.size() < sizeof(header)
+	|| h->magic != index_magic
+	|| h->version != index_version
+	|| !sized_correctly(h, mapped.size())) {
+		std::wcerr << L"Scan index " << path << L" is not in a format I understand, ignoring" << std::endl;
+		mapped.close();
+		return;
+	}
+	const indexed_directory* const first_directory(reinterpret_cast<const indexed_directory*>(h + 1));
+	const indexed_entry* const first_entry(reinterpret_cast<const indexed_entry*>(first_directory + h->directory_count));
+	if(!ranges_valid(h, first_directory, first_entry)) {
+		std::wcerr << L"Scan index " << path << L" is damaged, ignoring" << std::endl;
+		mapped.close();
+		return;
+	}
+	directories = first_directory;
+	directory_count = h->directory_count;
+	entries = first_entry;
+	names = reinterpret_cast<const wchar_t*>(entries + h->entry_count);
+}
+
+const indexed_directory* scan_index::find(const std::wstring& directory) const {
+	if(directories == nullptr) {
+		return nullptr;
+	}
+	indexed_directory key = {0};
+	key.path_hash = hash_path(directory.c_str(), directory.size());
+	const indexed_directory* const end(directories + directory_count);
+	for(const indexed_directory* it(std::lower_bound(directories, end, key, &hash_order)); it != end && it->path_hash == key.path_hash; ++it) {
+		if(it->path_length == directory.size() && 0 == std::wmemcmp(names + it->path_offset, directory.c_str(), directory.size())) {
+			return it;
+		}
+	}
+	return nullptr;
+}
+
+void scan_index_builder::add_directory(const std::wstring& path, unsigned __int64 last_write_time, unsigned __int64 change_time) {
+	indexed_directory directory = {0};
+	directory.path_hash = hash_path(path.c_str(), path.size());
+	directory.last_write_time = last_write_time;
+	directory.change_time = change_time;
+	directory.path_offset = names.size();
+	directory.path_length = static_cast<unsigned __int32>(path.size());
+	directory.first_entry = entries.size();
+	directory.entry_count = 0;
+	names.insert(names.end(), path.begin(), path.end());
+	directories.push_back(directory);
+}
+
+void scan_index_builder::add_entry(const wchar_t* name, size_t name_length, DWORD attributes, unsigned __int64 size, unsigned __int64 file_id, unsigned __int64 last_write_time) {
+	indexed_entry entry = {0};
+	entry.name_offset = names.size();
+	entry.name_length = static_cast<unsigned __int32>(name_length);
+	entry.attributes = attributes;
+	entry.size = size;
+	entry.file_id = file_id;
+	entry.last_write_time = last_write_time;
+	names.insert(names.end(), name, name + name_length);
+	entries.push_back(entry);
+	++directories.back().entry_count;
+}
+
+void scan_index_builder::remove_last_directory() {
+	const indexed_directory& directory(directories.back());
+	names.resize(static_cast<size_t>(directory.path_offset));
+	entries.resize(static_cast<size_t>(directory.first_entry));
+	directories.pop_back();
+}
+
+bool write_scan_index(const std::wstring& path, const std::vector<const scan_index_builder*>& parts) {
+	// stitch the parts together, moving each part's offsets past everything that precedes it
+	std::vector<indexed_directory> directories;
+	std::vector<indexed_entry> entries;
+	std::vector<wchar_t> names;
+	for(auto it(parts.cbegin()), end(parts.cend()); it != end; ++it) {
+		const scan_index_builder& part(**it);
+		const unsigned __int64 entry_base(entries.size());
+		const unsigned __int64 name_base(names.size());
+		for(auto dit(part.directories.cbegin()), dend(part.directories.cend()); dit != dend; ++dit) {
+			indexed_directory directory(*dit);
+			directory.first_entry += entry_base;
+			directory.path_offset += name_base;
+			directories.push_back(directory);
+		}
+		for(auto eit(part.entries.cbegin()), eend(part.entries.cend()); eit != eend; ++eit) {
+			indexed_entry entry(*eit);
+			entry.name_offset += name_base;
+			entries.push_back(entry);
+		}
+		names.insert(names.end(), part.names.begin(), part.names.end());
+	}
+	std::stable_sort(directories.begin(), directories.end(), &hash_order);
+
+	const header h = { index_magic, index_version, directories.size(), entries.size(), names.size() };
+	std::vector<std::pair<const void*, size_t> > pieces;
+	pieces.push_back(std::make_pair(static_cast<const void*>(&h), sizeof(h)));
+	if(!directories.empty()) {
+		pieces.push_back(std::make_pair(static_cast<const void*>(&directories[0]), directories.size() * sizeof(indexed_directory)));
+	}
+	if(!entries.empty()) {
+		pieces.push_back(std::make_pair(static_cast<const void*>(&entries[0]), entries.size() * sizeof(indexed_entry)));
+	}
+	if(!names.empty()) {
+		pieces.push_back(std::make_pair(static_cast<const void*>(&names[0]), names.size() * sizeof(wchar_t)));
+	}
+	const std::wstring temporary_path(path + L".tmp");
+	if(!util::write_file(temporary_path, pieces)) {
+		std::wcerr << L"Could not write scan index " << temporary_path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+		return false;
+	}
+	if(FALSE == ::MoveFileExW(temporary_path.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+		std::wcerr << L"Could not replace scan index " << path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,441 @@
+// scheduler.cpp : runs size groups, and batches of small ones, concurrently under a single buffer budget, with a queue for each disk
+//
+
+#include "stdafx.h"
+
+#include "scheduler.hpp"
+#include "prefilter.hpp"
+#include "fingerprint.hpp"
+#include "extents.hpp"
+#include "instrumentation.hpp"
+#include "devices.hpp"
+#include "small_files.hpp"
+
+namespace {
+	// (volume, cluster)
+	typedef std::pair<DWORD, unsigned __int64> disk_location;
+
+	typedef std::vector<std::vector<std::wstring> > name_sets_type;
+
+	// the most that one batch of small groups may have to read, and the most files it may have; a batch is just one group, compared
+	// the usual way, if that group on its own is more than this
+	const size_t small_batch_bytes(16 * 1024 * 1024);
+	const size_t small_batch_files(4096);
+
+	// where the first file of a group starts on disk; the group's other files could be anywhere, so this is only a rough guide
+	disk_location group_location(const file_table& table, const file_table::file_index* group) {
+		HANDLE file(::CreateFileW(table.path_of(group[0]).c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, 0));
+		if(file == INVALID_HANDLE_VALUE) {
+			return disk_location(~0UL, ~0ULL);
+		}
+		ON_BLOCK_EXIT([=] { ::CloseHandle(file); });
+		file_extents extents;
+		if(!query_extents(file, extents)) {
+			return disk_location(~0UL, ~0ULL);
+		}
+		return disk_location(extents.volume, extents.first_cluster());
+	}
+
+	// samples (or fingerprints) the group first, then compares whatever sub-groups survive in full. the last reference_count names are references.
+	name_sets_type compare_group(unsigned __int64 file_size, std::vector<std::wstring>& names, size_t reference_count, void* buffer, size_t buffer_size, const compare_options& options, prefilter_statistics& statistics) {
+		const std::vector<std::vector<size_t> > candidates(options.fingerprint ? fingerprint_groups(names, buffer, buffer_size, options.cache)
+		                                                                       : sample_prefilter(file_size, names, options.sample_count, statistics));
+		if(!options.fingerprint && candidates.size() == 1 && candidates[0].size() == names.size()) {
+			return n_way_compare(file_size, names, buffer, buffer_size, options, reference_count);
+		}
+
+		const size_t first_reference(names.size() - reference_count);
+		name_sets_type duplicates;
+		for(auto it(candidates.cbegin()), end(candidates.cend()); it != end; ++it) {
+			// sub-groups are in name order, so one that starts with a reference is nothing but references
+			if(it->front() >= first_reference) {
+				continue;
+			}
+			std::vector<std::wstring> candidate_names;
+			candidate_names.reserve(it->size());
+			for(auto cit(it->cbegin()), cend(it->cend()); cit != cend; ++cit) {
+				candidate_names.push_back(names[*cit]);
+			}
+			// fingerprint groups are already in order, and are only split further if they need verifying
+			if(options.fingerprint && !options.verify) {
+				duplicates.push_back(std::move(candidate_names));
+				continue;
+			}
+			const size_t candidate_references(it->cend() - std::lower_bound(it->cbegin(), it->cend(), first_reference));
+			name_sets_type found(n_way_compare(file_size, candidate_names, buffer, buffer_size, options, candidate_references));
+			std::move(found.begin(), found.end(), std::back_inserter(duplicates));
+		}
+		// put the sets back in the order that comparing the group as a whole would have found them in
+		if(candidates.size() > 1) {
+			std::unordered_map<std::wstring, size_t> rank;
+			for(size_t i(0); i < names.size(); ++i) {
+				rank[names[i]] = i;
+			}
+			std::sort(duplicates.begin(), duplicates.end(), [&rank] (const std::vector<std::wstring>& lhs, const std::vector<std::wstring>& rhs) {
+				return rank.find(lhs.front())->second < rank.find(rhs.front())->second;
+			});
+		}
+		return duplicates;
+	}
+
+	// groups are compared by path, but their duplicate sets are handed back as the files in the table that those paths belong to
+	duplicate_sets_type to_file_indices(const name_sets_type& sets, const std::vector<std::wstring>& names, const file_table::file_index* group) {
+		duplicate_sets_type duplicates;
+		if(sets.empty()) {
+			return duplicates;
+		}
+		std::unordered_map<std::wstring, file_table::file_index> index_of;
+		for(size_t i(0); i < names.size(); ++i) {
+			index_of[names[i]] = group[i];
+		}
+		for(auto it(sets.cbegin()), end(sets.cend()); it != end; ++it) {
+			std::vector<file_table::file_index> duplicate_set;
+			duplicate_set.reserve(it->size());
+			for(auto nit(it->cbegin()), nend(it->cend()); nit != nend; ++nit) {
+				duplicate_set.push_back(index_of.find(*nit)->second);
+			}
+			duplicates.push_back(std::move(duplicate_set));
+		}
+		return duplicates;
+	}
+
+	struct group_result {
+		group_result() : file_size(0), file_count(0), reference_count(0), done(false) {
+		}
+
+		unsigned __int64 file_size;
+		size_t file_count;
+		size_t reference_count;
+		duplicate_sets_type duplicates;
+		prefilter_statistics prefilter;
+		std::exception_ptr failure;
+		bool done;
+	};
+
+	// every device that a job's groups' files are on. a job takes up one of each device's slots while it's being compared.
+	std::vector<file_table::device_index> job_devices(const file_table& table, const size_groups& files, size_t first_group, size_t group_count) {
+		std::vector<file_table::device_index> devices;
+		for(size_t g(first_group); g < first_group + group_count; ++g) {
+			const file_table::file_index* group(&files.files[files.groups[g].first]);
+			for(size_t i(0); i < files.groups[g].count; ++i) {
+				devices.push_back(table.directory(table.file(group[i]).directory).device);
+			}
+		}
+		std::sort(devices.begin(), devices.end());
+		devices.erase(std::unique(devices.begin(), devices.end()), devices.end());
+		return devices;
+	}
+
+	// a job is either a single group, or a run of consecutive groups of small files that are read and compared together
+	struct job {
+		size_t first_group;
+		size_t group_count;
+		bool small;
+	};
+
+	// runs of groups of small files, as long as they fit in a batch, become jobs of their own; every other group is a job by itself.
+	// reading in physical order keeps every file of a batch open at once, so then batches are held to the open file limit as well.
+	std::vector<job> make_jobs(const size_groups& files, size_t buffer_budget, const compare_options& options) {
+		const size_t batch_bytes(std::min(small_batch_bytes, buffer_budget));
+		const size_t batch_files(options.physical_order ? std::max<size_t>(1, std::min(small_batch_files, options.max_open_files)) : small_batch_files);
+		std::vector<job> jobs;
+		size_t bytes(0);
+		size_t file_count(0);
+		for(size_t i(0); i < files.groups.size(); ++i) {
+			const size_groups::group& g(files.groups[i]);
+			const size_t needed(g.size <= small_file_limit ? small_group_buffer_size(g.size, g.count) : 0);
+			// a group too big for a batch on its own goes through n_way_compare, which can take it a wave at a time
+			if(g.size > small_file_limit || needed > batch_bytes || g.count > batch_files) {
+				const job single = { i, 1, false };
+				jobs.push_back(single);
+				continue;
+			}
+			if(jobs.empty() || !jobs.back().small || bytes + needed > batch_bytes || file_count + g.count > batch_files) {
+				const job batch = { i, 0, true };
+				jobs.push_back(batch);
+				bytes = 0;
+				file_count = 0;
+			}
+			++jobs.back().group_count;
+			bytes += needed;
+			file_count += g.count;
+		}
+		return jobs;
+	}
+
+	// each device has a queue of its own, holding the jobs whose first device it is, and a limit on how many jobs may be reading from it at once,
+	// so that a rotational disk is given one group (or batch) at a time while the jobs on other disks carry on alongside it.
+	// the queues are taken from in turn. the budget is handed out strictly in that order: a job that is free to start on its devices
+	// but wants more than is currently free holds up every queue until enough jobs have finished, so a huge group can still claim (nearly)
+	// the whole budget, rather than being starved by a stream of small groups each taking a few pages.
+	struct scheduler_state {
+		static const size_t no_job = ~static_cast<size_t>(0);
+
+		scheduler_state(size_t buffer_budget, const std::vector<job>& jobs_, size_t group_count, size_t in_flight_limit_, const std::vector<size_t>& device_limits_) : available(buffer_budget),
+		                                                                                                                                                              in_flight(0),
+		                                                                                                                                                              in_flight_limit(in_flight_limit_),
+		                                                                                                                                                              device_limits(device_limits_),
+		                                                                                                                                                              device_in_flight(device_limits_.size(), 0),
+		                                                                                                                                                              queues(device_limits_.size()),
+		                                                                                                                                                              next_queue(0),
+		                                                                                                                                                              jobs(jobs_),
+		                                                                                                                                                              devices(jobs_.size()),
+		                                                                                                                                                              granted(jobs_.size(), 0),
+		                                                                                                                                                              results(group_count),
+		                                                                                                                                                              next_to_report(0) {
+			::InitializeCriticalSection(&lock);
+			::InitializeConditionVariable(&changed);
+		}
+
+		~scheduler_state() {
+			::DeleteCriticalSection(&lock);
+		}
+
+		// jobs must be queued in the order they're to be started in, and all before any are started
+		void enqueue(size_t index, const std::vector<file_table::device_index>& job_devices_, size_t bytes) {
+			devices[index] = job_devices_;
+			granted[index] = bytes;
+			queues[devices[index].front()].push_back(index);
+		}
+
+		void finish(size_t index) {
+			::EnterCriticalSection(&lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+			for(size_t g(jobs[index].first_group); g < jobs[index].first_group + jobs[index].group_count; ++g) {
+				results[g].done = true;
+				prefilter.candidates_eliminated += results[g].prefilter.candidates_eliminated;
+				prefilter.bytes_saved += results[g].prefilter.bytes_saved;
+			}
+			available += granted[index];
+			--in_flight;
+			for(auto it(devices[index].cbegin()), end(devices[index].cend()); it != end; ++it) {
+				--device_in_flight[*it];
+			}
+			::WakeConditionVariable(&changed);
+		}
+
+		// reports every finished group at the front of the queue; must be called without the lock held
+		void report_finished(const group_reporter_type& report) {
+			for(;;) {
+				{
+					::EnterCriticalSection(&lock);
+					ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+					if(next_to_report == results.size() || !results[next_to_report].done) {
+						return;
+					}
+				}
+				group_result& result(results[next_to_report++]);
+				if(result.failure != std::exception_ptr()) {
+					std::rethrow_exception(result.failure);
+				}
+				report(result.file_size, result.file_count, result.duplicates);
+				duplicate_sets_type().swap(result.duplicates);
+			}
+		}
+
+		// waits until some queued job can be started, and reserves its room and its devices' slots, or until the next group to report has finished.
+		// returns the job that was reserved for, or no_job.
+		size_t reserve() {
+			::EnterCriticalSection(&lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+			for(;;) {
+				const size_t index(in_flight < in_flight_limit ? startable() : no_job);
+				if(index != no_job) {
+					queues[devices[index].front()].pop_front();
+					available -= granted[index];
+					++in_flight;
+					for(auto it(devices[index].cbegin()), end(devices[index].cend()); it != end; ++it) {
+						++device_in_flight[*it];
+					}
+					return index;
+				}
+				if(next_to_report < results.size() && results[next_to_report].done) {
+					return no_job;
+				}
+				::SleepConditionVariableCS(&changed, &lock, INFINITE);
+			}
+		}
+
+		// waits until the next group to report has finished
+		void wait_for_next() {
+			::EnterCriticalSection(&lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&lock); });
+			while(!results[next_to_report].done) {
+				::SleepConditionVariableCS(&changed, &lock, INFINITE);
+			}
+		}
+
+		CRITICAL_SECTION lock;
+		CONDITION_VARIABLE changed;
+		size_t available;
+		size_t in_flight;
+		const size_t in_flight_limit;
+		const std::vector<size_t> device_limits;
+		std::vector<size_t> device_in_flight;
+		std::vector<std::deque<size_t> > queues;
+		// the queue to look at first next time, so that no device's queue gets ahead of the others'
+		size_t next_queue;
+		const std::vector<job> jobs;
+		// by job
+		std::vector<std::vector<file_table::device_index> > devices;
+		std::vector<size_t> granted;
+		// by group
+		std::vector<group_result> results;
+		size_t next_to_report;
+		prefilter_statistics prefilter;
+
+	private:
+		// the first job at the front of a queue whose devices all have a slot free, as long as the budget will stretch to it. must be called with the lock held.
+		size_t startable() {
+			for(size_t i(0); i < queues.size(); ++i) {
+				const size_t queue((next_queue + i) % queues.size());
+				if(queues[queue].empty()) {
+					continue;
+				}
+				const size_t index(queues[queue].front());
+				bool free(true);
+				for(auto it(devices[index].cbegin()), end(devices[index].cend()); it != end; ++it) {
+					free = free && device_in_flight[*it] < device_limits[*it];
+				}
+				if(!free) {
+					continue;
+				}
+				if(available < granted[index]) {
+					return no_job;
+				}
+				next_queue = (queue + 1) % queues.size();
+				return index;
+			}
+			return no_job;
+		}
+
+		scheduler_state(const scheduler_state&);
+		scheduler_state& operator=(const scheduler_state&);
+	};
+}
+
+prefilter_statistics compare_groups(const file_table& table, const size_groups& files, size_t buffer_budget, size_t compare_threads, const compare_options& options, const group_reporter_type& report) {
+	if(compare_threads == 0) {
+		SYSTEM_INFO system_info = {0};
+		::GetSystemInfo(&system_info);
+		compare_threads = system_info.dwNumberOfProcessors;
+	}
+	std::vector<size_t> device_limits;
+	for(size_t i(0); i < table.device_count(); ++i) {
+		device_limits.push_back(device_concurrency(table.device(i)));
+	}
+	const std::vector<job> jobs(make_jobs(files, buffer_budget, options));
+	scheduler_state state(buffer_budget, jobs, files.groups.size(), compare_threads, device_limits);
+	unsigned __int64 total_bytes(0);
+	for(auto it(files.groups.cbegin()), end(files.groups.cend()); it != end; ++it) {
+		total_bytes += it->size * it->count;
+	}
+	instrumentation::set_compare_totals(files.groups.size(), total_bytes);
+	// declared after the state so that outstanding jobs are finished with it before it goes away
+	util::work_stealing_pool pool(compare_threads);
+
+	// groups are reported in size order regardless, but can be started in whatever order suits the disk best. finding where a group is costs
+	// an open of its first file, so it's done on the pool's threads, and only for groups of large files; a batch of small files tells us little
+	// from its first file, and sorts its own files instead. batches sort first.
+	std::vector<std::pair<disk_location, size_t> > start_order(jobs.size());
+	for(size_t i(0); i < jobs.size(); ++i) {
+		start_order[i].second = i;
+		if(options.physical_order && !jobs[i].small) {
+			std::pair<disk_location, size_t>& placed(start_order[i]);
+			const file_table::file_index* group(&files.files[files.groups[jobs[i].first_group].first]);
+			pool.submit([&placed, &table, group] (size_t) {
+				placed.first = group_location(table, group);
+			});
+		}
+	}
+	pool.wait();
+	std::stable_sort(start_order.begin(), start_order.end(), [] (const std::pair<disk_location, size_t>& lhs, const std::pair<disk_location, size_t>& rhs) {
+		return lhs.first < rhs.first;
+	});
+	for(auto sit(start_order.cbegin()), send(start_order.cend()); sit != send; ++sit) {
+		const job& j(jobs[sit->second]);
+		size_t bytes(0);
+		if(j.small) {
+			for(size_t g(j.first_group); g < j.first_group + j.group_count; ++g) {
+				bytes += small_group_buffer_size(files.groups[g].size, files.groups[g].count);
+			}
+		}
+		else {
+			bytes = desired_buffer_size(files.groups[j.first_group].size, files.groups[j.first_group].count, buffer_budget);
+		}
+		state.enqueue(sit->second, job_devices(table, files, j.first_group, j.group_count), bytes);
+	}
+	for(size_t i(0); i < files.groups.size(); ++i) {
+		state.results[i].file_size = files.groups[i].size;
+		state.results[i].file_count = files.groups[i].count;
+		state.results[i].reference_count = files.groups[i].references;
+	}
+
+	for(size_t launched(0); launched < jobs.size(); ++launched) {
+		size_t index(scheduler_state::no_job);
+		do {
+			state.report_finished(report);
+		}
+		while((index = state.reserve()) == scheduler_state::no_job);
+
+		const job& j(jobs[index]);
+		const size_t granted(state.granted[index]);
+		pool.submit([&state, &files, &options, &table, &j, index, granted] (size_t) {
+			const unsigned __int64 started(instrumentation::enabled ? instrumentation::now() : 0);
+			group_result& first(state.results[j.first_group]);
+			try {
+				void* buffer(::VirtualAlloc(nullptr, granted, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+				if(buffer == nullptr) {
+					throw std::bad_alloc();
+				}
+				ON_BLOCK_EXIT([=] { ::VirtualFree(buffer, 0, MEM_RELEASE); });
+				// paths are only put together for as long as the group is being compared
+				std::vector<std::vector<std::wstring> > names(j.group_count);
+				for(size_t k(0); k < j.group_count; ++k) {
+					const group_result& result(state.results[j.first_group + k]);
+					const file_table::file_index* group(&files.files[files.groups[j.first_group + k].first]);
+					names[k].reserve(result.file_count);
+					for(size_t i(0); i < result.file_count; ++i) {
+						names[k].push_back(table.path_of(group[i]));
+					}
+				}
+				if(j.small) {
+					// every file of the batch is read whole and compared in one go, skipping the prefilter, as sampling a file this small costs a read all the same
+					std::vector<small_group> batch(j.group_count);
+					for(size_t k(0); k < j.group_count; ++k) {
+						batch[k].file_size = state.results[j.first_group + k].file_size;
+						batch[k].names = names[k];
+						batch[k].reference_count = state.results[j.first_group + k].reference_count;
+					}
+					const std::vector<name_sets_type> sets(compare_small_groups(batch, buffer, options));
+					for(size_t k(0); k < j.group_count; ++k) {
+						state.results[j.first_group + k].duplicates = to_file_indices(sets[k], names[k], &files.files[files.groups[j.first_group + k].first]);
+					}
+				}
+				else {
+					first.duplicates = to_file_indices(compare_group(first.file_size, names[0], first.reference_count, buffer, granted, options, first.prefilter), names[0], &files.files[files.groups[j.first_group].first]);
+				}
+			} catch(...) {
+				first.failure = std::current_exception();
+			}
+			if(started != 0) {
+				// a batch's groups are read together, so its time is shared out between them by how many files each has
+				const unsigned __int64 ticks(instrumentation::now() - started);
+				size_t file_count(0);
+				for(size_t k(0); k < j.group_count; ++k) {
+					file_count += state.results[j.first_group + k].file_count;
+				}
+				for(size_t k(0); k < j.group_count; ++k) {
+					const group_result& result(state.results[j.first_group + k]);
+					instrumentation::record_group(result.file_size, result.file_count, ticks * result.file_count / file_count);
+				}
+			}
+			state.finish(index);
+		});
+	}
+	while(state.next_to_report < state.results.size()) {
+		state.wait_for_next();
+		state.report_finished(report);
+	}
+	return state.prefilter;
+}
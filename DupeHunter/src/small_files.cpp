@@ -0,0 +1,268 @@
+// small_files.cpp : reads small files whole, a batch of size groups at a time, and compares each in a single step
+//
+
+#include "stdafx.h"
+
+#include "small_files.hpp"
+#include "compare.hpp"
+#include "extents.hpp"
+#include "instrumentation.hpp"
+
+namespace {
+	// each file's slice of the buffer starts on a cache line of its own
+	const unsigned __int64 slice_alignment(64);
+
+	const size_t no_clone(~static_cast<size_t>(0));
+
+	typedef std::vector<std::vector<std::wstring> > name_sets_type;
+
+	struct small_file
+	{
+		unsigned __int8* data;
+		DWORD length;
+		HANDLE handle;
+		OVERLAPPED overlapped;
+		// (volume, file index), for finding hard links, if the file system would say
+		std::pair<DWORD, unsigned __int64> id;
+		bool identified;
+		DWORD bytes_read;
+		// whether the file was opened and its read queued, and so has something to report
+		bool started;
+		// the file in the same group whose clusters this one shares all of, if any. it isn't read, but takes on that file's contents.
+		size_t clone_of;
+	};
+
+	// opens the file and checks that it's still the size it was found to be, closing it again if not
+	bool open_file(small_file& file, const std::wstring& name) {
+		file.handle = instrumentation::timed(instrumentation::open_timer, [&] {
+			return ::CreateFileW(name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_OVERLAPPED, 0);
+		});
+		if(file.handle == INVALID_HANDLE_VALUE) {
+			std::wcerr << L"Could not open file " << name << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			return false;
+		}
+		instrumentation::count(instrumentation::files_opened);
+		BY_HANDLE_FILE_INFORMATION info = {0};
+		file.identified = FALSE != ::GetFileInformationByHandle(file.handle, &info);
+		// as with n_way_compare, a size from the scan index may be out of date, and a file that's grown would be compared on only part of itself
+		if(file.identified && ((static_cast<unsigned __int64>(info.nFileSizeHigh) << 32) + info.nFileSizeLow) != file.length) {
+			std::wcerr << L"File " << name << L" is no longer " << file.length << L" bytes, ignoring" << std::endl;
+			::CloseHandle(file.handle);
+			file.handle = INVALID_HANDLE_VALUE;
+			return false;
+		}
+		file.id = std::make_pair(info.dwVolumeSerialNumber, (static_cast<unsigned __int64>(info.nFileIndexHigh) << 32) + info.nFileIndexLow);
+		return true;
+	}
+
+	// queues a read of the whole of an open file to the port, closing it if the read can't be queued.
+	// the files are small enough that there's nothing to be gained from unbuffered reads, which would also need their lengths rounding up.
+	bool start_read(HANDLE port, small_file& file, const std::wstring& name, ULONG_PTR key) {
+		std::memset(&file.overlapped, 0, sizeof(file.overlapped));
+		// the completion is queued to the port even when the read finishes immediately
+		if(nullptr != ::CreateIoCompletionPort(file.handle, port, key, 0)
+		&& (FALSE != ::ReadFile(file.handle, file.data, file.length, nullptr, &file.overlapped) || ::GetLastError() == ERROR_IO_PENDING)) {
+			instrumentation::count(instrumentation::read_calls);
+			file.started = true;
+			return true;
+		}
+		std::wcerr << L"Could not read file " << name << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+		::CloseHandle(file.handle);
+		file.handle = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	// the files are read in order, each opened (unless it already is), read, and closed in turn, but up to queue_depth of them are
+	// somewhere along the way at any one time
+	void read_all(std::vector<small_file>& files, const std::vector<const std::wstring*>& names, const std::vector<size_t>& order, size_t queue_depth) {
+		HANDLE port(::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1));
+		if(port == nullptr) {
+			throw std::exception("Could not create I/O completion port");
+		}
+		ON_BLOCK_EXIT([=] { ::CloseHandle(port); });
+		const size_t depth(queue_depth == 0 ? 1 : queue_depth);
+		size_t next_to_start(0);
+		size_t in_flight(0);
+		for(;;) {
+			while(in_flight < depth && next_to_start < order.size()) {
+				const size_t i(order[next_to_start++]);
+				if(files[i].handle == INVALID_HANDLE_VALUE && !open_file(files[i], *names[i])) {
+					continue;
+				}
+				if(start_read(port, files[i], *names[i], static_cast<ULONG_PTR>(i))) {
+					++in_flight;
+				}
+			}
+			if(in_flight == 0) {
+				break;
+			}
+			DWORD transferred(0);
+			ULONG_PTR key(0);
+			OVERLAPPED* o(nullptr);
+			const BOOL ok(instrumentation::timed(instrumentation::read_timer, [&] { return ::GetQueuedCompletionStatus(port, &transferred, &key, &o, INFINITE); }));
+			// with no timeout, getting no packet at all means the port has failed, and waiting again would only spin
+			if(o == nullptr) {
+				throw std::exception("Could not wait on I/O completion port");
+			}
+			--in_flight;
+			small_file& file(files[static_cast<size_t>(key)]);
+			file.bytes_read = FALSE != ok ? transferred : 0;
+			instrumentation::count(instrumentation::bytes_read, file.bytes_read);
+			::CloseHandle(file.handle);
+			file.handle = INVALID_HANDLE_VALUE;
+		}
+	}
+
+	// opens every file up front to find where its data is, and returns the order to read them in, which is the order they sit on disk.
+	// a file whose clusters are all those of an earlier file in its group is a clone of it, and is closed again rather than read.
+	std::vector<size_t> physical_order(std::vector<small_file>& files, const std::vector<const std::wstring*>& names, const std::vector<small_group>& groups) {
+		std::vector<file_extents> extents(files.size());
+		std::vector<std::pair<std::pair<DWORD, unsigned __int64>, size_t> > locations;
+		size_t group_start(0);
+		for(auto it(groups.cbegin()), end(groups.cend()); it != end; ++it) {
+			for(size_t i(group_start); i < group_start + it->names.size(); ++i) {
+				if(!open_file(files[i], *names[i])) {
+					continue;
+				}
+				query_extents(files[i].handle, extents[i]);
+				size_t original(group_start);
+				for(; original < i && (files[original].handle == INVALID_HANDLE_VALUE || !extents[original].shares_all_clusters(extents[i])); ++original) {
+				}
+				if(original < i) {
+					files[i].clone_of = original;
+					::CloseHandle(files[i].handle);
+					files[i].handle = INVALID_HANDLE_VALUE;
+					continue;
+				}
+				locations.push_back(std::make_pair(std::make_pair(extents[i].volume, extents[i].first_cluster()), i));
+			}
+			group_start += it->names.size();
+		}
+		std::sort(locations.begin(), locations.end());
+		std::vector<size_t> order;
+		order.reserve(locations.size());
+		for(auto it(locations.cbegin()), end(locations.cend()); it != end; ++it) {
+			order.push_back(it->second);
+		}
+		return order;
+	}
+
+	// the same sets that n_way_compare would find, from files that are already in memory in their entirety
+	name_sets_type compare_group(small_group& group, const small_file* files) {
+		const size_t first_given_reference(group.names.size() - group.reference_count);
+		std::vector<std::wstring> names;
+		std::vector<unsigned __int8*> buffers;
+		std::vector<DWORD> bytes_read;
+		std::set<std::pair<DWORD, unsigned __int64> > file_ids;
+		group.reference_count = 0;
+		for(size_t i(0); i < group.names.size(); ++i) {
+			const small_file& file(files[i]);
+			if(!file.started) {
+				continue;
+			}
+			if(file.bytes_read != file.length) {
+				std::wcerr << L"Could not read file " << group.names[i] << L" to the end, ignoring" << std::endl;
+				continue;
+			}
+			// as with n_way_compare, this only catches the hard links that the walk couldn't set aside itself. a file the file system
+			// wouldn't identify can't be told to be a link at all.
+			if(file.identified) {
+				if(file_ids.find(file.id) != file_ids.end()) {
+					std::wcerr << L"Skipping file " << group.names[i] << L" due to hard links" << std::endl;
+					continue;
+				}
+				file_ids.insert(file.id);
+			}
+			names.push_back(group.names[i]);
+			buffers.push_back(file.data);
+			bytes_read.push_back(file.bytes_read);
+			if(i >= first_given_reference) {
+				++group.reference_count;
+			}
+		}
+		group.names.swap(names);
+
+		name_sets_type duplicate_sets;
+		if(group.names.size() < 2 || group.reference_count == group.names.size()) {
+			return duplicate_sets;
+		}
+		std::vector<size_t> members;
+		for(size_t i(0); i < group.names.size(); ++i) {
+			members.push_back(i);
+		}
+		std::vector<std::vector<size_t> > classes;
+		split_class(members, buffers, bytes_read, group.names.size() - group.reference_count, classes);
+		std::sort(classes.begin(), classes.end(), [] (const std::vector<size_t>& lhs, const std::vector<size_t>& rhs) {
+			return lhs.front() < rhs.front();
+		});
+		for(auto it(classes.cbegin()), end(classes.cend()); it != end; ++it) {
+			std::vector<std::wstring> duplicates;
+			duplicates.reserve(it->size());
+			for(auto mit(it->cbegin()), mend(it->cend()); mit != mend; ++mit) {
+				duplicates.push_back(group.names[*mit]);
+			}
+			duplicate_sets.push_back(std::move(duplicates));
+		}
+		return duplicate_sets;
+	}
+}
+
+size_t small_group_buffer_size(unsigned __int64 file_size, size_t file_count) {
+	return static_cast<size_t>(file_count * round_to_next_multiple(file_size, slice_alignment));
+}
+
+std::vector<name_sets_type> compare_small_groups(std::vector<small_group>& groups, void* buffer, const compare_options& options) {
+	std::vector<small_file> files;
+	std::vector<const std::wstring*> names;
+	unsigned __int8* slice(static_cast<unsigned __int8*>(buffer));
+	for(auto it(groups.cbegin()), end(groups.cend()); it != end; ++it) {
+		for(auto nit(it->names.cbegin()), nend(it->names.cend()); nit != nend; ++nit) {
+			small_file file = {0};
+			file.data = slice;
+			file.length = static_cast<DWORD>(it->file_size);
+			file.handle = INVALID_HANDLE_VALUE;
+			file.clone_of = no_clone;
+			files.push_back(file);
+			names.push_back(&*nit);
+			slice += round_to_next_multiple(it->file_size, slice_alignment);
+		}
+	}
+	// files opened up front, or left open by a failure part way through, are closed whatever happens
+	ON_BLOCK_EXIT([&] {
+		for(auto it(files.cbegin()), end(files.cend()); it != end; ++it) {
+			if(it->handle != INVALID_HANDLE_VALUE) {
+				::CloseHandle(it->handle);
+			}
+		}
+	});
+	std::vector<size_t> order;
+	if(options.physical_order) {
+		physical_order(files, names, groups).swap(order);
+	}
+	else {
+		for(size_t i(0); i < files.size(); ++i) {
+			order.push_back(i);
+		}
+	}
+	read_all(files, names, order, options.queue_depth);
+	// a clone comes after the file it shares its clusters with, and is compared on that file's contents
+	for(auto it(files.begin()), end(files.end()); it != end; ++it) {
+		if(it->clone_of != no_clone) {
+			const small_file& original(files[it->clone_of]);
+			it->data = original.data;
+			it->bytes_read = original.bytes_read;
+			it->started = original.started;
+		}
+	}
+
+	instrumentation::scoped_timer comparing(instrumentation::compare_timer);
+	std::vector<name_sets_type> results;
+	results.reserve(groups.size());
+	const small_file* group_files(files.empty() ? nullptr : &files[0]);
+	for(auto it(groups.begin()), end(groups.end()); it != end; ++it) {
+		const size_t count(it->names.size());
+		results.push_back(compare_group(*it, group_files));
+		group_files += count;
+	}
+	return results;
+}
@@ -0,0 +1,491 @@
+// traversal.cpp : parallel directory walk that builds the size map
+//
+
+#include "stdafx.h"
+
+#include "traversal.hpp"
+#include "file_table.hpp"
+#include "scan_index.hpp"
+#include "name_filter.hpp"
+#include "instrumentation.hpp"
+
+#include <utility/radix_sort.hpp>
+
+namespace {
+	// a file's position in a depth-first walk is the chain of entry ordinals leading to it, starting with the index of its source.
+	// every file in a directory shares that directory's chain and adds its own ordinal on the end, so sorting on the chains
+	// reproduces the order a single-threaded recursive walk would have found things in, however the work got split up.
+	typedef std::vector<unsigned int> ordinal_path;
+
+	// the file itself is in the table of the worker that found it, until the tables are joined at the end
+	struct found_file {
+		unsigned __int64 size;
+		const ordinal_path* directory;
+		unsigned int ordinal;
+		file_table::file_index file;
+	};
+
+	bool walk_order(const found_file& lhs, const found_file& rhs) {
+		const ordinal_path& l(*lhs.directory);
+		const ordinal_path& r(*rhs.directory);
+		const size_t common(std::min(l.size(), r.size()));
+		for(size_t i(0); i < common; ++i) {
+			if(l[i] != r[i]) {
+				return l[i] < r[i];
+			}
+		}
+		// past the common prefix, each side is either the file itself or the subdirectory that leads to it
+		const unsigned int l_next(l.size() > common ? l[common] : lhs.ordinal);
+		const unsigned int r_next(r.size() > common ? r[common] : rhs.ordinal);
+		return l_next < r_next;
+	}
+
+	// everything a worker finds goes into its own list, so the walk itself never contends on anything but the directory table
+	struct worker_state {
+		worker_state() : count(0), directories_reused(0), directories_enumerated(0) {
+		}
+
+		std::vector<found_file> found;
+		// the first of two passes keeps nothing of a file but its size
+		std::vector<unsigned __int64> sizes;
+		// only the files go in here; their directories are all in the scan's shared table
+		file_table files;
+		std::deque<ordinal_path> directories;
+		unsigned __int64 count;
+		unsigned __int64 directories_reused;
+		unsigned __int64 directories_enumerated;
+		scan_index_builder index_builder;
+	};
+
+	struct directory_entry {
+		const wchar_t* name;
+		size_t name_length;
+		DWORD attributes;
+		unsigned __int64 size;
+		unsigned __int64 file_id;
+		unsigned __int64 last_write_time;
+	};
+
+	bool is_dot_or_dotdot(const directory_entry& entry) {
+		return (entry.name_length == 1 && entry.name[0] == L'.')
+		    || (entry.name_length == 2 && entry.name[0] == L'.' && entry.name[1] == L'.');
+	}
+
+	// FindFirstFileExW is the fallback for filesystems (FAT, some redirectors) that won't enumerate through a directory handle
+	template<typename F>
+	bool for_each_entry_by_search(const std::wstring& path, F f) {
+		const std::wstring search_path(path + (path[path.size() - 1] == L'\\' ? L"*" : L"\\*"));
+		WIN32_FIND_DATAW found = {0};
+		HANDLE finder(::FindFirstFileExW(search_path.c_str(), FindExInfoBasic, &found, FindExSearchNameMatch, nullptr, FIND_FIRST_EX_LARGE_FETCH));
+		if(finder == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+		ON_BLOCK_EXIT([=] { ::FindClose(finder); });
+		do {
+			const directory_entry entry = { found.cFileName,
+			                                std::wcslen(found.cFileName),
+			                                found.dwFileAttributes,
+			                                (static_cast<unsigned __int64>(found.nFileSizeHigh) << 32) + static_cast<unsigned __int64>(found.nFileSizeLow),
+			                                0,
+			                                (static_cast<unsigned __int64>(found.ftLastWriteTime.dwHighDateTime) << 32) + static_cast<unsigned __int64>(found.ftLastWriteTime.dwLowDateTime) };
+			if(!is_dot_or_dotdot(entry)) {
+				f(entry);
+			}
+		}
+		while(FALSE != ::FindNextFileW(finder, &found));
+		return ::GetLastError() == ERROR_NO_MORE_FILES;
+	}
+
+	// enumerates through an open directory handle, pulling back as many entries as fit in each call, sizes and all.
+	// returns false if the listing was cut short, in which case only some of the entries have been seen.
+	template<typename F>
+	bool for_each_entry(HANDLE directory, const std::wstring& path, F f) {
+		// FILE_ID_BOTH_DIR_INFO records must be 8-byte aligned
+		std::vector<unsigned __int64> buffer((64 * 1024) / sizeof(unsigned __int64));
+		const DWORD buffer_bytes(static_cast<DWORD>(buffer.size() * sizeof(unsigned __int64)));
+		bool first(true);
+		while(FALSE != ::GetFileInformationByHandleEx(directory, first ? FileIdBothDirectoryRestartInfo : FileIdBothDirectoryInfo, &buffer[0], buffer_bytes)) {
+			first = false;
+			const unsigned __int8* position(reinterpret_cast<const unsigned __int8*>(&buffer[0]));
+			for(;;) {
+				const FILE_ID_BOTH_DIR_INFO* info(reinterpret_cast<const FILE_ID_BOTH_DIR_INFO*>(position));
+				const directory_entry entry = { info->FileName,
+				                                info->FileNameLength / sizeof(wchar_t),
+				                                info->FileAttributes,
+				                                static_cast<unsigned __int64>(info->EndOfFile.QuadPart),
+				                                static_cast<unsigned __int64>(info->FileId.QuadPart),
+				                                static_cast<unsigned __int64>(info->LastWriteTime.QuadPart) };
+				if(!is_dot_or_dotdot(entry)) {
+					f(entry);
+				}
+				if(info->NextEntryOffset == 0) {
+					break;
+				}
+				position += info->NextEntryOffset;
+			}
+		}
+		if(::GetLastError() == ERROR_NO_MORE_FILES) {
+			return true;
+		}
+		// a directory handle that can't be enumerated at all may still be searchable, but one that fails part way through has already had entries seen
+		return first ? for_each_entry_by_search(path, f) : false;
+	}
+
+	// replays the entries recorded for a directory by an earlier run
+	template<typename F>
+	void for_each_indexed_entry(const scan_index& index, const indexed_directory& directory, F f) {
+		const indexed_entry* entries(index.entries_of(directory));
+		for(unsigned __int32 i(0); i < directory.entry_count; ++i) {
+			const directory_entry entry = { index.name_of(entries[i]), entries[i].name_length, entries[i].attributes, entries[i].size, entries[i].file_id, entries[i].last_write_time };
+			f(entry);
+		}
+	}
+
+	struct scan_context {
+		scan_context(const name_filter& filter_, size_t thread_count, const scan_index* previous_index_, bool record_index_) : filter(filter_),
+		                                                                                                                       previous_index(previous_index_),
+		                                                                                                                       record_index(record_index_),
+		                                                                                                                       sizes_only(false),
+		                                                                                                                       wanted_sizes(nullptr),
+		                                                                                                                       states(thread_count),
+		                                                                                                                       pool(thread_count) {
+			::InitializeCriticalSection(&directories_lock);
+		}
+
+		~scan_context() {
+			::DeleteCriticalSection(&directories_lock);
+		}
+
+		// handle is the directory itself, if it could be opened, which is how the disk it's on is found
+		file_table::directory_index add_directory(file_table::directory_index parent, const wchar_t* name, size_t name_length, unsigned __int32 volume, HANDLE handle) {
+			::EnterCriticalSection(&directories_lock);
+			ON_BLOCK_EXIT([&] { ::LeaveCriticalSection(&directories_lock); });
+			return directories.add_directory(parent, name, name_length, volume, device_of(volume, handle));
+		}
+
+		bool keeps(unsigned __int64 size) const {
+			return wanted_sizes == nullptr || std::binary_search(wanted_sizes->begin(), wanted_sizes->end(), size);
+		}
+
+		// the disk is only looked for the first time a volume turns up; volumes on the same disk share a device. must be called with the lock held.
+		file_table::device_index device_of(unsigned __int32 volume, HANDLE handle) {
+			const auto known(volume_devices.find(volume));
+			if(known != volume_devices.end()) {
+				return known->second;
+			}
+			const device_info info(identify_device(handle, volume));
+			file_table::device_index device(0);
+			const auto same_disk(info.disk_number == device_info::no_disk ? disk_devices.end() : disk_devices.find(info.disk_number));
+			if(same_disk != disk_devices.end()) {
+				device = same_disk->second;
+			}
+			else {
+				device = directories.add_device(info);
+				if(info.disk_number != device_info::no_disk) {
+					disk_devices[info.disk_number] = device;
+				}
+			}
+			// directories that couldn't be opened all have a volume of 0, and so share a single device that nothing is known about
+			volume_devices[volume] = device;
+			return device;
+		}
+
+		// the directory's own name is the part of its path from name_start onwards
+		void submit_directory(const std::wstring& path, size_t name_start, file_table::directory_index parent, const ordinal_path& ordinals, size_t worker) {
+			pool.submit([=] (size_t current_worker) {
+				this->scan_directory(path, name_start, parent, ordinals, current_worker);
+			}, worker);
+		}
+
+		void scan_directory(const std::wstring& path, size_t name_start, file_table::directory_index parent, const ordinal_path& ordinals, size_t worker) {
+			instrumentation::scoped_timer listing(instrumentation::traversal_timer);
+			instrumentation::count(instrumentation::directories_listed);
+			worker_state& state(states[worker]);
+			const ordinal_path* directory(nullptr);
+			if(!sizes_only) {
+				state.directories.push_back(ordinals);
+				directory = &state.directories.back();
+			}
+
+			// child paths share this prefix; only directories and permitted files ever get a string of their own
+			const std::wstring prefix(path + (path[path.size() - 1] == L'\\' ? L"" : L"\\"));
+			unsigned int ordinal(0);
+			bool recording(false);
+
+			HANDLE handle(::CreateFileW(path.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, 0));
+			ON_BLOCK_EXIT([=] {
+				if(handle != INVALID_HANDLE_VALUE) {
+					::CloseHandle(handle);
+				}
+			});
+			// file ids are only unique within a volume
+			BY_HANDLE_FILE_INFORMATION info = {0};
+			if(handle != INVALID_HANDLE_VALUE) {
+				::GetFileInformationByHandle(handle, &info);
+			}
+			const file_table::directory_index this_directory(sizes_only ? file_table::no_directory : add_directory(parent, path.c_str() + name_start, path.size() - name_start, info.dwVolumeSerialNumber, handle));
+
+			auto visit = [&] (const directory_entry& entry) {
+				if(recording) {
+					state.index_builder.add_entry(entry.name, entry.name_length, entry.attributes, entry.size, entry.file_id, entry.last_write_time);
+				}
+				const unsigned int entry_ordinal(ordinal++);
+				if((entry.attributes & FILE_ATTRIBUTE_DIRECTORY) == FILE_ATTRIBUTE_DIRECTORY) {
+					if((entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT) != FILE_ATTRIBUTE_REPARSE_POINT) {
+						ordinal_path child(ordinals);
+						child.push_back(entry_ordinal);
+						this->submit_directory(prefix + std::wstring(entry.name, entry.name_length), prefix.size(), this_directory, child, worker);
+					}
+				}
+				else {
+					instrumentation::count(instrumentation::names_filtered);
+					if(instrumentation::timed(instrumentation::filter_timer, [&] { return filter.permitted(entry.name, entry.name_length); })) {
+						if(sizes_only) {
+							state.sizes.push_back(entry.size);
+						}
+						else if(keeps(entry.size)) {
+							const found_file found = { entry.size, directory, entry_ordinal, state.files.add_file(this_directory, entry.name, entry.name_length, entry.size, entry.file_id) };
+							state.found.push_back(found);
+						}
+						++state.count;
+						instrumentation::count(instrumentation::files_found);
+					}
+				}
+			};
+
+			bool listed(false);
+			if(handle == INVALID_HANDLE_VALUE) {
+				listed = for_each_entry_by_search(path, visit);
+			}
+			else {
+				// adding, removing, or renaming an entry updates the directory's timestamps. changes to the files themselves don't,
+				// so sizes taken from the index are as of the last time the directory's membership changed.
+				FILE_BASIC_INFO times = {0};
+				const bool timed((previous_index != nullptr || record_index) && FALSE != ::GetFileInformationByHandleEx(handle, FileBasicInfo, &times, sizeof(times)));
+				if(timed && record_index) {
+					state.index_builder.add_directory(path, static_cast<unsigned __int64>(times.LastWriteTime.QuadPart), static_cast<unsigned __int64>(times.ChangeTime.QuadPart));
+					recording = true;
+				}
+				const indexed_directory* indexed(timed && previous_index != nullptr ? previous_index->find(path) : nullptr);
+				if(indexed != nullptr && indexed->last_write_time == static_cast<unsigned __int64>(times.LastWriteTime.QuadPart) && indexed->change_time == static_cast<unsigned __int64>(times.ChangeTime.QuadPart)) {
+					for_each_indexed_entry(*previous_index, *indexed, visit);
+					++state.directories_reused;
+					listed = true;
+				}
+				else {
+					listed = for_each_entry(handle, path, visit);
+					++state.directories_enumerated;
+				}
+			}
+			if(!listed) {
+				std::wcerr << L"Could not enumerate directory " << path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+				// a partial listing mustn't be replayed by later runs as if it were the whole directory
+				if(recording) {
+					state.index_builder.remove_last_directory();
+				}
+			}
+		}
+
+		const name_filter& filter;
+		// every directory the workers visit, shared between them so that a directory's parent is always in the same table as it is
+		file_table directories;
+		CRITICAL_SECTION directories_lock;
+		std::map<unsigned __int32, file_table::device_index> volume_devices;
+		std::map<DWORD, file_table::device_index> disk_devices;
+		const scan_index* previous_index;
+		const bool record_index;
+		// with sizes_only, files are only counted, into their worker's sizes, and no directories go in the table either.
+		// otherwise, files whose size isn't among the wanted sizes (if there are any) are counted and then forgotten.
+		bool sizes_only;
+		const std::vector<unsigned __int64>* wanted_sizes;
+		// declared before the pool so that the workers are gone before their state is
+		std::vector<worker_state> states;
+		util::work_stealing_pool pool;
+
+	private:
+		scan_context(const scan_context&);
+		scan_context& operator=(const scan_context&);
+	};
+
+	// walks every source, waiting until the workers are done. sources that are plain files are dealt with here, while the workers may
+	// already be busy with their own state, and go in top_level.
+	void walk_sources(scan_context& context, worker_state& top_level, const std::vector<std::wstring>& sources) {
+		// plain file sources keep the path they were given as their name, under a directory with no name at all
+		file_table::directory_index top_level_directory(file_table::no_directory);
+
+		for(size_t i(0); i < sources.size(); ++i) {
+			const std::wstring& base_path(sources[i]);
+			const ordinal_path root(1, static_cast<unsigned int>(i));
+			WIN32_FILE_ATTRIBUTE_DATA attributes = {0};
+			::GetFileAttributesExW(base_path.c_str(), GetFileExInfoStandard, &attributes);
+
+			if((attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != FILE_ATTRIBUTE_DIRECTORY) {
+				DWORD buffer_size(::GetFullPathNameW(base_path.c_str(), 0, nullptr, nullptr));
+				std::unique_ptr<wchar_t[]> buffer(new wchar_t[buffer_size]);
+				wchar_t* file_name(nullptr);
+				::GetFullPathNameW(base_path.c_str(), buffer_size, buffer.get(), &file_name);
+				if(context.filter.permitted(file_name, std::wcslen(file_name))) {
+					const unsigned __int64 size((static_cast<unsigned __int64>(attributes.nFileSizeHigh) << 32) + static_cast<unsigned __int64>(attributes.nFileSizeLow));
+					++top_level.count;
+					if(context.sizes_only) {
+						top_level.sizes.push_back(size);
+						continue;
+					}
+					if(!context.keeps(size)) {
+						continue;
+					}
+					if(top_level_directory == file_table::no_directory) {
+						top_level_directory = context.add_directory(file_table::no_directory, L"", 0, 0, INVALID_HANDLE_VALUE);
+					}
+					top_level.directories.push_back(root);
+					const found_file found = { size, &top_level.directories.back(), 0, top_level.files.add_file(top_level_directory, base_path.c_str(), base_path.size(), size, 0) };
+					top_level.found.push_back(found);
+				}
+				continue;
+			}
+			context.pool.submit([&context, base_path, root] (size_t worker) {
+				context.scan_directory(base_path, 0, file_table::no_directory, root, worker);
+			});
+		}
+		context.pool.wait();
+	}
+
+	// the first of two passes, which keeps nothing of a file but its size, so that the second can leave out the files whose size is unique
+	// without ever having stored them. returns the sizes that more than one file has, in order.
+	std::vector<unsigned __int64> shared_sizes(const name_filter& filter, const std::vector<std::wstring>& sources, size_t scan_threads, const scan_index* previous_index) {
+		scan_context context(filter, scan_threads, previous_index, false);
+		context.sizes_only = true;
+		worker_state top_level;
+		walk_sources(context, top_level, sources);
+
+		std::vector<unsigned __int64> sizes;
+		sizes.swap(top_level.sizes);
+		for(auto it(context.states.begin()), end(context.states.end()); it != end; ++it) {
+			sizes.insert(sizes.end(), it->sizes.begin(), it->sizes.end());
+			std::vector<unsigned __int64>().swap(it->sizes);
+		}
+		util::parallel_radix_sort(sizes, [] (unsigned __int64 size) { return size; }, context.pool);
+		// each size that turns up more than once is written over the front of the list; empty files are never compared
+		size_t shared(0);
+		for(size_t first(0), last(0); first < sizes.size(); first = last) {
+			for(last = first + 1; last < sizes.size() && sizes[last] == sizes[first]; ++last) {
+			}
+			if(last - first > 1 && sizes[first] != 0) {
+				sizes[shared++] = sizes[first];
+			}
+		}
+		sizes.resize(shared);
+		std::vector<unsigned __int64>(sizes).swap(sizes);
+		return sizes;
+	}
+}
+
+unsigned __int64 populate_files(file_table& table, size_groups& files, link_map_type& links, const name_filter& filter, const std::vector<std::wstring>& sources, const scan_options& options, scan_statistics& statistics) {
+	size_t scan_threads(options.threads);
+	if(scan_threads == 0) {
+		SYSTEM_INFO system_info = {0};
+		::GetSystemInfo(&system_info);
+		scan_threads = system_info.dwNumberOfProcessors;
+	}
+	const bool indexed(!options.index_path.empty());
+	std::unique_ptr<scan_index> previous_index(indexed ? new scan_index(options.index_path) : nullptr);
+	// sizes that more than one file has, from a first pass; nothing else is kept from it
+	std::vector<unsigned __int64> wanted_sizes;
+	if(options.two_pass) {
+		shared_sizes(filter, sources, scan_threads, previous_index.get()).swap(wanted_sizes);
+	}
+	scan_context context(filter, scan_threads, previous_index.get(), indexed);
+	context.wanted_sizes = options.two_pass ? &wanted_sizes : nullptr;
+	worker_state top_level;
+	walk_sources(context, top_level, sources);
+
+	if(indexed) {
+		std::vector<const scan_index_builder*> parts;
+		for(auto it(context.states.cbegin()), end(context.states.cend()); it != end; ++it) {
+			statistics.directories_reused += it->directories_reused;
+			statistics.directories_enumerated += it->directories_enumerated;
+			parts.push_back(&it->index_builder);
+		}
+		// the old index has to be let go of before it can be replaced
+		previous_index.reset();
+		write_scan_index(options.index_path, parts);
+		for(auto it(context.states.begin()), end(context.states.end()); it != end; ++it) {
+			scan_index_builder().swap(it->index_builder);
+		}
+	}
+
+	unsigned __int64 count(0);
+	table.swap(context.directories);
+	size_t found_count(top_level.found.size());
+	for(auto it(context.states.cbegin()), end(context.states.cend()); it != end; ++it) {
+		found_count += it->found.size();
+	}
+	std::vector<found_file> all;
+	all.reserve(found_count);
+	auto merge_state = [&] (worker_state& state) {
+		count += state.count;
+		const file_table::file_index first(table.take_files(state.files));
+		for(auto it(state.found.cbegin()), end(state.found.cend()); it != end; ++it) {
+			found_file moved(*it);
+			moved.file += first;
+			all.push_back(moved);
+		}
+		std::vector<found_file>().swap(state.found);
+	};
+	merge_state(top_level);
+	std::for_each(context.states.begin(), context.states.end(), merge_state);
+
+	const size_t first_reference_source(sources.size() - std::min(options.reference_sources, sources.size()));
+	// one sort brings every size together; within a size, the files are put back into walk order
+	util::parallel_radix_sort(all, [] (const found_file& f) { return f.size; }, context.pool);
+	files.files.reserve(all.size());
+	for(auto it(all.begin()), end(all.end()); it != end;) {
+		auto run_end(it + 1);
+		while(run_end != end && run_end->size == it->size) {
+			++run_end;
+		}
+		// nothing to compare against, or nothing to compare
+		if(run_end - it == 1 || it->size == 0) {
+			it = run_end;
+			continue;
+		}
+		// the references are the last sources, so walk order puts their files at the end of the run
+		std::sort(it, run_end, &walk_order);
+		const size_groups::group group = { it->size, files.files.size(), 0, 0 };
+		size_t references(0);
+		// hard links are one file under several names, so only the first name found goes on to be compared, and the rest are kept alongside it
+		std::map<std::pair<unsigned __int64, unsigned __int64>, size_t> first_names;
+		for(; it != run_end; ++it) {
+			const file_table::file_record& record(table.file(it->file));
+			if(record.file_id != 0) {
+				const auto inserted(first_names.insert(std::make_pair(std::make_pair(table.directory(record.directory).volume, record.file_id), files.files.size())));
+				if(!inserted.second) {
+					links[files.files[inserted.first->second]].push_back(it->file);
+					continue;
+				}
+			}
+			files.files.push_back(it->file);
+			if(it->directory->front() >= first_reference_source) {
+				++references;
+			}
+		}
+		// a run that was all names for the same file leaves nothing to compare after all
+		if(files.files.size() - group.first == 1) {
+			links.erase(files.files.back());
+			files.files.pop_back();
+			continue;
+		}
+		// a size that only references have can't turn up anything that's wanted
+		if(references == files.files.size() - group.first) {
+			for(size_t i(group.first); i < files.files.size(); ++i) {
+				links.erase(files.files[i]);
+			}
+			files.files.resize(group.first);
+			continue;
+		}
+		files.groups.push_back(group);
+		files.groups.back().count = files.files.size() - group.first;
+		files.groups.back().references = references;
+	}
+	return count;
+}
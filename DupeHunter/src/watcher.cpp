@@ -0,0 +1,440 @@
+// watcher.cpp : keeps the duplicates up to date as files change, by comparing again only the size groups that changed
+//
+
+#include "stdafx.h"
+
+#include "watcher.hpp"
+#include "traversal.hpp"
+#include "scheduler.hpp"
+#include "name_filter.hpp"
+
+namespace {
+	// as large as notifications can be over the network
+	const DWORD notification_buffer_size(64 * 1024);
+	const DWORD notification_filter(FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+	// how long things must have been quiet for before changes are acted on; long enough for most writes to finish, short enough that new
+	// duplicates are reported within a few seconds
+	const DWORD settle_milliseconds(1000);
+	// a file that's written more often than the settle time, such as a log, would otherwise keep the changes from ever being looked at
+	const DWORD longest_settle_milliseconds(5000);
+
+	HANDLE stop_event(nullptr);
+
+	BOOL WINAPI on_console_control(DWORD type) {
+		switch(type) {
+		case CTRL_C_EVENT:
+		case CTRL_BREAK_EVENT:
+		case CTRL_CLOSE_EVENT:
+			::SetEvent(stop_event);
+			return TRUE;
+		default:
+			return FALSE;
+		}
+	}
+
+	std::wstring directory_prefix(const std::wstring& path) {
+		return path + (path[path.size() - 1] == L'\\' ? L"" : L"\\");
+	}
+
+	struct live_file {
+		unsigned __int64 size;
+		DWORD volume;
+		// 0 if it isn't known
+		unsigned __int64 file_id;
+	};
+
+	// every file under the sources that passes the filters, and which of them share each size
+	struct live_index {
+		// sorted, so that everything under a directory is together
+		std::map<std::wstring, live_file> files;
+		// the keys of files, whose nodes stay put for as long as they're in the map
+		std::unordered_map<unsigned __int64, std::vector<const std::wstring*> > by_size;
+		// sizes whose files have changed since the last time they were compared
+		std::set<unsigned __int64> touched;
+
+		void put(const std::wstring& path, const live_file& file) {
+			remove(path);
+			const auto inserted(files.insert(std::make_pair(path, file)));
+			// empty files are never compared
+			if(file.size != 0) {
+				by_size[file.size].push_back(&inserted.first->first);
+				touched.insert(file.size);
+			}
+		}
+
+		void remove(const std::wstring& path) {
+			const auto it(files.find(path));
+			if(it != files.end()) {
+				erase(it);
+			}
+		}
+
+		// the path, and everything under it if it was a directory
+		void remove_tree(const std::wstring& path) {
+			remove(path);
+			const std::wstring prefix(directory_prefix(path));
+			for(auto it(files.lower_bound(prefix)); it != files.end() && it->first.compare(0, prefix.size(), prefix) == 0;) {
+				erase(it++);
+			}
+		}
+
+	private:
+		void erase(std::map<std::wstring, live_file>::iterator it) {
+			const unsigned __int64 size(it->second.size);
+			if(size != 0) {
+				std::vector<const std::wstring*>& same_size(by_size[size]);
+				*std::find(same_size.begin(), same_size.end(), &it->first) = same_size.back();
+				same_size.pop_back();
+				if(same_size.empty()) {
+					by_size.erase(size);
+				}
+				touched.insert(size);
+			}
+			files.erase(it);
+		}
+	};
+
+	// the file's id is what tells hard links apart from copies, and takes opening the file to find out
+	live_file describe(const std::wstring& path, const WIN32_FILE_ATTRIBUTE_DATA& data) {
+		const live_file file = { (static_cast<unsigned __int64>(data.nFileSizeHigh) << 32) + static_cast<unsigned __int64>(data.nFileSizeLow), 0, 0 };
+		HANDLE handle(::CreateFileW(path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, 0, 0));
+		if(handle == INVALID_HANDLE_VALUE) {
+			return file;
+		}
+		ON_BLOCK_EXIT([=] { ::CloseHandle(handle); });
+		BY_HANDLE_FILE_INFORMATION info = {0};
+		if(FALSE == ::GetFileInformationByHandle(handle, &info)) {
+			return file;
+		}
+		const live_file identified = { file.size, info.dwVolumeSerialNumber, (static_cast<unsigned __int64>(info.nFileIndexHigh) << 32) | info.nFileIndexLow };
+		return identified;
+	}
+
+	bool permitted(const name_filter& filter, const std::wstring& path) {
+		const std::wstring::size_type separator(path.find_last_of(L'\\'));
+		const wchar_t* name(path.c_str() + (separator == std::wstring::npos ? 0 : separator + 1));
+		return filter.permitted(name, path.size() - (name - path.c_str()));
+	}
+
+	// puts everything under a directory that has just turned up into the index, without following junctions, as the scan doesn't
+	void add_tree(live_index& index, const name_filter& filter, const std::wstring& root) {
+		std::vector<std::wstring> pending(1, root);
+		while(!pending.empty()) {
+			const std::wstring prefix(directory_prefix(pending.back()));
+			pending.pop_back();
+			WIN32_FIND_DATAW data = {0};
+			HANDLE search(::FindFirstFileW((prefix + L"*").c_str(), &data));
+			if(search == INVALID_HANDLE_VALUE) {
+				std::wcerr << L"Could not enumerate directory " << prefix << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+				continue;
+			}
+			ON_BLOCK_EXIT([=] { ::FindClose(search); });
+			do {
+				const std::wstring name(data.cFileName);
+				if(name == L"." || name == L"..") {
+					continue;
+				}
+				if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+					if((data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0) {
+						pending.push_back(prefix + name);
+					}
+					continue;
+				}
+				if(filter.permitted(name.c_str(), name.size())) {
+					const WIN32_FILE_ATTRIBUTE_DATA attributes = { data.dwFileAttributes, data.ftCreationTime, data.ftLastAccessTime, data.ftLastWriteTime, data.nFileSizeHigh, data.nFileSizeLow };
+					index.put(prefix + name, describe(prefix + name, attributes));
+				}
+			}
+			while(FALSE != ::FindNextFileW(search, &data));
+		}
+	}
+
+	void apply_changes(live_index& index, const name_filter& filter, const directory_watcher::change_map_type& changes, const std::vector<std::wstring>& overflowed) {
+		// whatever the notifications missed could be anywhere under the directory, so all of it is taken to have changed
+		for(auto it(overflowed.cbegin()), end(overflowed.cend()); it != end; ++it) {
+			index.remove_tree(*it);
+			add_tree(index, filter, *it);
+		}
+		for(auto it(changes.cbegin()), end(changes.cend()); it != end; ++it) {
+			WIN32_FILE_ATTRIBUTE_DATA data = {0};
+			if(FALSE == ::GetFileAttributesExW(it->first.c_str(), GetFileExInfoStandard, &data)) {
+				index.remove_tree(it->first);
+				continue;
+			}
+			if(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+				// a directory that was already there only changes when its files do, and they have notifications of their own
+				if(it->second && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) == 0) {
+					add_tree(index, filter, it->first);
+				}
+				continue;
+			}
+			if(!permitted(filter, it->first)) {
+				index.remove(it->first);
+				continue;
+			}
+			index.put(it->first, describe(it->first, data));
+		}
+	}
+
+	typedef std::vector<std::vector<std::wstring> > path_sets_type;
+
+	// sets compare equal whatever order their files were found in
+	void normalise(path_sets_type& sets) {
+		for(auto it(sets.begin()), end(sets.end()); it != end; ++it) {
+			std::sort(it->begin(), it->end());
+		}
+		std::sort(sets.begin(), sets.end());
+	}
+
+	// the scan compares whichever name of a file with hard links it comes across first, where the watcher compares the first in order of path,
+	// so the scan's sets are put under the watcher's names; otherwise the first change to their groups would make them seem to have changed too
+	void use_first_names(const live_index& index, duplicate_index_type& duplicates) {
+		std::map<std::pair<DWORD, unsigned __int64>, const std::wstring*> first_names;
+		for(auto it(duplicates.cbegin()), end(duplicates.cend()); it != end; ++it) {
+			for(auto sit(it->second.cbegin()), send(it->second.cend()); sit != send; ++sit) {
+				for(auto pit(sit->cbegin()), pend(sit->cend()); pit != pend; ++pit) {
+					const auto file(index.files.find(*pit));
+					if(file != index.files.end() && file->second.file_id != 0) {
+						first_names.insert(std::make_pair(std::make_pair(file->second.volume, file->second.file_id), static_cast<const std::wstring*>(nullptr)));
+					}
+				}
+			}
+		}
+		if(first_names.empty()) {
+			return;
+		}
+		for(auto it(index.files.cbegin()), end(index.files.cend()); it != end; ++it) {
+			const auto first(first_names.find(std::make_pair(it->second.volume, it->second.file_id)));
+			if(first != first_names.end() && first->second == nullptr) {
+				first->second = &it->first;
+			}
+		}
+		for(auto it(duplicates.begin()), end(duplicates.end()); it != end; ++it) {
+			for(auto sit(it->second.begin()), send(it->second.end()); sit != send; ++sit) {
+				for(auto pit(sit->begin()), pend(sit->end()); pit != pend; ++pit) {
+					const live_file& file(index.files.find(*pit)->second);
+					if(file.file_id != 0) {
+						*pit = *first_names.find(std::make_pair(file.volume, file.file_id))->second;
+					}
+				}
+			}
+		}
+	}
+
+	// compares every touched size group again, as a table of its own with every file named by its full path
+	std::map<unsigned __int64, path_sets_type> compare_touched(const live_index& index, const watch_options& options) {
+		file_table table;
+		const file_table::directory_index top_level(table.add_directory(file_table::no_directory, L"", 0, 0, table.add_device(device_info())));
+		size_groups files;
+		for(auto sit(index.touched.cbegin()), send(index.touched.cend()); sit != send; ++sit) {
+			const auto same_size(index.by_size.find(*sit));
+			if(same_size == index.by_size.end() || same_size->second.size() < 2) {
+				continue;
+			}
+			std::vector<const std::wstring*> paths(same_size->second);
+			std::sort(paths.begin(), paths.end(), [] (const std::wstring* lhs, const std::wstring* rhs) {
+				return *lhs < *rhs;
+			});
+			// as in the scan, only the first name of a file with hard links is compared
+			std::set<std::pair<DWORD, unsigned __int64> > file_ids;
+			const size_groups::group g = { *sit, files.files.size(), 0, 0 };
+			for(auto it(paths.cbegin()), end(paths.cend()); it != end; ++it) {
+				const live_file& file(index.files.find(**it)->second);
+				if(file.file_id != 0 && !file_ids.insert(std::make_pair(file.volume, file.file_id)).second) {
+					continue;
+				}
+				files.files.push_back(table.add_file(top_level, (*it)->c_str(), (*it)->size(), file.size, file.file_id));
+			}
+			if(files.files.size() - g.first < 2) {
+				files.files.resize(g.first);
+				continue;
+			}
+			files.groups.push_back(g);
+			files.groups.back().count = files.files.size() - g.first;
+		}
+
+		std::map<unsigned __int64, path_sets_type> found;
+		if(files.groups.empty()) {
+			return found;
+		}
+		compare_groups(table, files, options.buffer_size, options.compare_threads, options.compare, [&] (unsigned __int64 file_size, size_t, const duplicate_sets_type& duplicates) {
+			path_sets_type& sets(found[file_size]);
+			for(auto it(duplicates.cbegin()), end(duplicates.cend()); it != end; ++it) {
+				std::vector<std::wstring> paths;
+				for(auto fit(it->cbegin()), fend(it->cend()); fit != fend; ++fit) {
+					paths.push_back(table.path_of(*fit));
+				}
+				sets.push_back(paths);
+			}
+		});
+		return found;
+	}
+}
+
+directory_watcher::directory_watcher(const std::vector<std::wstring>& sources) {
+	for(auto it(sources.cbegin()), end(sources.cend()); it != end; ++it) {
+		const DWORD attributes(::GetFileAttributesW(it->c_str()));
+		if(attributes == INVALID_FILE_ATTRIBUTES || (attributes & FILE_ATTRIBUTE_DIRECTORY) == 0) {
+			continue;
+		}
+		// one handle to wait on for each directory, and one for being told to stop
+		if(directories.size() + 1 == MAXIMUM_WAIT_OBJECTS) {
+			throw std::exception("too many sources to watch");
+		}
+		HANDLE handle(::CreateFileW(it->c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, 0));
+		if(handle == INVALID_HANDLE_VALUE) {
+			std::wcerr << L"Could not watch " << *it << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			continue;
+		}
+		directories.push_back(watched_directory());
+		watched_directory& directory(directories.back());
+		directory.path = *it;
+		directory.handle = handle;
+		std::memset(&directory.overlapped, 0, sizeof(directory.overlapped));
+		directory.overlapped.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+		directory.buffer.resize(notification_buffer_size / sizeof(unsigned __int64));
+		if(directory.overlapped.hEvent == nullptr) {
+			::CloseHandle(handle);
+			directories.pop_back();
+			throw std::exception("could not create an event to watch with");
+		}
+		if(!arm(directory)) {
+			std::wcerr << L"Could not watch " << *it << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			close(directory);
+			directories.pop_back();
+		}
+	}
+}
+
+directory_watcher::~directory_watcher() {
+	for(auto it(directories.begin()), end(directories.end()); it != end; ++it) {
+		// the read has to be over before its buffer goes away
+		::CancelIoEx(it->handle, &it->overlapped);
+		DWORD bytes(0);
+		::GetOverlappedResult(it->handle, &it->overlapped, &bytes, TRUE);
+		close(*it);
+	}
+}
+
+bool directory_watcher::arm(watched_directory& directory) {
+	::ResetEvent(directory.overlapped.hEvent);
+	return FALSE != ::ReadDirectoryChangesW(directory.handle, &directory.buffer[0], notification_buffer_size, TRUE, notification_filter, nullptr, &directory.overlapped, nullptr);
+}
+
+void directory_watcher::gather(const watched_directory& directory, DWORD bytes, change_map_type& changes) const {
+	const std::wstring prefix(directory_prefix(directory.path));
+	const unsigned __int8* position(reinterpret_cast<const unsigned __int8*>(&directory.buffer[0]));
+	const unsigned __int8* const end(position + bytes);
+	while(position < end) {
+		const FILE_NOTIFY_INFORMATION* info(reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(position));
+		bool& created(changes[prefix + std::wstring(info->FileName, info->FileNameLength / sizeof(wchar_t))]);
+		created = created || info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME;
+		if(info->NextEntryOffset == 0) {
+			break;
+		}
+		position += info->NextEntryOffset;
+	}
+}
+
+void directory_watcher::close(watched_directory& directory) {
+	::CloseHandle(directory.overlapped.hEvent);
+	::CloseHandle(directory.handle);
+}
+
+bool directory_watcher::wait(HANDLE stop, DWORD settle, DWORD longest, change_map_type& changes, std::vector<std::wstring>& overflowed) {
+	DWORD timeout(INFINITE);
+	// when the first change came in; the tick count wraps, but the difference between two readings is still right
+	DWORD first_change(0);
+	for(;;) {
+		std::vector<HANDLE> events(1, stop);
+		std::vector<std::list<watched_directory>::iterator> watched;
+		for(auto it(directories.begin()), end(directories.end()); it != end; ++it) {
+			events.push_back(it->overlapped.hEvent);
+			watched.push_back(it);
+		}
+		const DWORD signalled(::WaitForMultipleObjects(static_cast<DWORD>(events.size()), &events[0], FALSE, timeout));
+		if(signalled == WAIT_TIMEOUT) {
+			return true;
+		}
+		if(signalled == WAIT_OBJECT_0) {
+			changes.clear();
+			overflowed.clear();
+			return false;
+		}
+		if(signalled > WAIT_OBJECT_0 + watched.size()) {
+			throw std::exception("could not wait for changes");
+		}
+		watched_directory& directory(*watched[signalled - WAIT_OBJECT_0 - 1]);
+		DWORD bytes(0);
+		// a read that completes with nothing in it means that there were more changes than would fit, and they've been thrown away
+		if(FALSE == ::GetOverlappedResult(directory.handle, &directory.overlapped, &bytes, FALSE) || bytes == 0) {
+			overflowed.push_back(directory.path);
+		}
+		else {
+			gather(directory, bytes, changes);
+		}
+		if(!arm(directory)) {
+			std::wcerr << L"Could not keep watching " << directory.path << L" with error 0x" << std::hex << ::GetLastError() << std::dec << L", ignoring" << std::endl;
+			close(directory);
+			directories.erase(watched[signalled - WAIT_OBJECT_0 - 1]);
+		}
+		if(timeout == INFINITE) {
+			first_change = ::GetTickCount();
+		}
+		const DWORD waited(::GetTickCount() - first_change);
+		if(waited >= longest) {
+			return true;
+		}
+		timeout = std::min(settle, longest - waited);
+	}
+}
+
+void watch_for_changes(directory_watcher& watcher, const file_table& table, duplicate_index_type& duplicates, const name_filter& filter, const watch_options& options, std::wostream& status) {
+	live_index index;
+	for(file_table::file_index i(0); i < table.file_count(); ++i) {
+		const file_table::file_record& record(table.file(i));
+		const live_file file = { record.size, table.directory(record.directory).volume, record.file_id };
+		index.put(table.path_of(i), file);
+	}
+	index.touched.clear();
+	use_first_names(index, duplicates);
+	for(auto it(duplicates.begin()), end(duplicates.end()); it != end; ++it) {
+		normalise(it->second);
+	}
+
+	stop_event = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+	if(stop_event == nullptr) {
+		throw std::exception("could not create an event to stop watching with");
+	}
+	ON_BLOCK_EXIT([&] { ::CloseHandle(stop_event); stop_event = nullptr; });
+	::SetConsoleCtrlHandler(&on_console_control, TRUE);
+	ON_BLOCK_EXIT([&] { ::SetConsoleCtrlHandler(&on_console_control, FALSE); });
+
+	buffered_output output;
+	status << L"Watching for changes; press Ctrl+C to stop" << std::endl;
+	directory_watcher::change_map_type changes;
+	std::vector<std::wstring> overflowed;
+	while(watcher.wait(stop_event, settle_milliseconds, longest_settle_milliseconds, changes, overflowed)) {
+		apply_changes(index, filter, changes, overflowed);
+		status << L"Comparing " << index.touched.size() << L" size groups again after " << (changes.size() + overflowed.size()) << L" changes" << std::endl;
+		std::map<unsigned __int64, path_sets_type> found(compare_touched(index, options));
+		for(auto sit(index.touched.cbegin()), send(index.touched.cend()); sit != send; ++sit) {
+			path_sets_type& now(found[*sit]);
+			normalise(now);
+			path_sets_type& before(duplicates[*sit]);
+			path_sets_type gone, appeared;
+			std::set_difference(before.begin(), before.end(), now.begin(), now.end(), std::back_inserter(gone));
+			std::set_difference(now.begin(), now.end(), before.begin(), before.end(), std::back_inserter(appeared));
+			write_changed_sets(output, options.format, *sit, gone, false);
+			write_changed_sets(output, options.format, *sit, appeared, true);
+			before.swap(now);
+			if(before.empty()) {
+				duplicates.erase(*sit);
+			}
+		}
+		output.flush();
+		index.touched.clear();
+		changes.clear();
+		overflowed.clear();
+	}
+}